@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+
+'''
+Measure how many line commands per second bbctrl's Cmd encoder produces.
+Lines are random moves with a typical mix of axes, S-curve times and spindle
+speeds.  The per float encoder used before Cmd.Encoder is timed for
+comparison.  Run it on the target, e.g. a Raspberry Pi, for meaningful
+numbers.
+'''
+
+import os
+import sys
+import time
+import random
+import argparse
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '../src/py'))
+
+from bbctrl import Cmd
+
+
+# The encoder before Cmd.Encoder
+def encode_float(x):
+    import struct
+    import base64
+
+    return base64.b64encode(struct.pack('<f', x))[:-2].decode('utf-8')
+
+
+def encode_axes(axes):
+    data = ''
+    for axis in 'xyzabc':
+        if axis in axes:
+            data += axis + encode_float(axes[axis])
+
+    return data
+
+
+def old_line(target, exitVel, maxAccel, maxJerk, times, speeds, scale = None):
+    cmd = Cmd.LINE
+
+    cmd += encode_float(exitVel)
+    cmd += encode_float(maxAccel)
+    cmd += encode_float(maxJerk)
+    cmd += encode_axes(target)
+
+    for i in range(7):
+        if times[i]:
+            cmd += str(i) + encode_float(times[i] / 60000)
+
+    for dist, speed in speeds:
+        cmd += '\n' + Cmd.SYNC_SPEED + encode_float(dist) + encode_float(speed)
+
+    return bytes(cmd.strip() + '\n', 'utf-8')
+
+
+def new_line(*args):
+    return Cmd.encoder.line(*args).strip() + b'\n'
+
+
+def make_lines(count, axes, speeds):
+    rand = random.Random(1)
+    lines = []
+
+    for n in range(count):
+        target = {axis: rand.uniform(-500, 500) for axis in 'xyzabc'[:axes]}
+        times = [rand.uniform(0, 100) if i % 2 == 0 or rand.random() < 0.5
+                 else 0 for i in range(7)]
+        sync = [(rand.uniform(0, 10), rand.uniform(0, 24000))
+                for j in range(speeds)]
+
+        lines.append((target, rand.uniform(0, 5000), rand.uniform(1e5, 1e7),
+                      rand.uniform(1e7, 1e9), times, sync))
+
+    return lines
+
+
+def run(encode, lines, repeat):
+    start = time.process_time()
+
+    for i in range(repeat):
+        for line in lines: encode(*line)
+
+    return time.process_time() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description = __doc__)
+    parser.add_argument('-n', '--lines', default = 10000, type = int,
+                        help = 'Distinct lines to encode')
+    parser.add_argument('-r', '--repeat', default = 10, type = int,
+                        help = 'Times to encode the lines')
+    parser.add_argument('-a', '--axes', default = 3, type = int,
+                        help = 'Axes per line')
+    parser.add_argument('-s', '--speeds', default = 0, type = int,
+                        help = 'Sync speeds per line, at most 2')
+    args = parser.parse_args()
+
+    if not 0 <= args.axes <= 6: parser.error('--axes must be 0 to 6')
+    if not 0 <= args.speeds <= 2: parser.error('--speeds must be 0 to 2')
+
+    lines = make_lines(args.lines, args.axes, args.speeds)
+
+    for line in lines:
+        if old_line(*line) != new_line(*line):
+            sys.exit('Encoders differ on %s' % (line,))
+
+    count = args.lines * args.repeat
+
+    for name, encode in (('old', old_line), ('new', new_line)):
+        elapsed = run(encode, lines, args.repeat)
+        print('%s: %d lines, %.3fs CPU, %.0f lines/s, %.2fus per line' % (
+            name, count, elapsed, count / elapsed, elapsed / count * 1e6))
+
+
+if __name__ == '__main__': main()
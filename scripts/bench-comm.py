@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+
+'''
+Measure the CPU time bbctrl's Comm spends per AVR message by replaying a
+captured AVR output stream.  The capture may be bbemu's standard output or a
+bbctrl log, in which case the "I:Comm:> " lines are used.  Run it on the
+target, e.g. a Raspberry Pi, for meaningful numbers.
+'''
+
+import os
+import sys
+import time
+import json
+import argparse
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '../src/py'))
+
+from bbctrl.Log import Log
+from bbctrl.State import State
+from bbctrl.Comm import Comm
+
+
+class IOLoop(object):
+    '''Runs callbacks when told to, between chunks of input.'''
+
+    def __init__(self): self.callbacks = []
+
+
+    def call_later(self, delay, cb, *args, **kwargs):
+        # Ignore periodic timers, such as Comm's poll
+        if delay < 1: self.callbacks.append(lambda: cb(*args, **kwargs))
+
+
+    def add_callback(self, cb, *args, **kwargs):
+        self.call_later(0, cb, *args, **kwargs)
+
+
+    def run(self):
+        while self.callbacks:
+            callbacks, self.callbacks = self.callbacks, []
+            for cb in callbacks: cb()
+
+
+class AVR(object):
+    def set_handlers(self, read_cb, write_cb): self.read_cb = read_cb
+    def enable_write(self, enable): pass
+
+
+class BenchComm(Comm):
+    def comm_next(self): pass
+    def comm_error(self): pass
+    def comm_result(self, result): pass
+
+
+class Ctrl(object):
+    def __init__(self):
+        self.args = argparse.Namespace(demo = True, verbose = False)
+        self.ioloop = IOLoop()
+        self.log = Log(self.args, self.ioloop, None)
+        self.state = State(self)
+        self.avr = AVR()
+        self.comm = BenchComm(self, self.avr)
+
+
+    def ready(self): pass
+
+
+def load(path):
+    lines = []
+
+    with open(path, 'r') as f:
+        for line in f:
+            if line.startswith('I:Comm:> '): line = line[9:]
+            line = line.strip()
+            if not line.startswith('{'): continue
+
+            # Skip messages which need a live controller
+            msg = json.loads(line)
+            if 'firmware' in msg or 'variables' in msg: continue
+
+            lines.append(line)
+
+    return (('\n'.join(lines)) + '\n').encode('utf-8'), len(lines)
+
+
+def run(data, args):
+    chunks = [data[i:i + args.chunk] for i in range(0, len(data), args.chunk)]
+
+    # Log output goes to stdout
+    stdout = sys.stdout
+    sys.stdout = open(os.devnull, 'w')
+
+    try:
+        ctrl = Ctrl()
+        start = time.process_time()
+        reads = 0
+
+        for i in range(args.repeat):
+            for chunk in chunks:
+                ctrl.avr.read_cb(chunk)
+                reads += 1
+                if not reads % args.coalesce: ctrl.ioloop.run()
+
+        ctrl.ioloop.run()
+        ctrl.log.flush() # Include the deferred log formatting
+        return time.process_time() - start
+
+    finally:
+        sys.stdout.close()
+        sys.stdout = stdout
+
+
+def main():
+    parser = argparse.ArgumentParser(description = __doc__)
+    parser.add_argument('capture', help = 'AVR output or bbctrl log')
+    parser.add_argument('-r', '--repeat', default = 100, type = int,
+                        help = 'Times to replay the capture')
+    parser.add_argument('-c', '--chunk', default = 256, type = int,
+                        help = 'Bytes per read')
+    parser.add_argument('--coalesce', default = 1, type = int,
+                        help = 'Reads per IOLoop callback run')
+    args = parser.parse_args()
+
+    if args.coalesce < 1: parser.error('--coalesce must be at least 1')
+
+    data, count = load(args.capture)
+    if not count: sys.exit('No AVR messages found')
+
+    elapsed = run(data, args)
+    messages = count * args.repeat
+
+    print('%d messages, %d bytes per read, %.3fs CPU, %.1fus per message' % (
+        messages, args.chunk, elapsed, elapsed / messages * 1e6))
+
+
+if __name__ == '__main__': main()
@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+
+'''
+Measure bbctrl's reconnect-to-ready time against the emulated AVR.  A headless
+controller from the emulator farm connects to libbbemu, reboots the firmware
+and times, in simulated time, how long it takes from the reboot until the
+configuration has been applied and all vars have been dumped.  The
+configuration is sent in bulk commands and, for comparison, as one $ line per
+var as before bulk commands.  Requires libbbemu.so, see src/avr/emu.
+'''
+
+import os
+import sys
+import shutil
+import argparse
+import tempfile
+
+emu = os.path.join(os.path.dirname(__file__), '../src/avr/emu')
+sys.path.insert(0, emu)
+
+import farm
+
+
+def reconnect(root, bulk):
+    ctrl = farm.FarmCtrl(root, None)
+    loop, mach, state = ctrl.ioloop, ctrl.mach, ctrl.state
+
+    if not bulk: mach.begin_bulk = mach.end_bulk = lambda: None
+
+    try:
+        def ready(): return ctrl.is_ready and not mach.reloading
+        if not loop.run(ready, 60): raise Exception('Not ready after connect')
+
+        # Count commands written from the reboot
+        commands = []
+        prep = mach._prep_command
+        def _prep(cmd):
+            commands.append(cmd)
+            return prep(cmd)
+        mach._prep_command = _prep
+
+        # The dump follows the configuration, only it reports most vars
+        dumped = []
+        update_vars, update = mach._update_vars, mach._update_state
+        def _update_vars(msg):
+            dumped.clear()
+            update_vars(msg)
+        def _update(msg):
+            if len(state.machine_var_set) < 2 * len(msg):
+                dumped.append(loop.time)
+            update(msg)
+        mach._update_vars, mach._update_state = _update_vars, _update
+
+        mach.reboot()
+        start = loop.time
+
+        def configured(): return len(dumped) and not mach.reloading
+        if not loop.run(configured, start + 60):
+            raise Exception('Not ready after reboot')
+
+        size = sum(len(cmd) + 1 for cmd in commands)
+        return loop.time - start, len(commands), size
+
+    finally: ctrl.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description = __doc__)
+    parser.add_argument('-c', '--config', help = 'Controller config.json')
+    parser.add_argument('-n', '--count', default = 3, type = int,
+                        help = 'Reconnects to time')
+    args = parser.parse_args()
+
+    # The host log prints to stdout
+    out = sys.stdout
+    sys.stdout = open(os.devnull, 'w')
+
+    with tempfile.TemporaryDirectory(prefix = 'bbconnect-') as root:
+        if args.config: shutil.copy(args.config, root + '/config.json')
+
+        for name, bulk in (('text', False), ('bulk', True)):
+            times = []
+
+            for i in range(args.count):
+                t, count, size = reconnect(root, bulk)
+                times.append(t)
+
+            out.write('%s: %d commands, %d bytes, %.0fms reconnect to ready\n'
+                      % (name, count, size, min(times) * 1000))
+
+
+if __name__ == '__main__': main()
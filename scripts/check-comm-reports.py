@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+
+'''
+Check that state transitions reported together by the AVR are each handled.
+A headless controller from the emulator farm is given a HOLDING report
+followed by a READY report in one serial read, as happens when a hold ends
+quickly, and fails unless Mach handled the HOLDING state by flushing the
+command queue.  Requires libbbemu.so, see src/avr/emu.
+'''
+
+import os
+import sys
+import json
+import tempfile
+
+emu = os.path.join(os.path.dirname(__file__), '../src/avr/emu')
+sys.path.insert(0, emu)
+
+import farm
+from bbctrl import Cmd
+
+
+def check(root):
+    ctrl = farm.FarmCtrl(root, None)
+    loop, state, mach = ctrl.ioloop, ctrl.state, ctrl.mach
+    errors = []
+
+    try:
+        if not loop.run(lambda: ctrl.is_ready and not mach.stopping, 60):
+            raise Exception('Controller did not become ready')
+
+        # Record I2C commands
+        commands = []
+        i2c_command = ctrl.avr.i2c_command
+        def _i2c_command(cmd, *args):
+            commands.append(cmd)
+            i2c_command(cmd, *args)
+        ctrl.avr.i2c_command = _i2c_command
+
+        xc = state.get('xc', 0)
+        reports = [dict(xx = 'HOLDING', xc = xc + 1, pr = 'User pause'),
+                   dict(xx = 'READY', xc = xc + 2)]
+        mach._read(b''.join(json.dumps(r).encode('utf-8') + b'\n'
+                            for r in reports))
+        loop.run(lambda: False, loop.time + 1)
+
+        if Cmd.FLUSH not in commands:
+            errors.append('HOLDING not handled, sent %s' % commands)
+
+        if state.get('xx') != 'READY':
+            errors.append('Ended in %s, not READY' % state.get('xx'))
+
+    finally: ctrl.close()
+
+    return errors + ctrl.errors
+
+
+def main():
+    # The host log prints to stdout
+    out = sys.stdout
+    sys.stdout = open(os.devnull, 'w')
+
+    with tempfile.TemporaryDirectory(prefix = 'bbcheck-') as root:
+        errors = check(root)
+
+    for error in errors: out.write(error + '\n')
+    out.write('%s\n' % ('FAILED' if errors else 'OK'))
+    return 1 if errors else 0
+
+
+if __name__ == '__main__': sys.exit(main())
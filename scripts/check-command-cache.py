@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+
+'''
+Check that a program streamed from the command cache runs as when planned
+live.  A headless controller from the emulator farm runs a G-code file live,
+so that planner IDs have advanced, then again from a command cache planned by
+plan.py as the Preplanner would and paused part way, which replaces the cache
+with live planning, then live once more.  Fails if the block resent after the
+pause is not the cached block with the same ID, if the firmware reports IDs
+out of order or if a run ends at a different position.  Requires libbbemu.so,
+see src/avr/emu.
+'''
+
+import os
+import sys
+import json
+import shutil
+import argparse
+import tempfile
+import subprocess
+
+emu = os.path.join(os.path.dirname(__file__), '../src/avr/emu')
+py = os.path.join(os.path.dirname(__file__), '../src/py')
+sys.path.insert(0, emu)
+
+import farm
+from bbctrl import util
+
+
+class Preplanner:
+    def __init__(self): self.path = None
+    def get_commands(self, path): return self.path
+
+
+def plan_commands(ctrl, gcode, dir):
+    state = ctrl.state
+    config = ctrl.mach.planner.get_config(True, False)
+    del config['default-units']
+
+    start = dict(position = state.get_position(),
+                 units = 'METRIC' if state.get('metric') else 'IMPERIAL')
+
+    # Run plan.py from this tree
+    path = os.environ.get('PYTHONPATH')
+    env = dict(os.environ, PYTHONPATH = py + (':' + path if path else ''))
+
+    subprocess.run((sys.executable, py + '/bbctrl/plan.py',
+                    os.path.abspath(gcode), json.dumps(state.snapshot()),
+                    json.dumps(config), '--commands=' + json.dumps(start)),
+                   cwd = dir, env = env, check = True,
+                   stdout = subprocess.DEVNULL)
+
+    path = dir + '/commands.gz'
+    if not os.path.exists(path): raise Exception('Program was not cached')
+    return path
+
+
+def same_block(a, b):
+    if a['type'] != b['type'] or a['id'] != b['id']: return False
+    if a['type'] != 'line': return a == b
+
+    target = a['target']
+    return set(target) == set(b['target']) and \
+        all(abs(target[axis] - b['target'][axis]) < 0.001 for axis in target)
+
+
+def check(root, gcode, pause):
+    ctrl = farm.FarmCtrl(root, None)
+    loop, state, mach = ctrl.ioloop, ctrl.state, ctrl.mach
+    planner = mach.planner
+    errors = []
+
+    ctrl.args.disable_command_cache = False
+    ctrl.preplanner = Preplanner()
+
+    # Record blocks as they are sent and the first one after a restart
+    sent = {}
+    restarted = []
+    apply, restart = planner._apply, planner.restart
+
+    def _apply(block):
+        if not restarted: sent[block['id'] & 0xffff] = block
+        elif restarted[-1] is None: restarted[-1] = block
+        apply(block)
+
+    def _restart():
+        restarted.append(None)
+        restart()
+
+    planner._apply, planner.restart = _apply, _restart
+
+    # The firmware reports IDs as it executes them
+    release = planner.cmdq.release
+    def _release(id):
+        if id and not util.id16_less(planner.cmdq.releaseID, id):
+            errors.append('ID %d out of order after %d' %
+                          (id, planner.cmdq.releaseID))
+        release(id)
+    planner.cmdq.release = _release
+
+    def unpause(update):
+        if state.get('xx') == 'HOLDING' and state.get('pr') == 'User pause':
+            loop.add_callback(mach.unpause)
+    state.add_listener(unpause)
+
+    def idle():
+        return state.get('cycle') == 'idle' and \
+            state.get('xx') in ('READY', 'ESTOPPED')
+
+    def run(pause = None):
+        start = loop.time
+        mach.start(os.path.abspath(gcode))
+
+        if pause is not None:
+            if planner.cache is None: raise Exception('Cache not used')
+            loop.run(lambda: False, start + pause)
+            mach.pause()
+
+        if not loop.run(idle, start + 24 * 60 * 60):
+            raise Exception('Program did not end')
+
+        return loop.time - start, state.get_position()
+
+    try:
+        if not loop.run(lambda: ctrl.is_ready and not mach.stopping, 60):
+            raise Exception('Controller did not become ready')
+
+        t, position = run()
+
+        with tempfile.TemporaryDirectory(prefix = 'bbcache-') as dir:
+            ctrl.preplanner.path = plan_commands(ctrl, gcode, dir)
+            sent.clear()
+            results = [run(t * pause)]
+            ctrl.preplanner.path = None
+
+        results.append(run())
+
+        if len(restarted) != 1 or restarted[0] is None:
+            errors.append('Pause did not restart the cached program')
+
+        else:
+            block = restarted[0]
+            cached = sent.get(block['id'] & 0xffff)
+            if cached is None or not same_block(cached, block):
+                errors.append('Resumed %s, cached %s' % (block, cached))
+
+        for i, (_, p) in enumerate(results):
+            for axis, value in position.items():
+                if 0.001 < abs(p.get(axis, 0) - value):
+                    errors.append('Run %d ended at %s, not %s' %
+                                  (i + 2, p, position))
+                    break
+
+    finally: ctrl.close()
+
+    return errors + ctrl.errors
+
+
+def main():
+    parser = argparse.ArgumentParser(description = __doc__)
+    parser.add_argument('gcode', help = 'G-code file to run')
+    parser.add_argument('-c', '--config', help = 'Controller config.json')
+    parser.add_argument('-p', '--pause', default = 0.5, type = float,
+                        help = 'Pause the cached run after this fraction of '
+                        'the live run time')
+    args = parser.parse_args()
+
+    # The host log prints to stdout
+    out = sys.stdout
+    sys.stdout = open(os.devnull, 'w')
+
+    with tempfile.TemporaryDirectory(prefix = 'bbcheck-') as root:
+        if args.config: shutil.copy(args.config, root + '/config.json')
+
+        errors = check(root, args.gcode, args.pause)
+
+    for error in errors: out.write(error + '\n')
+    out.write('%s\n' % ('FAILED' if errors else 'OK'))
+    return 1 if errors else 0
+
+
+if __name__ == '__main__': sys.exit(main())
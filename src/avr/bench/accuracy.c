@@ -0,0 +1,474 @@
+/******************************************************************************\
+
+                  This file is part of the Buildbotics firmware.
+
+         Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.
+
+          This Source describes Open Hardware and is licensed under the
+                                  CERN-OHL-S v2.
+
+          You may redistribute and modify this Source and make products
+     using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).
+            This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED
+     WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS
+      FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable
+                                   conditions.
+
+                 Source location: https://github.com/buildbotics
+
+       As per CERN-OHL-S v2 section 4, should You produce hardware based on
+     these sources, You must maintain the Source Location clearly visible on
+     the external case of the CNC Controller or other product you make using
+                                   this Source.
+
+                 For more information, email info@buildbotics.com
+
+\******************************************************************************/
+
+// S-curve accuracy harness.  Randomized chains of line commands are run
+// through the firmware's line.c and SCurve kernels and every segment they
+// emit is compared against a long double evaluation of the same profile.
+// line.c is built with exec_segment() renamed so the segments can be captured
+// here before being passed on to the real exec.
+
+#include <config.h>
+#include <command.h>
+#include <exec.h>
+#include <motor.h>
+#include <state.h>
+#include <base64.h>
+#include <status.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+
+
+void main_init(int argc, char *argv[]);
+stat_t command_line(char *cmd);
+stat_t command_resume(char *cmd);
+void __RTC_OVF_vect();
+
+
+#define PROFILES       1000   // Default number of random line chains
+#define CHAIN_MAX      24     // Lines per chain, fits the sync queue
+
+// Limits for --check, a few times the errors of the current kernels
+#define CHECK_POSITION 0.02   // mm
+#define CHECK_VELOCITY 0.5    // mm/min
+#define CHECK_END      0.02   // mm
+
+
+typedef struct {
+  float start[3];
+  float target[3];
+  float times[7];
+  float vel;
+  float accel;
+  float jerk;
+
+  // Long double reference
+  long double unit[3];
+  long double length;
+  long double secT[8]; // Section start times
+  long double secD[7]; // Section initial distance
+  long double secV[7]; // Section initial velocity
+  long double secA[7]; // Section initial acceleration
+  long double secJ[7]; // Section jerk
+} ref_line_t;
+
+
+typedef struct {
+  double *values;
+  unsigned count;
+  unsigned size;
+
+  double max;
+  unsigned worstProfile;
+  unsigned worstLine;
+} dist_t;
+
+
+static struct {
+  uint32_t seed;
+  unsigned profile;
+
+  ref_line_t lines[CHAIN_MAX];
+  unsigned count;
+
+  int current;        // Line being executed
+  long double t;      // Time into the current line
+  float lastTarget[3];
+  long double lastD;  // Reference distance at the last segment
+  unsigned segments;
+
+  dist_t position;
+  dist_t velocity;
+  dist_t end;
+} acc;
+
+
+static double _random(double min, double max) {
+  acc.seed = acc.seed * 1664525 + 1013904223; // Fixed sequence per seed
+  return min + (max - min) * (acc.seed >> 8) / (double)(1 << 24);
+}
+
+
+static void _record(dist_t *d, double value) {
+  if (d->count == d->size) {
+    d->size = d->size ? d->size * 2 : 4096;
+    d->values = (double *)realloc(d->values, d->size * sizeof(double));
+    if (!d->values) {perror("accuracy"); exit(1);}
+  }
+
+  d->values[d->count++] = value;
+
+  if (d->max < value || !isfinite(value)) {
+    d->max = value;
+    d->worstProfile = acc.profile;
+    d->worstLine = acc.current;
+  }
+}
+
+
+/******************************************************************************/
+// Reference
+
+/// Section jerk and initial acceleration follow line.c, velocity and distance
+/// are carried across sections in long double.
+static void _ref_init(ref_line_t *l, long double v) {
+  long double length = 0;
+  for (int axis = 0; axis < 3; axis++) {
+    l->unit[axis] = (long double)l->target[axis] - l->start[axis];
+    length += l->unit[axis] * l->unit[axis];
+  }
+
+  l->length = sqrtl(length);
+  for (int axis = 0; axis < 3; axis++)
+    if (l->length) l->unit[axis] /= l->length;
+
+  long double t = 0, d = 0;
+  for (int i = 0; i < 7; i++) {
+    long double j =
+      i == 0 || i == 6 ? l->jerk : i == 2 || i == 4 ? -l->jerk : 0;
+    long double a =
+      i == 1 || i == 2 ? (long double)l->jerk * l->times[0] :
+      i == 5 || i == 6 ? -(long double)l->jerk * l->times[4] : 0;
+    long double st = l->times[i];
+
+    l->secT[i] = t;
+    l->secD[i] = d;
+    l->secV[i] = v;
+    l->secA[i] = a;
+    l->secJ[i] = j;
+
+    d += st * (v + st * (a / 2 + j * st / 6));
+    v += st * (a + j * st / 2);
+    t += st;
+  }
+
+  l->secT[7] = t;
+}
+
+
+static void _ref_eval(const ref_line_t *l, long double t, long double *d,
+                      long double *v) {
+  int i = 6;
+  while (0 < i && (t < l->secT[i] || !l->times[i])) i--;
+
+  long double st = t - l->secT[i];
+  long double a = l->secA[i], j = l->secJ[i];
+  *d = l->secD[i] + st * (l->secV[i] + st * (a / 2 + j * st / 6));
+  *v = l->secV[i] + st * (a + j * st / 2);
+}
+
+
+/// Section times of a jerk limited velocity change
+static void _ramp(double dv, double accel, double jerk, float times[3]) {
+  if (dv <= 0) return;
+
+  if (dv <= accel * accel / jerk) times[0] = times[2] = sqrt(dv / jerk);
+  else {
+    times[0] = times[2] = accel / jerk;
+    times[1] = (dv - accel * accel / jerk) / accel;
+  }
+}
+
+
+/******************************************************************************/
+// Profiles
+
+static void _encode_float(char *s, float x) {
+  b64_encode((const uint8_t *)&x, 4, s, false);
+  s[6] = 0;
+}
+
+
+static void _command(stat_t (*cb)(char *), char *cmd) {
+  stat_t status = cb(cmd);
+  if (status) {
+    fprintf(stderr, "Command failed: %s\n", status_to_pgmstr(status));
+    exit(1);
+  }
+}
+
+
+static void _push_line(ref_line_t *l) {
+  char cmd[INPUT_BUFFER_LEN];
+  char *s = cmd;
+
+  *s++ = COMMAND_line;
+  const float values[] = {l->vel, l->accel, l->jerk};
+  for (int i = 0; i < 3; i++, s += 6) _encode_float(s, values[i]);
+
+  for (int axis = 0; axis < 3; axis++) {
+    *s++ = "xyz"[axis];
+    _encode_float(s, l->target[axis]);
+    s += 6;
+  }
+
+  for (int i = 0; i < 7; i++)
+    if (l->times[i]) {
+      *s++ = '0' + i;
+      _encode_float(s, l->times[i]);
+      s += 6;
+    }
+
+  *s = 0;
+  _command(command_line, cmd);
+}
+
+
+/// A chain of lines from a stop to a stop.  Velocity is in mm/min, accel in
+/// mm/min^2, jerk in mm/min^3 and times in minutes.
+static void _profile() {
+  memset(acc.lines, 0, sizeof(acc.lines));
+  acc.count = 1 + _random(0, CHAIN_MAX);
+  if (CHAIN_MAX < acc.count) acc.count = CHAIN_MAX;
+
+  // Start far from the origin so positions lose float precision
+  float position[AXES] = {0};
+  for (int axis = 0; axis < 3; axis++) position[axis] = _random(-1000, 1000);
+  command_set_position(position);
+
+  double jerk = pow(10, _random(7, 10));
+  double accel = pow(10, _random(5, 6.5));
+  float v = 0;
+
+  for (unsigned i = 0; i < acc.count; i++) {
+    ref_line_t *l = &acc.lines[i];
+    bool last = i == acc.count - 1;
+
+    double peak = _random(10, 10000);
+    if (v && _random(0, 1) < 0.2) peak = v; // Enter at peak velocity
+    if (peak < v) peak = v;
+    double exit = last ? 0 : peak * _random(0.05, 1);
+
+    _ramp(peak - v, accel, jerk, l->times);
+    if (_random(0, 1) < 0.75) l->times[3] = _random(0, 0.01);
+    _ramp(peak - exit, accel, jerk, l->times + 4);
+
+    bool moving = false;
+    for (int j = 0; j < 7; j++) if (l->times[j]) moving = true;
+    if (!moving) l->times[3] = _random(0.001, 0.01);
+
+    l->vel = exit;
+    l->jerk = jerk;
+    l->accel = accel;
+
+    // Length of the profile in a random direction, quantized like the planner
+    memcpy(l->start, position, sizeof(l->start));
+    memcpy(l->target, position, sizeof(l->target));
+    _ref_init(l, v);
+    long double length;
+    long double endV;
+    _ref_eval(l, l->secT[7], &length, &endV);
+
+    double dir[3], norm = 0;
+    for (int axis = 0; axis < 3; axis++) {
+      dir[axis] = _random(-1, 1);
+      norm += dir[axis] * dir[axis];
+    }
+    norm = sqrt(norm);
+
+    for (int axis = 0; axis < 3; axis++)
+      l->target[axis] = l->start[axis] + length * dir[axis] / norm;
+
+    _ref_init(l, v);
+    memcpy(position, l->target, sizeof(l->target));
+    v = l->vel;
+
+    _push_line(l);
+  }
+}
+
+
+/******************************************************************************/
+// Capture
+
+stat_t accuracy_exec_segment(float time, const float target[], float vel,
+                             float accel, float maxAccel, float maxJerk,
+                             const power_update_t power_updates[]) {
+  int line = acc.count - command_get_count() - 1;
+
+  if (line != acc.current) {
+    acc.current = line;
+    acc.t = 0;
+    acc.lastD = 0;
+    memcpy(acc.lastTarget, acc.lines[line].start, sizeof(acc.lastTarget));
+  }
+
+  const ref_line_t *l = &acc.lines[line];
+  acc.t += time;
+  acc.segments++;
+
+  long double d, v;
+  _ref_eval(l, acc.t, &d, &v);
+  if (l->length < d) d = l->length;
+
+  // Only the last segment of a line passes the exact target and velocity
+  bool last = vel == l->vel && !memcmp(target, l->target, sizeof(l->target));
+
+  if (!last) {
+    long double err = 0;
+    for (int axis = 0; axis < 3; axis++) {
+      long double e = target[axis] - (l->start[axis] + l->unit[axis] * d);
+      err += e * e;
+    }
+
+    _record(&acc.position, sqrtl(err));
+    _record(&acc.velocity, fabsl(vel - v));
+
+  } else {
+    // Last segment snaps to the target, compare its length to the reference
+    long double seg = 0;
+    for (int axis = 0; axis < 3; axis++) {
+      long double e = (long double)target[axis] - acc.lastTarget[axis];
+      seg += e * e;
+    }
+
+    _record(&acc.end, fabsl(sqrtl(seg) - (l->length - acc.lastD)));
+  }
+
+  memcpy(acc.lastTarget, target, sizeof(acc.lastTarget));
+  acc.lastD = d;
+
+  return exec_segment(time, target, vel, accel, maxAccel, maxJerk,
+                      power_updates);
+}
+
+
+static void _run_profile() {
+  // Let the exec start without waiting for the queue to fill
+  for (int i = 0; i <= EXEC_DELAY / 4; i++) __RTC_OVF_vect();
+
+  acc.current = -1;
+  _profile();
+
+  while (true) {
+    stat_t status = exec_next();
+    if (status == STAT_NOP) break;
+
+    // Consume the prepped move
+    if (status == STAT_OK)
+      for (int motor = 0; motor < MOTORS; motor++) motor_load_move(motor);
+  }
+
+  if (command_get_count() || state_get() != STATE_READY) {
+    fprintf(stderr, "Profile %u did not complete\n", acc.profile);
+    exit(1);
+  }
+}
+
+
+/******************************************************************************/
+// Output
+
+static int _compare(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : y < x;
+}
+
+
+static void _print_dist(FILE *f, const char *name, dist_t *d) {
+  qsort(d->values, d->count, sizeof(double), _compare);
+
+  double sum = 0;
+  for (unsigned i = 0; i < d->count; i++) sum += d->values[i];
+
+  fprintf(f, "\"%s\":{\"count\":%u,\"mean\":%.3g", name, d->count,
+          d->count ? sum / d->count : 0);
+
+  const double pct[] = {50, 90, 99, 99.9};
+  const char *names[] = {"p50", "p90", "p99", "p999"};
+  for (int i = 0; i < 4; i++)
+    fprintf(f, ",\"%s\":%.3g", names[i], d->count ?
+            d->values[(unsigned)(pct[i] / 100 * (d->count - 1))] : 0);
+
+  fprintf(f, ",\"max\":%.3g,\"worst\":{\"profile\":%u,\"line\":%u}}", d->max,
+          d->worstProfile, d->worstLine);
+}
+
+
+static bool _check(const char *name, const dist_t *d, double limit) {
+  if (d->max <= limit) return true;
+
+  fprintf(stderr, "%s error %g exceeds %g, profile %u line %u\n", name,
+          d->max, limit, d->worstProfile, d->worstLine);
+  return false;
+}
+
+
+int main(int argc, char *argv[]) {
+  unsigned profiles = PROFILES;
+  bool check = false;
+  acc.seed = 1;
+
+  for (int i = 1; i < argc; i++)
+    if (!strcmp(argv[i], "--check")) check = true;
+    else if (!strcmp(argv[i], "--profiles") && i + 1 < argc)
+      profiles = strtoul(argv[++i], 0, 0);
+    else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+      acc.seed = strtoul(argv[++i], 0, 0);
+    else {
+      fprintf(stderr,
+              "Usage: %s [--profiles N] [--seed N] [--check]\n", argv[0]);
+      return 1;
+    }
+
+  // Keep firmware output off of the results
+  FILE *out = fdopen(dup(1), "w");
+  if (!freopen("/dev/null", "w", stdout)) return 1;
+
+  char *args[] = {(char *)"bbaccuracy", 0};
+  main_init(1, args);
+
+  // Leave the initial flushing state
+  char resume[] = "c";
+  _command(command_resume, resume);
+  state_callback();
+
+  uint32_t seed = acc.seed;
+  for (acc.profile = 0; acc.profile < profiles; acc.profile++)
+    _run_profile();
+
+  fprintf(out, "{\"seed\":%u,\"profiles\":%u,\"segments\":%u,", seed, profiles,
+          acc.segments);
+  _print_dist(out, "position", &acc.position);
+  fprintf(out, ",");
+  _print_dist(out, "velocity", &acc.velocity);
+  fprintf(out, ",");
+  _print_dist(out, "end", &acc.end);
+  fprintf(out, "}\n");
+  fflush(out);
+
+  if (check && !(_check("Position", &acc.position, CHECK_POSITION) &
+                 _check("Velocity", &acc.velocity, CHECK_VELOCITY) &
+                 _check("End", &acc.end, CHECK_END)))
+    return 1;
+
+  return 0;
+}
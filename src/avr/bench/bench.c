@@ -0,0 +1,845 @@
+/******************************************************************************\
+
+                  This file is part of the Buildbotics firmware.
+
+         Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.
+
+          This Source describes Open Hardware and is licensed under the
+                                  CERN-OHL-S v2.
+
+          You may redistribute and modify this Source and make products
+     using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).
+            This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED
+     WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS
+      FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable
+                                   conditions.
+
+                 Source location: https://github.com/buildbotics
+
+       As per CERN-OHL-S v2 section 4, should You produce hardware based on
+     these sources, You must maintain the Source Location clearly visible on
+     the external case of the CNC Controller or other product you make using
+                                   this Source.
+
+                 For more information, email info@buildbotics.com
+
+\******************************************************************************/
+
+// Host microbenchmarks for the motion kernels.  Kernels are timed natively
+// and, with --count, single stepped under ptrace to count the executed float
+// instructions and kernel calls as a proxy for AVR soft-float cost.
+
+#include <config.h>
+#include <command.h>
+#include <stepper.h>
+#include <motor.h>
+#include <state.h>
+#include <base64.h>
+#include <SCurve.h>
+#include <status.h>
+#include <spindle.h>
+
+#include <avr/io.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+
+void main_init(int argc, char *argv[]);
+void motor_emulate_steps(int motor);
+
+stat_t command_var(char *cmd);
+stat_t command_line(char *cmd);
+stat_t command_raster(char *cmd);
+stat_t command_resume(char *cmd);
+
+void __STEP_LOW_LEVEL_ISR();
+void __STEP_TIMER_ISR();
+void __STEP_TIMER_CCA_ISR();
+void __STEP_TIMER_CCB_ISR();
+void __STEP_TIMER_CCC_ISR();
+void __RTC_OVF_vect();
+
+
+#define KERNEL_OPS     100000 // Timed calls per kernel
+#define COUNT_OPS      32     // Single stepped calls per kernel
+#define COUNT_STRIDE   128    // Single step one in N move mix exec calls
+#define QUEUE_LINES    24     // Lines kept queued while running a mix
+#define RASTER_SCALE   10000
+
+
+// Float instruction classes
+typedef enum {
+  FLOP_ADD, FLOP_MUL, FLOP_DIV, FLOP_SQRT, FLOP_CMP, FLOP_CVT, FLOP_FMA,
+  FLOP_COUNT, FLOP_NONE = FLOP_COUNT
+} flop_t;
+
+static const char *flop_names[] = {
+  "add", "mul", "div", "sqrt", "cmp", "cvt", "fma",
+};
+
+
+// Kernels whose calls are counted
+static const char *call_names[] = {
+  "b64_decode_float", "SCurve::stoppingDist", "SCurve::nextAccel",
+  "SCurve::distance", "SCurve::velocity", "SCurve::acceleration",
+  "command_line", "_line_exec", "exec_segment", "motor_prep_move",
+  "spindle_power_update",
+};
+
+#define CALL_COUNT (sizeof(call_names) / sizeof(call_names[0]))
+
+
+typedef struct {
+  const char *name;
+  bool mix;
+
+  // Timing
+  uint64_t ops;
+  uint64_t ns;
+  unsigned lines;
+  uint64_t ms;        // Simulated time
+
+  // Counts
+  uint64_t counted;   // Single stepped ops
+  uint64_t insns;
+  uint64_t flops[FLOP_COUNT];
+  uint64_t calls[CALL_COUNT];
+} result_t;
+
+
+#define RESULT_MAX 16
+
+static struct {
+  bool counting;      // Running under ptrace
+  volatile int slot;  // Current result, read by the tracer
+  uint64_t ticks;
+  uint64_t calls;     // Step exec calls while counting
+  unsigned input;
+
+  result_t results[RESULT_MAX];
+  unsigned count;
+
+  float inputs[1024][6];
+  char encoded[1024][8];
+} bench;
+
+
+static uint64_t _now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static float _random(float min, float max) {
+  static uint32_t x = 1;
+  x = x * 1664525 + 1013904223; // Fixed sequence for repeatable runs
+  return min + (max - min) * (x >> 8) / (float)(1 << 24);
+}
+
+
+// Results are registered in the same order by the counting and timing runs
+static result_t *_result(const char *name, bool mix) {
+  result_t *r = &bench.results[bench.count++];
+  r->name = name;
+  r->mix = mix;
+  return r;
+}
+
+
+// Brackets one op.  Under ptrace the signals start and stop single stepping.
+static uint64_t _begin(result_t *r) {
+  if (bench.counting) {
+    bench.slot = r - bench.results;
+    raise(SIGUSR1);
+  }
+
+  return _now();
+}
+
+
+static void _end(result_t *r, uint64_t start) {
+  uint64_t ns = _now() - start;
+
+  if (bench.counting) raise(SIGUSR2);
+  else {
+    r->ops++;
+    r->ns += ns;
+  }
+}
+
+
+static void _encode_float(char *s, float x) {
+  b64_encode((const uint8_t *)&x, 4, s, false);
+  s[6] = 0;
+}
+
+
+static void _command(stat_t (*cb)(char *), const char *cmd) {
+  char buf[INPUT_BUFFER_LEN];
+  strncpy(buf, cmd, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = 0;
+
+  stat_t status = cb(buf);
+  if (status) {
+    fprintf(stderr, "Command failed: %s: %s\n", status_to_pgmstr(status),
+            cmd);
+    exit(1);
+  }
+}
+
+
+static void _init() {
+  char *argv[] = {(char *)"bbbench", 0};
+  main_init(1, argv);
+
+  for (int motor = 0; motor < 3; motor++) {
+    const char *vars[] = {"me=1", "sa=1.8", "tr=5", "mi=32", "vm=10", 0};
+
+    for (int i = 0; vars[i]; i++) {
+      char cmd[32];
+      sprintf(cmd, "$%d%s", motor, vars[i]);
+      _command(command_var, cmd);
+    }
+  }
+
+  _command(command_var, "$st=1");
+  _command(command_var, "$sx=10000");
+
+  // Leave the initial flushing state
+  _command(command_resume, "c");
+  state_callback();
+
+  // Random kernel inputs
+  for (int i = 0; i < 1024; i++) {
+    for (int j = 0; j < 6; j++) bench.inputs[i][j] = _random(0, 1);
+    _encode_float(bench.encoded[i], _random(-1000, 1000));
+  }
+}
+
+
+/******************************************************************************/
+// Kernels
+
+static volatile float sink;
+
+
+static const float *_input() {return bench.inputs[bench.input++ & 1023];}
+
+
+static void _kernel_b64_decode_float(result_t *r) {
+  float x;
+  uint64_t t = _begin(r);
+  b64_decode_float(bench.encoded[bench.input++ & 1023], &x);
+  _end(r, t);
+  sink = x;
+}
+
+
+static void _kernel_stopping_dist(result_t *r) {
+  const float *in = _input();
+  uint64_t t = _begin(r);
+  float x = SCurve::stoppingDist(in[0] * 5000, in[1] * 1e6, 1e7, 1e9);
+  _end(r, t);
+  sink = x;
+}
+
+
+static void _kernel_next_accel(result_t *r) {
+  const float *in = _input();
+  uint64_t t = _begin(r);
+  float x = SCurve::nextAccel(SEGMENT_TIME, in[0] * 5000, in[1] * 5000,
+                              in[2] * 1e6, 1e7, 1e9);
+  _end(r, t);
+  sink = x;
+}
+
+
+static void _kernel_distance(result_t *r) {
+  const float *in = _input();
+  uint64_t t = _begin(r);
+  float x = SCurve::distance(in[0] * 0.01, in[1] * 5000, in[2] * 1e6, 1e9);
+  _end(r, t);
+  sink = x;
+}
+
+
+static void _kernel_command_line(result_t *r) {
+  static char cmd[INPUT_BUFFER_LEN];
+
+  if (!*cmd) {
+    const float values[] = {1500, 1e7, 1e9};
+    char *s = cmd;
+    *s++ = COMMAND_line;
+    for (int i = 0; i < 3; i++, s += 6) _encode_float(s, values[i]);
+    *s++ = 'x';
+    _encode_float(s, 0.25);
+    s += 6;
+    *s++ = '3';
+    _encode_float(s, 0.25 / 1500);
+  }
+
+  char buf[INPUT_BUFFER_LEN];
+  strcpy(buf, cmd);
+
+  uint64_t t = _begin(r);
+  command_line(buf);
+  _end(r, t);
+
+  command_flush_queue();
+}
+
+
+static void _kernel_motor_prep_move(result_t *r) {
+  const float *in = _input();
+  uint64_t t = _begin(r);
+  motor_prep_move(0, in[0]);
+  _end(r, t);
+
+  motor_load_move(0);
+}
+
+
+static void _run_kernel(const char *name, void (*cb)(result_t *)) {
+  result_t *r = _result(name, false);
+  unsigned ops = bench.counting ? COUNT_OPS : KERNEL_OPS;
+  for (unsigned i = 0; i < ops; i++) cb(r);
+}
+
+
+/******************************************************************************/
+// Move mixes
+
+typedef struct {
+  char cmds[8][INPUT_BUFFER_LEN];
+  unsigned count;
+} line_cmds_t;
+
+
+static struct {
+  float position[3];
+  line_cmds_t *lines;
+  unsigned count;
+  unsigned size;
+} mix;
+
+
+static line_cmds_t *_add_line(const float target[3], float vel, float jerk,
+                              const float times[7]) {
+  if (mix.count == mix.size) {
+    mix.size = mix.size ? mix.size * 2 : 1024;
+    mix.lines = (line_cmds_t *)
+      realloc(mix.lines, mix.size * sizeof(line_cmds_t));
+    if (!mix.lines) {perror("bench"); exit(1);}
+  }
+
+  line_cmds_t *l = &mix.lines[mix.count++];
+  l->count = 1;
+
+  float accel = jerk * (times[0] < times[4] ? times[4] : times[0]);
+  const float values[] = {vel, accel, jerk};
+  char *s = l->cmds[0];
+
+  *s++ = COMMAND_line;
+  for (int i = 0; i < 3; i++, s += 6) _encode_float(s, values[i]);
+
+  for (int axis = 0; axis < 3; axis++) {
+    *s++ = "xyz"[axis];
+    _encode_float(s, target[axis]);
+    s += 6;
+  }
+
+  for (int i = 0; i < 7; i++)
+    if (times[i]) {
+      *s++ = '0' + i;
+      _encode_float(s, times[i]);
+      s += 6;
+    }
+
+  memcpy(mix.position, target, sizeof(mix.position));
+
+  return l;
+}
+
+
+static void _add_raster(line_cmds_t *l, float length, float pitch) {
+  unsigned pixels = length / pitch + 1;
+
+  for (unsigned i = 0; i < pixels && l->count < 8; i += RASTER_MAX) {
+    unsigned n = pixels - i < RASTER_MAX ? pixels - i : RASTER_MAX;
+    uint8_t data[12 + RASTER_MAX];
+    float header[3] = {i * pitch, pitch, RASTER_SCALE};
+
+    memcpy(data, header, sizeof(header));
+    for (unsigned j = 0; j < n; j++) data[12 + j] = ((i + j) * 37) & 0xff;
+
+    char *s = l->cmds[l->count++];
+    *s++ = COMMAND_raster;
+    b64_encode(data, 12 + n, s, false);
+  }
+}
+
+
+static float _distance(const float a[3], const float b[3]) {
+  float d = 0;
+  for (int i = 0; i < 3; i++) d += (b[i] - a[i]) * (b[i] - a[i]);
+  return sqrt(d);
+}
+
+
+/// Polyline from a stop to a stop.  Accelerate over the first ramp distance
+/// and decelerate over the last.  Velocity is in mm/min and times in minutes.
+static void _stroke(const float points[][3], unsigned count, float feed,
+                    float jerk, float pitch) {
+  float ramp = sqrt(feed / jerk);
+  float rampD = feed * ramp;
+  float p[3];
+
+  // Accelerate along the first segment
+  float d = _distance(mix.position, points[0]);
+  for (int i = 0; i < 3; i++)
+    p[i] = mix.position[i] + (points[0][i] - mix.position[i]) * rampD / d;
+  const float accel[7] = {ramp, 0, ramp, 0, 0, 0, 0};
+  _add_line(p, feed, jerk, accel);
+
+  for (unsigned i = 0; i < count; i++) {
+    bool last = i == count - 1;
+    d = _distance(mix.position, points[i]) - (last ? rampD : 0);
+
+    if (last)
+      for (int j = 0; j < 3; j++)
+        p[j] = mix.position[j] + (points[i][j] - mix.position[j]) * d /
+          (d + rampD);
+    else memcpy(p, points[i], sizeof(p));
+
+    const float cruise[7] = {0, 0, 0, d / feed, 0, 0, 0};
+    line_cmds_t *l = _add_line(p, feed, jerk, cruise);
+    if (pitch && !last) _add_raster(l, d, pitch);
+  }
+
+  // Decelerate along the last segment
+  const float decel[7] = {0, 0, 0, 0, ramp, 0, ramp};
+  _add_line(points[count - 1], 0, jerk, decel);
+}
+
+
+static void _rapid(const float target[3]) {
+  const float jerk = 1e9;
+  float d = _distance(mix.position, target);
+  if (!d) return;
+
+  // Peak velocity of a jerk limited move of this length
+  float peak = pow(d * sqrt(jerk) / 2, 2.0 / 3);
+  if (5000 < peak) peak = 5000;
+  float ramp = sqrt(peak / jerk);
+  float cruise = (d - 2 * peak * ramp) / peak;
+  if (cruise < 0) cruise = 0;
+
+  const float times[7] = {ramp, 0, ramp, cruise, ramp, 0, ramp};
+  _add_line(target, 0, jerk, times);
+}
+
+
+static void _mix_dense() {
+  // Zig-zag over a wavy surface with 0.25mm segments and 3mm lead in and out
+  float points[122][3];
+
+  for (int row = 0; row < 10; row++) {
+    float dir = row & 1 ? -1 : 1;
+    float x0 = row & 1 ? 30 : 0;
+
+    for (int i = 0; i < 122; i++) {
+      float x = x0 + dir * (i == 121 ? 33 : i * 0.25);
+      points[i][0] = x;
+      points[i][1] = row;
+      points[i][2] = 2 * sin(x / 5) * cos(row / 7.0);
+    }
+
+    float start[3] = {x0 - dir * 3, (float)row, points[0][2]};
+    _rapid(start);
+    _stroke(points, 122, 1500, 1e9, 0);
+  }
+}
+
+
+static void _mix_long() {
+  // Long rapid moves
+  for (int i = 0; i < 20; i++) {
+    float target[1][3] = {{i & 1 ? 0.0f : 200.0f, i * 5.0f, 0}};
+    _stroke(target, 1, 5000, 1e9, 0);
+  }
+}
+
+
+static void _mix_arcs() {
+  // Circles cut as 0.2mm chords with 3mm tangent lead in and out
+  float points[402][3];
+  const float r = 12.8;
+
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 401; j++) {
+      float a = 2 * M_PI * j / 400;
+      points[j][0] = r * cos(a);
+      points[j][1] = r * sin(a);
+      points[j][2] = i;
+    }
+
+    points[401][0] = r;
+    points[401][1] = 3;
+    points[401][2] = i;
+
+    float start[3] = {r, -3, (float)i};
+    _rapid(start);
+    _stroke(points, 402, 2000, 1e9, 0);
+  }
+}
+
+
+static void _mix_raster() {
+  // Laser raster rows with 0.1mm pixels and 6mm overscan
+  for (int row = 0; row < 10; row++) {
+    float dir = row & 1 ? -1 : 1;
+    float x0 = row & 1 ? 20 : 0;
+    float y = row * 0.1;
+    float points[2][3] = {{x0 + dir * 20, y, 0}, {x0 + dir * 26, y, 0}};
+
+    float start[3] = {x0 - dir * 6, y, 0};
+    _rapid(start);
+    _stroke(points, 2, 3000, 1e9, 0.1);
+  }
+}
+
+
+static void _tick() {
+  result_t *r = &bench.results[bench.slot];
+
+  if (ADCB_CH0_INTCTRL == ADC_CH_INTLVL_LO_gc) {
+    if (bench.counting && bench.calls++ % COUNT_STRIDE)
+      __STEP_LOW_LEVEL_ISR();
+
+    else {
+      uint64_t t = _begin(r);
+      __STEP_LOW_LEVEL_ISR();
+      _end(r, t);
+    }
+  }
+
+  for (int motor = 0; motor < MOTORS; motor++) motor_emulate_steps(motor);
+  __STEP_TIMER_ISR();
+
+#if 1 < POWER_UPDATES_PER_MS
+  if (TIMER_STEP.INTCTRLB & TC0_CCAINTLVL_gm) __STEP_TIMER_CCA_ISR();
+#endif
+#if 2 < POWER_UPDATES_PER_MS
+  if (TIMER_STEP.INTCTRLB & TC0_CCBINTLVL_gm) __STEP_TIMER_CCB_ISR();
+#endif
+#if 3 < POWER_UPDATES_PER_MS
+  if (TIMER_STEP.INTCTRLB & TC0_CCCINTLVL_gm) __STEP_TIMER_CCC_ISR();
+#endif
+
+  if (!(bench.ticks++ & 3)) __RTC_OVF_vect();
+  state_callback();
+}
+
+
+static void _run_mix(const char *name, void (*cb)()) {
+  result_t *r = _result(name, true);
+  bench.slot = r - bench.results;
+
+  mix.count = 0;
+  cb();
+
+  unsigned count = mix.count;
+  uint64_t start = bench.ticks;
+
+  for (unsigned next = 0; next < count || st_is_busy() || command_get_count();) {
+    while (next < count && command_get_count() < QUEUE_LINES) {
+      line_cmds_t &l = mix.lines[next++];
+
+      _command(command_line, l.cmds[0]);
+      for (unsigned i = 1; i < l.count; i++)
+        _command(command_raster, l.cmds[i]);
+    }
+
+    _tick();
+  }
+
+  r->lines += count;
+  r->ms += bench.ticks - start;
+
+  // Return to the origin
+  command_flush_queue();
+  for (int motor = 0; motor < MOTORS; motor++) motor_set_position(motor, 0);
+  float origin[AXES] = {0};
+  command_set_position(origin);
+  memset(mix.position, 0, sizeof(mix.position));
+}
+
+
+static void _run() {
+  _run_kernel("b64_decode_float", _kernel_b64_decode_float);
+  _run_kernel("stopping_dist", _kernel_stopping_dist);
+  _run_kernel("next_accel", _kernel_next_accel);
+  _run_kernel("distance", _kernel_distance);
+  _run_kernel("command_line", _kernel_command_line);
+  _run_kernel("motor_prep_move", _kernel_motor_prep_move);
+
+  _run_mix("dense", _mix_dense);
+  _run_mix("long", _mix_long);
+  _run_mix("arcs", _mix_arcs);
+  _run_mix("raster", _mix_raster);
+}
+
+
+/******************************************************************************/
+// Instruction counting
+
+static flop_t _classify(const uint8_t *b) {
+  int pp = 0; // 1 = 66, 2 = F3, 3 = F2
+  int map = 0;
+  int op;
+
+  // Legacy prefixes
+  for (;; b++)
+    if (*b == 0x66) pp = 1;
+    else if (*b == 0xf3) pp = 2;
+    else if (*b == 0xf2) pp = 3;
+    else if (*b == 0x26 || *b == 0x2e || *b == 0x36 || *b == 0x3e ||
+             *b == 0x64 || *b == 0x65 || *b == 0x67) continue;
+    else break;
+
+  if (*b == 0xc5) {pp = b[1] & 3; map = 1; op = b[2];}   // 2 byte VEX
+  else if (*b == 0xc4) {pp = b[2] & 3; map = b[1] & 0x1f; op = b[3];}
+  else {
+    if ((*b & 0xf0) == 0x40) b++; // REX
+    if (*b++ != 0x0f) return FLOP_NONE;
+    if (*b == 0x38) {map = 2; op = b[1];}
+    else if (*b == 0x3a) {map = 3; op = b[1];}
+    else {map = 1; op = *b;}
+  }
+
+  bool scalar = pp == 2 || pp == 3;
+
+  if (map == 1)
+    switch (op) {
+    case 0x58: case 0x5c: return scalar ? FLOP_ADD : FLOP_NONE;
+    case 0x59: return scalar ? FLOP_MUL : FLOP_NONE;
+    case 0x5e: return scalar ? FLOP_DIV : FLOP_NONE;
+    case 0x51: return scalar ? FLOP_SQRT : FLOP_NONE;
+    case 0x5d: case 0x5f: return scalar ? FLOP_CMP : FLOP_NONE; // min, max
+    case 0x5a: case 0x2a: case 0x2c: case 0x2d:
+      return scalar ? FLOP_CVT : FLOP_NONE;
+    case 0x2e: case 0x2f: return pp <= 1 ? FLOP_CMP : FLOP_NONE;
+    }
+
+  // Scalar FMA, i.e. vfmadd/vfmsub/vfnmadd/vfnmsub 132/213/231 ss/sd
+  if (map == 2 && pp == 1 && 0x99 <= op && op <= 0xbf && 9 <= (op & 0xf) &&
+      (op & 1))
+    return FLOP_FMA;
+  if (map == 3 && pp == 1 && (op == 0x0a || op == 0x0b)) return FLOP_CVT;
+
+  return FLOP_NONE;
+}
+
+
+typedef struct {
+  unsigned long addr;
+  unsigned call;
+} entry_t;
+
+
+static entry_t entries[64];
+static unsigned entryCount = 0;
+
+
+static void _load_entries(const char *exe) {
+  // Kernel entry points from the symbol table, the bench is not PIE
+  char cmd[PATH_MAX + 32];
+  snprintf(cmd, sizeof(cmd), "nm -C '%s' 2>/dev/null", exe);
+
+  FILE *f = popen(cmd, "r");
+  if (!f) return;
+
+  char line[512];
+  while (fgets(line, sizeof(line), f) && entryCount < 64) {
+    unsigned long addr;
+    char type;
+    int n;
+    if (sscanf(line, "%lx %c %n", &addr, &type, &n) != 2) continue;
+    if (type != 'T' && type != 't') continue;
+
+    const char *name = line + n;
+    for (unsigned i = 0; i < CALL_COUNT; i++) {
+      unsigned len = strlen(call_names[i]);
+      if (!strncmp(name, call_names[i], len) && name[len] == '(') {
+        entries[entryCount].addr = addr;
+        entries[entryCount++].call = i;
+      }
+    }
+  }
+
+  pclose(f);
+}
+
+
+static void _step(pid_t pid, result_t *r) {
+  struct user_regs_struct regs;
+  ptrace(PTRACE_GETREGS, pid, 0, &regs);
+
+  r->insns++;
+
+  for (unsigned i = 0; i < entryCount; i++)
+    if (entries[i].addr == regs.rip) r->calls[entries[i].call]++;
+
+  // The child is a fork of this process so its code is mapped at the same
+  // addresses here.  Reading it directly saves two syscalls per step.
+  flop_t flop = _classify((const uint8_t *)regs.rip);
+  if (flop != FLOP_NONE) r->flops[flop]++;
+}
+
+
+static void _count(const char *exe) {
+  _load_entries(exe);
+
+  pid_t pid = fork();
+  if (pid == -1) {perror("fork"); exit(1);}
+
+  if (!pid) {
+    ptrace(PTRACE_TRACEME, 0, 0, 0);
+    bench.counting = true;
+    _init();
+    _run();
+    fflush(0);
+    _exit(0);
+  }
+
+  bool stepping = false;
+  result_t *r = 0;
+
+  while (true) {
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {perror("waitpid"); exit(1);}
+    if (WIFEXITED(status) || WIFSIGNALED(status)) break;
+
+    int sig = WSTOPSIG(status);
+
+    if (sig == SIGUSR1) {
+      // Start of op, result slot set by the child
+      int slot = ptrace(PTRACE_PEEKDATA, pid, (void *)&bench.slot, 0);
+      r = &bench.results[slot];
+      r->counted++;
+      stepping = true;
+
+    } else if (sig == SIGUSR2) stepping = false;
+    else if (sig == SIGTRAP && stepping) _step(pid, r);
+    else if (sig != SIGTRAP && sig != SIGSTOP) {
+      ptrace(PTRACE_CONT, pid, 0, sig); // Pass on other signals
+      continue;
+    }
+
+    ptrace(stepping ? PTRACE_SINGLESTEP : PTRACE_CONT, pid, 0, 0);
+  }
+}
+
+
+/******************************************************************************/
+// Output
+
+static void _print_counts(FILE *f, const result_t *r) {
+  if (!r->counted) return;
+
+  double ops = r->counted;
+  uint64_t flops = 0;
+
+  fprintf(f, ",\"insns\":%.1f,\"flops\":{", r->insns / ops);
+  for (int i = 0; i < FLOP_COUNT; i++) {
+    fprintf(f, "%s\"%s\":%.2f", i ? "," : "", flop_names[i],
+            r->flops[i] / ops);
+    flops += r->flops[i] * (i == FLOP_FMA ? 2 : 1);
+  }
+  fprintf(f, ",\"total\":%.2f},\"calls\":{", flops / ops);
+
+  bool first = true;
+  for (unsigned i = 0; i < CALL_COUNT; i++)
+    if (r->calls[i]) {
+      fprintf(f, "%s\"%s\":%.2f", first ? "" : ",", call_names[i],
+              r->calls[i] / ops);
+      first = false;
+    }
+
+  fprintf(f, "}");
+}
+
+
+static void _print(FILE *f) {
+  for (int mixes = 0; mixes < 2; mixes++) {
+    fprintf(f, "%s\"%s\":{", mixes ? "," : "{", mixes ? "mixes" : "kernels");
+    bool first = true;
+
+    for (unsigned i = 0; i < bench.count; i++) {
+      const result_t *r = &bench.results[i];
+      if (r->mix != (bool)mixes) continue;
+
+      fprintf(f, "%s\"%s\":{\"ops\":%llu,\"ns\":%.1f", first ? "" : ",",
+              r->name, (unsigned long long)r->ops,
+              r->ops ? (double)r->ns / r->ops : 0.0);
+      first = false;
+
+      // Mix ops are step exec calls, one per 4ms segment
+      if (r->mix)
+        fprintf(f, ",\"lines\":%u,\"ms\":%llu,\"ops_per_line\":%.2f",
+                r->lines, (unsigned long long)r->ms,
+                r->lines ? (double)r->ops / r->lines : 0.0);
+
+      _print_counts(f, r);
+      fprintf(f, "}");
+    }
+
+    fprintf(f, "}");
+  }
+
+  fprintf(f, "}\n");
+}
+
+
+int main(int argc, char *argv[]) {
+  bool count = false;
+  for (int i = 1; i < argc; i++)
+    if (!strcmp(argv[i], "--count")) count = true;
+    else {
+      fprintf(stderr, "Usage: %s [--count]\n", argv[0]);
+      return 1;
+    }
+
+  // Keep firmware output off of the results
+  FILE *out = fdopen(dup(1), "w");
+  if (!freopen("/dev/null", "w", stdout)) return 1;
+
+  if (count) {
+    // Resolve the link here, under nm it would name nm itself
+    char exe[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (len < 0) {perror("readlink"); return 1;}
+    exe[len] = 0;
+
+    _count(exe);
+  }
+
+  _init();
+  _run();
+  _print(out);
+
+  return 0;
+}
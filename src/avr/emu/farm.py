@@ -0,0 +1,357 @@
+#!/usr/bin/env python3
+
+################################################################################
+#                                                                              #
+#                 This file is part of the Buildbotics firmware.               #
+#                                                                              #
+#        Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.      #
+#                                                                              #
+#         This Source describes Open Hardware and is licensed under the        #
+#                                 CERN-OHL-S v2.                               #
+#                                                                              #
+#         You may redistribute and modify this Source and make products        #
+#    using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).  #
+#           This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED          #
+#    WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS  #
+#     FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable    #
+#                                  conditions.                                 #
+#                                                                              #
+#                Source location: https://github.com/buildbotics               #
+#                                                                              #
+#      As per CERN-OHL-S v2 section 4, should You produce hardware based on    #
+#    these sources, You must maintain the Source Location clearly visible on   #
+#    the external case of the CNC Controller or other product you make using   #
+#                                  this Source.                                #
+#                                                                              #
+#                For more information, email info@buildbotics.com              #
+#                                                                              #
+################################################################################
+
+# Runs G-code files through the host planner and the emulated firmware, many
+# at once, and compares the results to a baseline.  Each file runs in its own
+# process with a headless controller, Mach, Comm, Planner and State from
+# bbctrl, talking to libbbemu over the emulated serial port.  Host timers run
+# on the firmware's simulated clock so files run as fast as the CPU allows.
+#
+# Requires libbbemu.so, see the Makefile, and the bbctrl Python dependencies
+# including the camotics planner module.
+
+import os, sys, json, time, heapq, shutil, argparse, tempfile, subprocess
+from concurrent.futures import ThreadPoolExecutor
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '../../py'))
+
+
+GCODE_EXTS = ('.nc', '.ngc', '.gc', '.gcode', '.tap', '.cnc')
+AXES = 'xyzabc'
+UNDERRUNS = ('un', 'ue', 'uh', 'ul')
+
+
+class VirtualIOLoop:
+  '''Runs IOLoop timers in simulated time, in order, without waiting.'''
+
+  READ  = 0x001 # Same as tornado
+  WRITE = 0x004
+  ERROR = 0x018
+
+
+  def __init__(self):
+    self.time = 0
+    self.timers = []
+    self.cancelled = set()
+    self.next = 0
+
+
+  def call_later(self, delay, callback, *args, **kwargs):
+    self.next += 1
+    heapq.heappush(self.timers, (self.time + delay, self.next, callback, args,
+                                 kwargs))
+    return self.next
+
+
+  def add_callback(self, callback, *args, **kwargs):
+    return self.call_later(0, callback, *args, **kwargs)
+
+
+  def remove_timeout(self, h): self.cancelled.add(h)
+  def add_handler(self, fd, handler, events): pass
+  def update_handler(self, fd, events): pass
+  def remove_handler(self, fd): pass
+  def close(self): self.timers = []
+
+
+  def run(self, done, limit):
+    '''Run timers until done() or limit seconds of simulated time.'''
+    while self.timers and not done():
+      if limit < self.timers[0][0]: return False
+      t, h, callback, args, kwargs = heapq.heappop(self.timers)
+
+      if h in self.cancelled:
+        self.cancelled.remove(h)
+        continue
+
+      self.time = t
+      callback(*args, **kwargs)
+
+    return done()
+
+
+class FarmCtrl:
+  '''The parts of bbctrl.Ctrl needed to run programs, without hardware.'''
+
+  def __init__(self, root, log):
+    from bbctrl.Log import Log
+    from bbctrl.Events import Events
+    from bbctrl.State import State
+    from bbctrl.Config import Config
+    from bbctrl.AVREmu import AVREmu
+    from bbctrl.Mach import Mach
+
+    # Plan in the IOLoop so results follow simulated time
+    self.args = argparse.Namespace(demo = True, emu_lib = True,
+                                   fast_emu = False, sync_planner = True,
+                                   disable_command_cache = True,
+                                   verbose = False)
+    self.root = root
+    self.ioloop = VirtualIOLoop()
+    self.is_ready = False
+    self.errors = []
+
+    self.log = Log(self.args, self.ioloop, log)
+    self.log.add_listener(self._log)
+    self.events = Events(self)
+    self.state = State(self)
+    self.config = Config(self)
+    self.avr = AVREmu(self)
+    self.fs = self
+    self.mach = Mach(self, self.avr)
+    self.mach.connect()
+
+
+  def _log(self, msg):
+    msg = msg['log']
+    if msg['level'] == 'error': self.errors.append(msg['msg'])
+
+
+  def realpath(self, path): return path
+
+
+  def get_path(self, dir = None, filename = None):
+    path = self.root if dir is None else (self.root + '/' + dir)
+    return path if filename is None else (path + '/' + filename)
+
+
+  def configure(self):
+    # Same as Ctrl.configure()
+    self.mach.begin_bulk()
+    try:
+      self.config.reload()
+      self.state.init()
+    finally: self.mach.end_bulk()
+    self.mach.set('be', 1) # Enable buffers
+
+
+  def ready(self): self.is_ready = True
+
+
+  def close(self):
+    self.ioloop.close()
+    self.avr.close()
+    self.mach.planner.close()
+
+
+def run_file(path, config, log, max_time):
+  '''Run one file and return its results.'''
+  result = dict(errors = [])
+
+  with tempfile.TemporaryDirectory(prefix = 'bbfarm-') as root:
+    if config: shutil.copy(config, root + '/config.json')
+    ctrl = FarmCtrl(root, log)
+    loop, state, mach = ctrl.ioloop, ctrl.state, ctrl.mach
+
+    def unpause(update):
+      # Continue after M0, M1 and tool changes as a user would
+      if state.get('xx') == 'HOLDING' and state.get('pr') in \
+         ('Program pause', 'Optional pause', 'User pause'):
+        loop.add_callback(mach.unpause)
+
+    state.add_listener(unpause)
+
+    def idle():
+      return state.get('cycle') == 'idle' and \
+        state.get('xx') in ('READY', 'ESTOPPED')
+
+    try:
+      # Wait for the stop that follows the firmware reset to complete
+      if not loop.run(lambda: ctrl.is_ready and not mach.stopping, 60):
+        raise Exception('Controller did not become ready')
+
+      start = loop.time
+      mach.start(os.path.abspath(path))
+      finished = loop.run(idle, start + max_time)
+      result['time'] = round(loop.time - start, 3)
+
+      if not finished:
+        ctrl.errors.append('Simulated time limit exceeded')
+
+    except Exception as e: ctrl.errors.append(str(e))
+
+    result['state'] = state.get('xx', '')
+    result['position'] = {axis: round(state.get(axis + 'p', 0), 4)
+                          for axis in AXES}
+    result['underruns'] = {name: state.get(name, 0) for name in UNDERRUNS}
+    result['errors'] = ctrl.errors
+
+    try:
+      ctrl.close()
+    except Exception: pass
+
+  return result
+
+
+def find_files(paths):
+  for path in paths:
+    if not os.path.isdir(path):
+      yield path, path
+      continue
+
+    for dir, dirs, files in os.walk(path):
+      dirs.sort()
+      for name in sorted(files):
+        if os.path.splitext(name)[1].lower() in GCODE_EXTS:
+          full = os.path.join(dir, name)
+          yield os.path.relpath(full, path), full
+
+
+def run_worker(args, name, path):
+  cmd = [sys.executable, __file__, '--worker', path,
+         '--max-time', str(args.max_time)]
+  if args.config: cmd += ['--config', args.config]
+  if args.logs:
+    cmd += ['--log', os.path.join(args.logs, name.replace('/', '_') + '.log')]
+
+  start = time.time()
+
+  try:
+    p = subprocess.run(cmd, stdout = subprocess.PIPE,
+                       stderr = subprocess.PIPE, timeout = args.timeout)
+    lines = p.stdout.decode('utf-8').strip().split('\n')
+
+    try:
+      result = json.loads(lines[-1])
+    except ValueError:
+      err = p.stderr.decode('utf-8', 'replace').strip().split('\n')[-1]
+      result = dict(errors = ['Worker failed (%d): %s' % (p.returncode, err)])
+
+  except subprocess.TimeoutExpired:
+    result = dict(errors = ['Timed out after %ds' % args.timeout])
+
+  result['wall'] = round(time.time() - start, 2)
+  return name, result
+
+
+def diff_result(args, a, b):
+  '''Yields differences between baseline a and result b.'''
+  if a.get('errors') != b.get('errors'):
+    yield 'errors %s -> %s' % (a.get('errors'), b.get('errors'))
+
+  if a.get('state') != b.get('state'):
+    yield 'state %s -> %s' % (a.get('state'), b.get('state'))
+
+  for axis in AXES:
+    pa = a.get('position', {}).get(axis, 0)
+    pb = b.get('position', {}).get(axis, 0)
+    if args.tolerance < abs(pa - pb):
+      yield '%sp %g -> %g' % (axis, pa, pb)
+
+  ta, tb = a.get('time'), b.get('time')
+  if (ta is None) != (tb is None) or (ta is not None and
+      args.time_tolerance * max(ta, 1) < abs(ta - tb)):
+    yield 'time %s -> %s' % (ta, tb)
+
+  for name in UNDERRUNS:
+    ua = a.get('underruns', {}).get(name, 0)
+    ub = b.get('underruns', {}).get(name, 0)
+    if ua < ub: yield '%s %d -> %d' % (name, ua, ub)
+
+
+def compare(args, baseline, results):
+  count = 0
+
+  for name in sorted(set(baseline) | set(results)):
+    if name not in results: diffs = ['missing from results']
+    elif name not in baseline: diffs = ['not in baseline']
+    else: diffs = list(diff_result(args, baseline[name], results[name]))
+
+    if diffs:
+      count += 1
+      print('%s:' % name)
+      for diff in diffs: print('  ' + diff)
+
+  print('%d of %d files differ' % (count, len(results)))
+  return count
+
+
+def worker_main(args):
+  # Keep stdout for the result, the host log also prints there
+  out = sys.stdout
+  sys.stdout = open(os.devnull, 'w')
+
+  result = run_file(args.worker, args.config, args.log, args.max_time)
+  out.write(json.dumps(result) + '\n')
+
+
+def main():
+  parser = argparse.ArgumentParser(
+    description = 'Run G-code through the planner and emulated firmware and '
+    'compare the results to a baseline')
+  parser.add_argument('paths', nargs = '*',
+                      help = 'G-code files or directories to search')
+  parser.add_argument('-j', '--jobs', type = int, default = os.cpu_count(),
+                      help = 'Files to run at once')
+  parser.add_argument('-c', '--config', help = 'Machine config JSON')
+  parser.add_argument('-o', '--output', default = 'farm.json',
+                      help = 'Write results here')
+  parser.add_argument('-b', '--baseline', help = 'Results to compare with')
+  parser.add_argument('--logs', help = 'Keep host logs in this directory')
+  parser.add_argument('--max-time', type = float, default = 24 * 60 * 60,
+                      help = 'Simulated seconds allowed per file')
+  parser.add_argument('--timeout', type = int, default = 3600,
+                      help = 'Real seconds allowed per file')
+  parser.add_argument('--tolerance', type = float, default = 0.001,
+                      help = 'Allowed final position difference')
+  parser.add_argument('--time-tolerance', type = float, default = 0.001,
+                      help = 'Allowed relative run time difference')
+  parser.add_argument('--worker', help = argparse.SUPPRESS)
+  parser.add_argument('--log', help = argparse.SUPPRESS)
+  args = parser.parse_args()
+
+  if args.worker: return worker_main(args)
+  if not args.paths: parser.error('No G-code given')
+
+  if args.logs and not os.path.exists(args.logs): os.makedirs(args.logs)
+
+  files = list(find_files(args.paths))
+  results = {}
+  start = time.time()
+
+  with ThreadPoolExecutor(args.jobs) as pool:
+    jobs = [pool.submit(run_worker, args, name, path) for name, path in files]
+
+    for i, job in enumerate(jobs):
+      name, result = job.result()
+      results[name] = result
+
+      status = 'ERROR' if result['errors'] else '%.1fs' % result['time']
+      sys.stderr.write('[%d/%d] %s %s\n' % (i + 1, len(files), name, status))
+
+  with open(args.output, 'w') as f: json.dump(results, f, indent = 2)
+
+  print('%d files in %.1fs' % (len(files), time.time() - start))
+
+  if args.baseline:
+    with open(args.baseline, 'r') as f: baseline = json.load(f)
+    if compare(args, baseline, results): return 1
+
+
+if __name__ == '__main__': sys.exit(main())
@@ -0,0 +1,191 @@
+#!/usr/bin/env python3
+
+################################################################################
+#                                                                              #
+#                 This file is part of the Buildbotics firmware.               #
+#                                                                              #
+#        Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.      #
+#                                                                              #
+#         This Source describes Open Hardware and is licensed under the        #
+#                                 CERN-OHL-S v2.                               #
+#                                                                              #
+#         You may redistribute and modify this Source and make products        #
+#    using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).  #
+#           This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED          #
+#    WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS  #
+#     FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable    #
+#                                  conditions.                                 #
+#                                                                              #
+#                Source location: https://github.com/buildbotics               #
+#                                                                              #
+#      As per CERN-OHL-S v2 section 4, should You produce hardware based on    #
+#    these sources, You must maintain the Source Location clearly visible on   #
+#    the external case of the CNC Controller or other product you make using   #
+#                                  this Source.                                #
+#                                                                              #
+#                For more information, email info@buildbotics.com              #
+#                                                                              #
+################################################################################
+
+# Reconstructs velocity, acceleration and jerk from a step trace written by
+# `bbemu --trace <file>`.  Each trace row is one 1ms step timer tick giving,
+# per motor, the commanded step position, direction and step period in CPU
+# clocks.
+
+import sys, csv, argparse
+import numpy as np
+
+
+F_CPU = 32000000
+TICKS_PER_MIN = 60000
+STEPS_PER_MM = 360 / 1.8 / 5 * 32
+
+
+class Trace:
+  def __init__(self, path, steps_per_unit, window):
+    self.steps_per_unit = steps_per_unit
+    self.window = window
+
+    f = sys.stdin if path == '-' else open(path, 'r')
+    reader = csv.reader(f)
+    header = next(reader)
+    rows = np.array([[float(x) for x in row] for row in reader])
+
+    self.motors = (len(header) - 1) // 3
+    self.time = rows[:, 0] if len(rows) else np.zeros(0)
+    self.steps = []
+    self.dir = []
+    self.period = []
+
+    for motor in range(self.motors):
+      col = 1 + motor * 3
+      self.steps.append(rows[:, col] if len(rows) else np.zeros(0))
+      self.dir.append(rows[:, col + 1] if len(rows) else np.zeros(0))
+      self.period.append(rows[:, col + 2] if len(rows) else np.zeros(0))
+
+
+  def is_active(self, motor):
+    return np.any(self.period[motor])
+
+
+  def position(self, motor):
+    return self.steps[motor] / self.steps_per_unit[motor]
+
+
+  def diff(self, x):
+    # Backward difference over the window, in units per minute
+    d = np.zeros(len(x))
+    w = self.window
+    d[w:] = (x[w:] - x[:-w]) * TICKS_PER_MIN / w
+    return d
+
+
+  def velocity(self, motor):
+    # Ignore position changes, such as position resets, while not stepping
+    moving = np.convolve(self.period[motor] != 0, np.ones(self.window))
+    vel = self.diff(self.position(motor))
+    vel[moving[:len(vel)] == 0] = 0
+    return vel
+
+
+  def step_velocity(self, motor):
+    # Instantaneous velocity from the step timer period
+    period = self.period[motor]
+    rate = np.zeros(len(period))
+    moving = period != 0
+    rate[moving] = F_CPU * 60 / period[moving]
+    return rate * self.dir[motor] / self.steps_per_unit[motor]
+
+
+  def derivatives(self, motor):
+    vel = self.velocity(motor)
+    accel = self.diff(vel)
+    jerk = self.diff(accel)
+    return vel, accel, jerk
+
+
+def summarize(trace, motors):
+  for motor in motors:
+    vel, accel, jerk = trace.derivatives(motor)
+    print('Motor %d: max vel %0.3f, max accel %0.3f, max jerk %0.3f' % (
+      motor, np.max(np.abs(vel)), np.max(np.abs(accel)),
+      np.max(np.abs(jerk))))
+
+
+def write_csv(trace, motors, out):
+  cols = ['time']
+  data = [trace.time]
+
+  for motor in motors:
+    vel, accel, jerk = trace.derivatives(motor)
+    cols += ['%d_%s' % (motor, name)
+             for name in ('position', 'velocity', 'step_velocity',
+                          'accel', 'jerk')]
+    data += [trace.position(motor), vel, trace.step_velocity(motor), accel,
+             jerk]
+
+  out.write(','.join(cols) + '\n')
+  for row in zip(*data):
+    out.write(','.join('%g' % x for x in row) + '\n')
+
+
+def plot(trace, motors, output):
+  import matplotlib
+  if output: matplotlib.use('Agg')
+  import matplotlib.pyplot as plt
+
+  fig, axes = plt.subplots(3, sharex = True)
+  seconds = trace.time / 1000
+
+  for motor in motors:
+    vel, accel, jerk = trace.derivatives(motor)
+    label = 'Motor %d' % motor
+
+    axes[0].plot(seconds, vel, label = label)
+    axes[0].plot(seconds, trace.step_velocity(motor), ':')
+    axes[1].plot(seconds, accel, label = label)
+    axes[2].plot(seconds, jerk, label = label)
+
+  axes[0].set_ylabel('Velocity (/min)')
+  axes[1].set_ylabel('Accel (/min²)')
+  axes[2].set_ylabel('Jerk (/min³)')
+  axes[2].set_xlabel('Time (sec)')
+  axes[0].legend()
+
+  if output: plt.savefig(output)
+  else: plt.show()
+
+
+if __name__ == '__main__':
+  # Parse command line arguments
+  description = 'Plot velocity, acceleration and jerk from a bbemu step trace'
+  parser = argparse.ArgumentParser(description = description)
+  parser.add_argument('trace', help = 'Trace file or - for stdin')
+  parser.add_argument('-s', '--steps-per-unit', default = [STEPS_PER_MM],
+                      type = float, nargs = '+',
+                      help = 'Steps per unit for each motor')
+  parser.add_argument('-w', '--window', default = 4, type = int,
+                      help = 'Differencing window in ticks')
+  parser.add_argument('-m', '--motors', type = int, nargs = '+',
+                      help = 'Motors to show, defaults to those that moved')
+  parser.add_argument('-o', '--output', help = 'Save plot to file')
+  parser.add_argument('--csv', action = 'store_true',
+                      help = 'Write derived data as CSV to stdout')
+  parser.add_argument('--summary', action = 'store_true',
+                      help = 'Print per motor maximums')
+  args = parser.parse_args()
+
+  if args.window < 1: parser.error('Window must be at least one tick')
+
+  # Load trace
+  steps_per_unit = args.steps_per_unit
+  steps_per_unit += [steps_per_unit[-1]] * 4
+  trace = Trace(args.trace, steps_per_unit, args.window)
+
+  motors = args.motors
+  if motors is None:
+    motors = [m for m in range(trace.motors) if trace.is_active(m)]
+
+  if args.csv: write_csv(trace, motors, sys.stdout)
+  elif args.summary: summarize(trace, motors)
+  else: plot(trace, motors, args.output)
@@ -0,0 +1,245 @@
+#!/usr/bin/env python3
+
+################################################################################
+#                                                                              #
+#                 This file is part of the Buildbotics firmware.               #
+#                                                                              #
+#        Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.      #
+#                                                                              #
+#         This Source describes Open Hardware and is licensed under the        #
+#                                 CERN-OHL-S v2.                               #
+#                                                                              #
+#         You may redistribute and modify this Source and make products        #
+#    using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).  #
+#           This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED          #
+#    WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS  #
+#     FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable    #
+#                                  conditions.                                 #
+#                                                                              #
+#                Source location: https://github.com/buildbotics               #
+#                                                                              #
+#      As per CERN-OHL-S v2 section 4, should You produce hardware based on    #
+#    these sources, You must maintain the Source Location clearly visible on   #
+#    the external case of the CNC Controller or other product you make using   #
+#                                  this Source.                                #
+#                                                                              #
+#                For more information, email info@buildbotics.com              #
+#                                                                              #
+################################################################################
+
+# Generates the sample command logs replayed by `bbemu --replay`.  Logs use
+# the format written by Comm._prep_command() so real captured logs can be
+# replayed the same way.
+
+import os, sys, json, math
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '../../../py'))
+from bbctrl import Cmd
+
+
+JERK = 1e9     # mm/min³
+RAPID = 5000   # mm/min
+
+
+def _sub(a, b): return [x - y for x, y in zip(a, b)]
+def _add(a, b): return [x + y for x, y in zip(a, b)]
+def _scale(a, s): return [x * s for x in a]
+def _length(a): return math.sqrt(sum(x * x for x in a))
+
+
+class Log:
+  def __init__(self, path):
+    self.f = open(path, 'w')
+    self.id = 0
+    self.position = [0, 0, 0]
+
+
+  def write(self, cmd):
+    self.f.write('I:Comm:< ' + json.dumps(cmd).strip('"') + '\n')
+
+
+  def block(self, cmd):
+    # Planner blocks are preceded by their command ID
+    self.id += 1
+    self.write(Cmd.set_sync('id', self.id) + '\n' + cmd)
+
+
+  def setup(self, *cmds):
+    # Resume first, the firmware drops queued commands, including synchronous
+    # float vars, until it sees the first resume
+    self.write(Cmd.RESUME)
+
+    for motor in range(3):
+      for name, value in (('me', 1), ('sa', 1.8), ('tr', 5), ('mi', 32),
+                          ('vm', 10), ('dc', 1.5), ('ic', 0.5)):
+        self.write(Cmd.set('%d%s' % (motor, name), value))
+
+    for cmd in cmds: self.write(cmd)
+
+
+  def line(self, target, exitVel, times, speeds = [], scale = None):
+    target = dict(zip('xyz', target))
+    accel = JERK * max(times[0], times[4]) / 60000
+    self.block(Cmd.line(target, exitVel, accel, JERK, times, speeds, scale))
+
+
+  def stroke(self, points, feed, speeds = None, scale = None):
+    '''Move through points starting and ending stopped.  The first and last
+    segments must be long enough to accelerate and decelerate.'''
+    ramp = math.sqrt(feed / JERK) * 60000 # ms
+    rampD = feed * ramp / 60000
+
+    points = [self.position] + [list(p) for p in points]
+
+    # Accelerate along the first segment
+    start = points[0]
+    unit = _scale(_sub(points[1], start), 1 / _length(_sub(points[1], start)))
+    points[0] = _add(start, _scale(unit, rampD))
+    self.line(points[0], feed, [ramp, 0, ramp, 0, 0, 0, 0])
+
+    # Decelerate along the last segment
+    end = points[-1]
+    unit = _scale(_sub(end, points[-2]), 1 / _length(_sub(end, points[-2])))
+    points[-1] = _sub(end, _scale(unit, rampD))
+    points.append(end)
+
+    for i in range(1, len(points)):
+      d = _length(_sub(points[i], points[i - 1]))
+      if i == len(points) - 1:
+        self.line(points[i], 0, [0, 0, 0, 0, ramp, 0, ramp])
+
+      elif d:
+        args = {}
+        if speeds is not None:
+          args = dict(speeds = speeds(points[i - 1], points[i], d),
+                      scale = scale)
+        self.line(points[i], feed, [0, 0, 0, d / feed * 60000, 0, 0, 0],
+                  **args)
+
+    self.position = list(end)
+
+
+  def rapid(self, target, feed = RAPID):
+    d = _length(_sub(target, self.position))
+    if not d: return
+
+    # Peak velocity for a jerk limited move of this length
+    peak = min(feed, (d * math.sqrt(JERK) / 2) ** (2 / 3))
+    ramp = math.sqrt(peak / JERK) * 60000
+    cruise = max(0, d - 2 * peak * ramp / 60000) / peak * 60000
+
+    self.line(target, 0, [ramp, 0, ramp, cruise, ramp, 0, ramp])
+    self.position = list(target)
+
+
+  def close(self): self.f.close()
+
+
+def finish3d(path):
+  # Zig-zag finishing pass over a wavy surface with 0.25mm segments
+  log = Log(path)
+  log.setup()
+
+  def z(x, y): return 2 * math.sin(x / 5) * math.cos(y / 7)
+
+  lead = 3
+  for row in range(20):
+    y = row
+    xs = [i * 0.25 for i in range(121)]
+    if row & 1: xs.reverse()
+    dx = lead if row & 1 else -lead
+
+    log.rapid([xs[0] + dx, y, z(xs[0], y) + 1])
+    log.stroke([[x, y, z(x, y)] for x in xs] + [[xs[-1] - dx, y, z(xs[-1], y)]],
+               1500)
+
+  log.close()
+
+
+def raster(path):
+  # Bidirectional laser raster, 200 0.1mm pixels per row with overscan
+  log = Log(path)
+  log.setup(Cmd.set('st', 1), Cmd.set('sx', 10000))
+
+  scale = 10000
+  pitch = 0.1
+  overscan = 5
+
+  for row in range(30):
+    y = row * pitch
+    xs = (0, 20) if not row & 1 else (20, 0)
+    dx = -overscan if not row & 1 else overscan
+
+    def power(start, end, d):
+      if start[0] == xs[0] and end[0] == xs[1]:
+        return [(i * pitch, scale * ((i * 37 + row * 11) % 256) / 255)
+                for i in range(round(d / pitch) + 1)]
+      return [(0, 0)]
+
+    log.rapid([xs[0] + dx, y, 0])
+    log.stroke([[xs[0], y, 0], [xs[1], y, 0], [xs[1] - dx, y, 0]], 3000,
+               power, scale)
+
+  log.close()
+
+
+def arcs(path):
+  # Circles and arcs cut as 0.2mm chords
+  log = Log(path)
+  log.setup()
+
+  for i, r in enumerate((5, 8, 12, 20, 3, 15)):
+    cx, cy = 40 * (i % 3), 40 * (i // 3)
+    turns = 1 if i % 2 else 0.75
+    n = max(8, round(2 * math.pi * r * turns / 0.2))
+    points = [[cx + r * math.cos(2 * math.pi * turns * j / n),
+               cy + r * math.sin(2 * math.pi * turns * j / n), 0]
+              for j in range(n + 1)]
+
+    # Tangent lead in and out
+    lead = 3
+    start = [points[0][0], points[0][1] - lead, 0]
+    a = 2 * math.pi * turns
+    end = [points[-1][0] - lead * math.sin(a), points[-1][1] + lead * math.cos(a),
+           0]
+
+    log.rapid(start)
+    log.stroke(points + [end], 2000)
+
+  log.close()
+
+
+def probe(path):
+  # Probe along X with the probe on IO 3, replay with --scenario probe.scn
+  log = Log(path)
+  log.setup(Cmd.set('cio', 14), Cmd.set('cim', 7)) # Probe, normally open
+  log.write(Cmd.seek(1, True, True)) # Probe, active, error if not found
+  log.rapid([20, 0, 0], 1000)
+  log.close()
+
+
+def starve(path):
+  # Log cut off at full speed so the queue runs dry while moving, replay with
+  # and without --late-exec to check each stall is counted once
+  log = Log(path)
+  log.setup()
+
+  feed = 2000
+  ramp = math.sqrt(feed / JERK) * 60000 # ms
+  x = feed * ramp / 60000
+  log.line([x, 0, 0], feed, [ramp, 0, ramp, 0, 0, 0, 0])
+
+  for i in range(10):
+    x += 0.5
+    log.line([x, 0, 0], feed, [0, 0, 0, 0.5 / feed * 60000, 0, 0, 0])
+
+  log.close()
+
+
+if __name__ == '__main__':
+  dir = os.path.dirname(os.path.abspath(__file__))
+  finish3d(os.path.join(dir, 'finish3d.log'))
+  raster(os.path.join(dir, 'raster.log'))
+  arcs(os.path.join(dir, 'arcs.log'))
+  probe(os.path.join(dir, 'probe.log'))
+  starve(os.path.join(dir, 'starve.log'))
@@ -0,0 +1,366 @@
+/******************************************************************************\
+
+                  This file is part of the Buildbotics firmware.
+
+         Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.
+
+          This Source describes Open Hardware and is licensed under the
+                                  CERN-OHL-S v2.
+
+          You may redistribute and modify this Source and make products
+     using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).
+            This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED
+     WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS
+      FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable
+                                   conditions.
+
+                 Source location: https://github.com/buildbotics
+
+       As per CERN-OHL-S v2 section 4, should You produce hardware based on
+     these sources, You must maintain the Source Location clearly visible on
+     the external case of the CNC Controller or other product you make using
+                                   this Source.
+
+                 For more information, email info@buildbotics.com
+
+\******************************************************************************/
+
+#include "drv8711_model.h"
+
+#include <config.h>
+#include <pins.h>
+#include <drv8711.h>
+#include <estop.h>
+
+#include <avr/io.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+
+void __SPIC_INT_vect();
+
+void motor_emulate_trace(int motor, int32_t *steps, bool *negative,
+                         uint32_t *period);
+
+
+#define DRV_MAX_FAULTS 16
+#define DRV_FAULT_MASK 0x3f // Status bits which assert FAULTn
+#define DRV_RAMP_GAP   5    // ms between torque increases in one ramp
+
+
+typedef struct {
+  uint8_t motor;
+  uint8_t bit;
+  uint64_t at;     // Injection time
+  uint64_t read;   // First status read showing the fault
+} fault_t;
+
+
+typedef struct {
+  uint16_t regs[8];
+
+  bool cs;         // Chip select, active high
+  bool low;        // Next byte is the low byte of the frame
+  uint16_t cmd;
+
+  // Current ramp
+  uint64_t rampStart;
+  uint64_t lastRise;
+  uint64_t rampMS; // Longest ramp
+  unsigned torqueWrites;
+
+  // Stall
+  bool stallEnabled;
+  int32_t stallAt; // Step position
+  uint64_t stalled;
+  int32_t overshoot;
+} device_t;
+
+
+static const uint8_t cs_pins[] = {
+  SPI_CS_0_PIN, SPI_CS_1_PIN, SPI_CS_2_PIN, SPI_CS_3_PIN,
+};
+
+static const uint8_t stall_pins[] = {
+  STALL_0_PIN, STALL_1_PIN, STALL_2_PIN, STALL_3_PIN,
+};
+
+// Indexed by status bit
+static const char *fault_names[] = {
+  "ots", "aocp", "bocp", "apdf", "bpdf", "uvlo",
+};
+
+
+static struct {
+  bool enabled;
+  unsigned rate;   // SPI bytes per ms
+  uint64_t bytes;
+  uint64_t estop;  // Time estopped
+
+  device_t devices[MOTORS];
+  fault_t faults[DRV_MAX_FAULTS];
+  unsigned faultCount;
+} model;
+
+
+static void _set_pin(uint8_t pin, bool high) {
+  if (high) PIN_PORT(pin)->IN |= PIN_BM(pin);
+  else PIN_PORT(pin)->IN &= ~PIN_BM(pin);
+}
+
+
+static void _write(device_t &d, uint8_t addr, uint16_t value, uint64_t time) {
+  switch (addr) {
+  case DRV8711_STATUS_REG:
+    // Status bits are cleared by writing zeros
+    d.regs[addr] &= value;
+    break;
+
+  case DRV8711_TORQUE_REG: {
+    uint8_t last = d.regs[addr];
+    uint8_t torque = value;
+    d.torqueWrites++;
+
+    // A ramp is a run of torque increases, timed from the first to the last
+    if (last < torque) {
+      if (d.lastRise + DRV_RAMP_GAP < time) d.rampStart = time;
+      d.lastRise = time;
+
+      if (d.rampMS < time - d.rampStart) d.rampMS = time - d.rampStart;
+    }
+
+    d.regs[addr] = value;
+    break;
+  }
+
+  default: d.regs[addr] = value; break;
+  }
+}
+
+
+static void _status_read(int driver, uint16_t status, uint64_t time) {
+  for (unsigned i = 0; i < model.faultCount; i++) {
+    fault_t &f = model.faults[i];
+    if (f.motor == driver && f.at <= time && !f.read &&
+        (status & (1 << f.bit))) f.read = time;
+  }
+}
+
+
+static uint8_t _shift(int driver, uint8_t out, uint64_t time) {
+  device_t &d = model.devices[driver];
+
+  // Frame is [r/w][addr:3][data:12], read data is returned in the same frame
+  if (!d.low) {
+    d.cmd = out << 8;
+    d.low = true;
+
+    bool read = out & 0x80;
+    return read ? d.regs[(out >> 4) & 7] >> 8 & 0xf : 0;
+  }
+
+  d.cmd |= out;
+  d.low = false;
+
+  uint8_t addr = DRV8711_CMD_ADDR(d.cmd);
+  if (!DRV8711_CMD_IS_READ(d.cmd)) {
+    _write(d, addr, d.cmd & 0xfff, time);
+    return 0;
+  }
+
+  if (addr == DRV8711_STATUS_REG) _status_read(driver, d.regs[addr], time);
+  return d.regs[addr];
+}
+
+
+static void _update_port(PORT_t *port) {
+  // Emulated OUTSET and OUTCLR registers are plain memory
+  port->OUT = (port->OUT | port->OUTSET) & ~port->OUTCLR;
+  port->OUTSET = port->OUTCLR = 0;
+}
+
+
+static void _transfer(uint64_t time) {
+  for (int i = 0; i < MOTORS; i++) _update_port(PIN_PORT(cs_pins[i]));
+
+  // Frames start on the rising edge of chip select
+  int driver = -1;
+  for (int i = 0; i < MOTORS; i++) {
+    device_t &d = model.devices[i];
+    bool cs = OUT_PIN(cs_pins[i]);
+    if (cs && !d.cs) d.low = false;
+    d.cs = cs;
+    if (cs) driver = i;
+  }
+
+  uint8_t in = driver == -1 ? 0 : _shift(driver, SPIC.DATA, time);
+
+  SPIC.DATA = in;
+  SPIC.STATUS = SPI_IF_bm;
+  model.bytes++;
+  __SPIC_INT_vect();
+}
+
+
+static void _inject(uint64_t time) {
+  for (unsigned i = 0; i < model.faultCount; i++) {
+    fault_t &f = model.faults[i];
+    if (f.at == time)
+      model.devices[f.motor].regs[DRV8711_STATUS_REG] |= 1 << f.bit;
+  }
+}
+
+
+static void _stall(uint64_t time) {
+  for (int motor = 0; motor < MOTORS; motor++) {
+    device_t &d = model.devices[motor];
+    if (!d.stallEnabled) continue;
+
+    int32_t steps;
+    bool negative;
+    uint32_t period;
+    motor_emulate_trace(motor, &steps, &negative, &period);
+
+    int32_t past = d.stallAt < 0 ? d.stallAt - steps : steps - d.stallAt;
+    bool enabled = d.regs[DRV8711_CTRL_REG] & DRV8711_CTRL_ENBL_bm;
+    uint16_t &status = d.regs[DRV8711_STATUS_REG];
+
+    if (0 <= past && enabled) {
+      status |= DRV8711_STATUS_STD_bm | DRV8711_STATUS_STDLAT_bm;
+      if (!d.stalled) d.stalled = time;
+      if (d.overshoot < past) d.overshoot = past;
+
+    } else status &= ~DRV8711_STATUS_STD_bm;
+  }
+}
+
+
+static void _update_pins() {
+  bool fault = false;
+
+  for (int motor = 0; motor < MOTORS; motor++) {
+    uint16_t status = model.devices[motor].regs[DRV8711_STATUS_REG];
+    if (status & DRV_FAULT_MASK) fault = true;
+    _set_pin(stall_pins[motor], !(status & DRV8711_STATUS_STD_bm));
+  }
+
+  _set_pin(MOTOR_FAULT_PIN, !fault);
+}
+
+
+static int _fault_bit(const char *name) {
+  for (int i = 0; i < 6; i++)
+    if (!strcmp(name, fault_names[i])) return i;
+
+  return -1;
+}
+
+
+bool drv8711_model_configure(const char *options) {
+  model.enabled = true;
+  model.rate = 125;
+
+  // Datasheet reset values
+  const uint16_t regs[] = {0xc10, 0x1ff, 0x030, 0x080, 0x110, 0x040, 0xa59, 0};
+  for (int i = 0; i < MOTORS; i++)
+    memcpy(model.devices[i].regs, regs, sizeof(regs));
+
+  char *copy = strdup(options ? options : "");
+  char *save = 0;
+  bool ok = true;
+
+  for (char *opt = strtok_r(copy, ",", &save); opt && ok;
+       opt = strtok_r(0, ",", &save)) {
+    char *value = strchr(opt, '=');
+    if (value) *value++ = 0;
+
+    char *end = 0;
+    unsigned long a = value ? strtoul(value, &end, 0) : 0;
+    char sep = end ? *end : 0;
+    long b = sep ? strtol(end + 1, &end, 0) : 0;
+    bool valid = value && *value && !*end;
+    int bit = _fault_bit(opt);
+
+    if (!strcmp(opt, "rate") && valid && !sep && a) model.rate = a;
+
+    else if (0 <= bit && valid && sep == '@' && a < MOTORS && 0 <= b &&
+             model.faultCount < DRV_MAX_FAULTS) {
+      fault_t &f = model.faults[model.faultCount++];
+      f.motor = a;
+      f.bit = bit;
+      f.at = b;
+
+    } else if (!strcmp(opt, "stall") && valid && sep == ':' && a < MOTORS) {
+      model.devices[a].stallEnabled = true;
+      model.devices[a].stallAt = b;
+
+    } else {
+      fprintf(stderr, "Invalid --drv8711 option '%s'\n", opt);
+      ok = false;
+    }
+  }
+
+  free(copy);
+
+  _update_pins();
+
+  return ok;
+}
+
+
+bool drv8711_model_enabled() {return model.enabled;}
+
+
+void drv8711_model_tick(uint64_t time) {
+  if (!model.enabled) return;
+
+  _inject(time);
+  _stall(time);
+
+  for (unsigned i = 0; i < model.rate && (SPIC.INTCTRL & SPI_INTLVL_gm); i++)
+    _transfer(time);
+
+  _update_pins();
+
+  if (!model.estop && estop_triggered()) model.estop = time;
+}
+
+
+void drv8711_model_summary(FILE *f) {
+  if (!model.enabled) return;
+
+  fprintf(f, "{\"drv8711\":{\"bytes\":%llu,\"motors\":[",
+          (unsigned long long)model.bytes);
+
+  for (int motor = 0; motor < MOTORS; motor++) {
+    const device_t &d = model.devices[motor];
+
+    fprintf(f, "%s{\"torque\":%u,\"torque_writes\":%u,\"ramp\":%llu,"
+            "\"status\":%u", motor ? "," : "",
+            d.regs[DRV8711_TORQUE_REG] & 0xff, d.torqueWrites,
+            (unsigned long long)d.rampMS, d.regs[DRV8711_STATUS_REG]);
+
+    if (d.stallEnabled)
+      fprintf(f, ",\"stall\":{\"at\":%lld,\"overshoot\":%ld}",
+              d.stalled ? (long long)d.stalled : -1LL, (long)d.overshoot);
+
+    fprintf(f, "}");
+  }
+
+  // Fault times in ms, -1 if never reached
+  fprintf(f, "],\"faults\":[");
+  for (unsigned i = 0; i < model.faultCount; i++) {
+    const fault_t &fault = model.faults[i];
+    bool estop = fault.at <= model.estop && model.estop;
+
+    fprintf(f, "%s{\"motor\":%u,\"fault\":\"%s\",\"at\":%llu,\"read\":%lld,"
+            "\"estop\":%lld}", i ? "," : "", fault.motor,
+            fault_names[fault.bit], (unsigned long long)fault.at,
+            fault.read ? (long long)fault.read : -1LL,
+            estop ? (long long)model.estop : -1LL);
+  }
+
+  fprintf(f, "]}}\n");
+}
@@ -0,0 +1,55 @@
+/******************************************************************************\
+
+                  This file is part of the Buildbotics firmware.
+
+         Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.
+
+          This Source describes Open Hardware and is licensed under the
+                                  CERN-OHL-S v2.
+
+          You may redistribute and modify this Source and make products
+     using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).
+            This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED
+     WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS
+      FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable
+                                   conditions.
+
+                 Source location: https://github.com/buildbotics
+
+       As per CERN-OHL-S v2 section 4, should You produce hardware based on
+     these sources, You must maintain the Source Location clearly visible on
+     the external case of the CNC Controller or other product you make using
+                                   this Source.
+
+                 For more information, email info@buildbotics.com
+
+\******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+
+/******************************************************************************\
+
+  Emulates the four DRV8711 stepper drivers on the SPI bus.  Enabled with
+  --drv8711 optionally followed by a comma separated list of:
+
+         rate=<n>           SPI bytes per ms, default 125
+    <fault>=<motor>@<ms>    Latch a status fault at the given time, where
+                            fault is one of ots, aocp, bocp, apdf, bpdf or
+                            uvlo
+        stall=<motor>:<n>   Stall once the motor passes step position n
+
+  Faults hold the shared FAULTn line low until the firmware clears them from
+  the status register.  A stall holds the motor's STALLn line low while the
+  motor is enabled and past the stall position.
+
+\******************************************************************************/
+
+bool drv8711_model_configure(const char *options);
+bool drv8711_model_enabled();
+void drv8711_model_tick(uint64_t time);
+void drv8711_model_summary(FILE *f);
@@ -26,6 +26,16 @@
 \******************************************************************************/
 
 #include <config.h>
+#include <stepper.h>
+#include <command.h>
+#include <usart.h>
+
+#include "replay.h"
+#include "vfd_slave.h"
+#include "drv8711_model.h"
+#include "steps.h"
+#include "scenario.h"
+#include "step_test.h"
 
 #include <avr/io.h>
 
@@ -36,6 +46,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/select.h>
+#include <setjmp.h>
 
 
 void __SPIC_INT_vect();      // DRV8711 SPI
@@ -49,14 +60,38 @@ void __SERIAL_DRE_vect();    // Serial to RPi
 void __SERIAL_RXC_vect();    // Serial from RPi
 void __STEP_LOW_LEVEL_ISR(); // Stepper lo interrupt
 void __STEP_TIMER_ISR();     // Stepper hi interrupt
+void __STEP_TIMER_CCA_ISR(); // Stepper power updates
+void __STEP_TIMER_CCB_ISR(); // Stepper power updates
+void __STEP_TIMER_CCC_ISR(); // Stepper power updates
 void __RTC_OVF_vect();       // RTC tick
 
+void main_init(int argc, char *argv[]);
+void main_loop();
+
 void motor_emulate_steps(int motor);
+void motor_emulate_trace(int motor, int32_t *steps, bool *negative,
+                         uint32_t *period);
 
 extern int __argc;
 extern char **__argv;
 
 
+#define RTC_MS               4      // RTC ISR period
+#define STEP_MS              4      // Step timer move period
+#define VIRTUAL_IDLE_MS      1000   // Idle time before blocking on input
+#define VIRTUAL_I2C_POLL_MS  16     // I2C poll period while busy
+#define VIRTUAL_POLL_MAX_MS  16     // Longest input poll period without data
+#define VIRTUAL_SERIAL_BAUD  230400 // Serial input rate
+
+
+// Time ISR calls when replaying
+#define CALL_ISR(ISR, STAT) do {                \
+    uint64_t start = replay_isr_start();        \
+    ISR();                                      \
+    replay_isr_end(STAT, start);                \
+  } while (0)
+
+
 volatile uint8_t io_mem[4096] = {0};
 
 
@@ -66,16 +101,141 @@ uint8_t i2cData[I2C_MAX_DATA];
 int i2cIndex = 0;
 bool haveI2C = false;
 fd_set readFDs;
+FILE *trace = 0;
+uint64_t ticks = 0;
+
+
+// Exec requests delayed to force late exec underruns
+static struct {
+  bool enabled;
+  bool holding;
+  uint64_t until;
+} late;
+
+
+// Virtual time
+static struct {
+  bool enabled;
+  uint64_t time;   // Simulated ms
+  uint32_t idle;   // Simulated ms idle
+  float credit;    // Serial bytes which may be sent this ms
+  bool eof;
+  bool i2c;        // I2C input is open
+  uint32_t poll;   // Simulated ms between input polls, 0 after data
+  uint64_t nextPoll;
+
+  uint8_t buf[4096];
+  unsigned len;
+  unsigned next;
+} virt;
+
+
+#ifdef EMU_LIB
+// Shared library state
+FILE *emu_stdout;
+
+static struct {
+  jmp_buf reset;   // Return point for firmware resets
+  bool dead;       // Firmware has reset, reload or reinitialize
+
+  char *out;       // Serial output
+  size_t outLen;
+  size_t outSize;
+} lib;
+#endif // EMU_LIB
 
 
 void cli() {}
 void sei() {}
 
 
+static void _replay_exit() {replay_summary(stderr);}
+static void _vfd_exit() {vfd_slave_summary(stderr);}
+static void _drv8711_exit() {drv8711_model_summary(stderr);}
+static void _scenario_exit() {scenario_summary(stderr);}
+
+
+static FILE *_open_trace(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) return 0;
+
+  // Keep clear of fd 3, which is used for I2C input
+  int traceFD = fcntl(fd, F_DUPFD, 4);
+  close(fd);
+
+  return traceFD == -1 ? 0 : fdopen(traceFD, "w");
+}
+
+
+#ifdef EMU_LIB
+static ssize_t _lib_write(void *cookie, const char *data, size_t len) {
+  if (lib.outSize < lib.outLen + len) {
+    size_t size = lib.outSize ? lib.outSize : 4096;
+    while (size < lib.outLen + len) size *= 2;
+
+    char *out = (char *)realloc(lib.out, size);
+    if (!out) return -1;
+
+    lib.out = out;
+    lib.outSize = size;
+  }
+
+  memcpy(lib.out + lib.outLen, data, len);
+  lib.outLen += len;
+
+  return len;
+}
+#endif // EMU_LIB
+
+
 void emu_init() {
+#ifdef EMU_LIB
+  cookie_io_functions_t funcs = {0, _lib_write, 0, 0};
+  if (!emu_stdout) emu_stdout = fopencookie(0, "w", funcs); // Kept on reinit
+  virt.enabled = true;
+#endif // EMU_LIB
+
   // Parse command line args
   for (int i = 0; i < __argc; i++)
     if (strcmp(__argv[i], "--fast") == 0) fast = true;
+    else if (strcmp(__argv[i], "--virtual") == 0) virt.enabled = true;
+    else if (strcmp(__argv[i], "--late-exec") == 0) late.enabled = true;
+    else if (strcmp(__argv[i], "--trace") == 0 && i + 1 < __argc) {
+      const char *path = __argv[++i];
+      trace = strcmp(path, "-") ? _open_trace(path) : stderr;
+      if (!trace) {perror(path); exit(1);}
+
+    } else if (strcmp(__argv[i], "--replay") == 0 && i + 1 < __argc) {
+      const char *path = __argv[++i];
+      if (!replay_load(path)) {perror(path); exit(1);}
+      virt.enabled = true;
+      atexit(_replay_exit);
+
+    } else if (strcmp(__argv[i], "--vfd") == 0 && i + 1 < __argc) {
+      if (!vfd_slave_configure(__argv[++i])) exit(1);
+      atexit(_vfd_exit);
+
+    } else if (strcmp(__argv[i], "--drv8711") == 0) {
+      // Options are optional
+      bool options = i + 1 < __argc && strncmp(__argv[i + 1], "--", 2);
+      if (!drv8711_model_configure(options ? __argv[++i] : 0)) exit(1);
+      atexit(_drv8711_exit);
+
+    } else if (strcmp(__argv[i], "--scenario") == 0 && i + 1 < __argc) {
+      if (!scenario_load(__argv[++i])) exit(1);
+      atexit(_scenario_exit);
+
+    } else if (strcmp(__argv[i], "--step-test") == 0 && i + 1 < __argc) {
+      if (!step_test_open(__argv[++i])) exit(1);
+    }
+
+  // Trace header
+  if (trace) {
+    fprintf(trace, "time");
+    for (int motor = 0; motor < 4; motor++)
+      fprintf(trace, ",%d_steps,%d_dir,%d_period", motor, motor, motor);
+    fprintf(trace, "\n");
+  }
 
   // Mark clocks ready
   OSC.STATUS = OSC_XOSCRDY_bm | OSC_PLLRDY_bm | OSC_RC32KRDY_bm;
@@ -86,14 +246,229 @@ void emu_init() {
   // Clear motor fault
   PIN_PORT(MOTOR_FAULT_PIN)->IN |= PIN_BM(MOTOR_FAULT_PIN);
 
+  // Switch inputs read open, as with nothing connected to the pull-ups
+  const uint8_t ioPins[] = {
+    IO_03_PIN, IO_04_PIN, IO_05_PIN, IO_08_PIN, IO_09_PIN, IO_10_PIN,
+    IO_11_PIN, IO_12_PIN, IO_22_PIN, IO_23_PIN,
+  };
+  for (unsigned i = 0; i < sizeof(ioPins); i++)
+    PIN_PORT(ioPins[i])->IN |= PIN_BM(ioPins[i]);
+
   FD_ZERO(&readFDs);
+
+#ifndef EMU_LIB
+  virt.i2c = !replay_enabled() && fcntl(3, F_GETFL) != -1;
+#endif
+}
+
+
+void emu_reset() {
+#ifdef EMU_LIB
+  lib.dead = true;
+  longjmp(lib.reset, 1);
+#else
+  exit(0);
+#endif
+}
+
+
+static void _send_i2c() {
+  if (!haveI2C || !(I2C_DEV.SLAVE.CTRLA & TWI_SLAVE_INTLVL_LO_gc)) return;
+
+  // START
+  I2C_DEV.SLAVE.STATUS = TWI_SLAVE_APIF_bm | TWI_SLAVE_AP_bm;
+  __I2C_ISR();
+
+  // DATA
+  for (int i = 0; i < i2cIndex; i++) {
+    I2C_DEV.SLAVE.STATUS = TWI_SLAVE_DIF_bm;
+    I2C_DEV.SLAVE.DATA = i2cData[i];
+    __I2C_ISR();
+  }
+
+  // STOP
+  I2C_DEV.SLAVE.STATUS = TWI_SLAVE_APIF_bm;
+  __I2C_ISR();
+
+  i2cIndex = 0;
+  haveI2C = false;
+}
+
+
+static bool _send_serial(uint8_t data) {
+  if (!(SERIAL_PORT.CTRLA & USART_RXCINTLVL_MED_gc)) return false;
+
+  SERIAL_PORT.DATA = data;
+  CALL_ISR(__SERIAL_RXC_vect, REPLAY_ISR_SERIAL);
+
+  // Receive interrupt is disabled when the input buffer is full
+  return SERIAL_PORT.CTRLA & USART_RXCINTLVL_MED_gc;
+}
+
+
+static void _trace() {
+  fprintf(trace, "%llu", (unsigned long long)ticks);
+
+  for (int motor = 0; motor < 4; motor++) {
+    int32_t steps;
+    bool negative;
+    uint32_t period;
+
+    motor_emulate_trace(motor, &steps, &negative, &period);
+    fprintf(trace, ",%ld,%d,%lu", (long)steps, negative ? -1 : 1,
+            (unsigned long)period);
+  }
+
+  fprintf(trace, "\n");
+}
+
+
+/// With --late-exec, exec requests made while the command queue is empty,
+/// as when the host falls behind, run a step period late
+static bool _hold_exec() {
+  if (!late.enabled) return false;
+
+  if (!late.holding) {
+    if (command_get_count()) return false;
+    late.holding = true;
+    late.until = ticks + STEP_MS;
+  }
+
+  return ticks < late.until;
+}
+
+
+static void _tick(bool rtc) {
+  // Call stepper ISRs
+  if (ADCB_CH0_INTCTRL == ADC_CH_INTLVL_LO_gc && !_hold_exec()) {
+    CALL_ISR(__STEP_LOW_LEVEL_ISR, REPLAY_ISR_LOW_LEVEL);
+    late.holding = false;
+  }
+  for (int motor = 0; motor < 4; motor++) motor_emulate_steps(motor);
+  CALL_ISR(__STEP_TIMER_ISR, REPLAY_ISR_STEP_TIMER);
+  if (trace) _trace();
+  replay_tick(ticks);
+  vfd_slave_tick(ticks);
+  drv8711_model_tick(ticks);
+  steps_tick(ticks);
+  scenario_tick(ticks);
+  step_test_tick(ticks);
+  ticks++;
+
+  // Call step timer compare ISRs in order within the 1ms tick
+#if 1 < POWER_UPDATES_PER_MS
+  if (TIMER_STEP.INTCTRLB & TC0_CCAINTLVL_gm)
+    CALL_ISR(__STEP_TIMER_CCA_ISR, REPLAY_ISR_POWER);
+#endif
+#if 2 < POWER_UPDATES_PER_MS
+  if (TIMER_STEP.INTCTRLB & TC0_CCBINTLVL_gm)
+    CALL_ISR(__STEP_TIMER_CCB_ISR, REPLAY_ISR_POWER);
+#endif
+#if 3 < POWER_UPDATES_PER_MS
+  if (TIMER_STEP.INTCTRLB & TC0_CCCINTLVL_gm)
+    CALL_ISR(__STEP_TIMER_CCC_ISR, REPLAY_ISR_POWER);
+#endif
+
+  // Call RTC
+  if (rtc) CALL_ISR(__RTC_OVF_vect, REPLAY_ISR_RTC);
+}
+
+
+#ifndef EMU_LIB
+static void _virtual_read(bool block) {
+  bool input = !virt.eof && virt.next == virt.len;
+
+  FD_ZERO(&readFDs);
+  if (input) FD_SET(0, &readFDs);
+  if (virt.i2c && !haveI2C) FD_SET(3, &readFDs);
+
+  struct timeval t = {0, 0};
+  if (select(4, &readFDs, 0, 0, block ? 0 : &t) <= 0) FD_ZERO(&readFDs);
+
+  if (FD_ISSET(0, &readFDs)) {
+    ssize_t len = read(0, virt.buf, sizeof(virt.buf));
+    if (len <= 0) virt.eof = true;
+    else {
+      virt.len = len;
+      virt.next = 0;
+    }
+
+    virt.poll = 0;
+
+  } else if (input) {
+    // Back off while the host has not written
+    virt.poll = virt.poll ? virt.poll * 2 : 1;
+    if (VIRTUAL_POLL_MAX_MS < virt.poll) virt.poll = VIRTUAL_POLL_MAX_MS;
+    virt.nextPoll = virt.time + virt.poll;
+  }
+
+  if (FD_ISSET(3, &readFDs)) {
+    uint8_t data;
+
+    while (!haveI2C && read(3, &data, 1) == 1)
+      if (data == '\n') haveI2C = true;
+      else if (i2cIndex < I2C_MAX_DATA) i2cData[i2cIndex++] = data;
+  }
+}
+#endif // EMU_LIB
+
+
+static void _virtual_callback() {
+  // Track time with nothing to do
+  bool idle = !st_is_busy() && !command_get_count() && usart_rx_empty() &&
+    virt.next == virt.len && !haveI2C;
+  virt.idle = idle ? virt.idle + 1 : 0;
+
+#ifndef EMU_LIB // Library input is pushed by the caller
+  bool waiting = VIRTUAL_IDLE_MS <= virt.idle;
+
+  // Done when idle after the end of input
+  if (waiting && virt.eof && !virt.i2c) exit(0);
+
+  // Replay input is paced by the serial rate below
+  if (replay_enabled() && !virt.eof && virt.next == virt.len) {
+    virt.len = replay_read(virt.buf, sizeof(virt.buf));
+    virt.next = 0;
+    virt.eof = !virt.len;
+
+  // Only poll inputs when out of data, while waiting or to check I2C.  Serial
+  // input is polled less often while none arrives and not while the firmware
+  // cannot take it.
+  } else if ((!virt.eof && virt.next == virt.len &&
+              (waiting || (virt.nextPoll <= virt.time &&
+                           (SERIAL_PORT.CTRLA & USART_RXCINTLVL_MED_gc)))) ||
+             (virt.i2c && !(virt.time % VIRTUAL_I2C_POLL_MS)))
+    _virtual_read(waiting);
+#endif
+
+  _send_i2c();
+
+  // Send serial data at baud rate
+  const float bytesPerMS = VIRTUAL_SERIAL_BAUD / 10.0 / 1000;
+  virt.credit += bytesPerMS;
+  if (bytesPerMS < virt.credit) virt.credit = bytesPerMS;
+
+  while (1 <= virt.credit && virt.next < virt.len &&
+         _send_serial(virt.buf[virt.next])) {
+    virt.next++;
+    virt.credit--;
+  }
+
+  // Advance simulated time
+  _tick(!(virt.time % RTC_MS));
+  virt.time++;
 }
 
 
 void emu_callback() {
   fflush(stdout);
 
-  if (RST.CTRL == RST_SWRST_bm) exit(0);
+  if (RST.CTRL == RST_SWRST_bm) emu_reset();
+
+  if (virt.enabled) {
+    _virtual_callback();
+    return;
+  }
 
   struct timeval t = {0, fast ? 0 : 1000};
   bool readData = true;
@@ -118,46 +493,102 @@ void emu_callback() {
 
     // Send message to i2c port
     if (haveI2C && (I2C_DEV.SLAVE.CTRLA & TWI_SLAVE_INTLVL_LO_gc)) {
-      // START
-      I2C_DEV.SLAVE.STATUS = TWI_SLAVE_APIF_bm | TWI_SLAVE_AP_bm;
-      __I2C_ISR();
-
-      // DATA
-      for (int i = 0; i < i2cIndex; i++) {
-        I2C_DEV.SLAVE.STATUS = TWI_SLAVE_DIF_bm;
-        I2C_DEV.SLAVE.DATA = i2cData[i];
-        __I2C_ISR();
-      }
-
-      // STOP
-      I2C_DEV.SLAVE.STATUS = TWI_SLAVE_APIF_bm;
-      __I2C_ISR();
-
-      i2cIndex = 0;
-      haveI2C = false;
+      _send_i2c();
       readData = true;
     }
 
     // Send byte to serial port
-    if (serialByte != -1 && SERIAL_PORT.CTRLA & USART_RXCINTLVL_MED_gc) {
-      SERIAL_PORT.DATA = (uint8_t)serialByte;
-      __SERIAL_RXC_vect();
-
-      if (SERIAL_PORT.CTRLA & USART_RXCINTLVL_MED_gc) {
-        serialByte = -1;
-        readData = true;
-      }
+    if (serialByte != -1 && _send_serial((uint8_t)serialByte)) {
+      serialByte = -1;
+      readData = true;
     }
   }
 
-  // Call stepper ISRs
-  if (ADCB_CH0_INTCTRL == ADC_CH_INTLVL_LO_gc) __STEP_LOW_LEVEL_ISR();
-  for (int motor = 0; motor < 4; motor++) motor_emulate_steps(motor);
-  __STEP_TIMER_ISR();
-
-  // Call RTC
-  __RTC_OVF_vect();
+  _tick(true);
 
   // Throttle with remaining time
   if (t.tv_usec) usleep(t.tv_usec);
 }
+
+
+#ifdef EMU_LIB
+// Shared library interface.  Simulated time only advances in bbemu_step().
+// Functions return -1 once the firmware has reset.
+extern "C" {
+  int bbemu_init(int argc, char *argv[]) {
+    if (setjmp(lib.reset)) return -1;
+
+    // Discard pending serial input from before a reset
+    lib.dead = false;
+    virt.len = virt.next = 0;
+
+    main_init(argc, argv);
+    return 0;
+  }
+
+
+  int bbemu_step(unsigned ms) {
+    if (lib.dead || setjmp(lib.reset)) return -1;
+    for (unsigned i = 0; i < ms; i++) main_loop();
+    return 0;
+  }
+
+
+  int bbemu_write_serial(const uint8_t *data, unsigned len) {
+    if (lib.dead) return -1;
+
+    // Compact unsent data
+    virt.len -= virt.next;
+    memmove(virt.buf, virt.buf + virt.next, virt.len);
+    virt.next = 0;
+
+    unsigned space = sizeof(virt.buf) - virt.len;
+    if (space < len) len = space;
+
+    memcpy(virt.buf + virt.len, data, len);
+    virt.len += len;
+
+    return len;
+  }
+
+
+  int bbemu_serial_pending() {return virt.len - virt.next;}
+
+
+  int bbemu_read_serial(uint8_t *data, unsigned len) {
+    fflush(emu_stdout);
+
+    if (lib.outLen < len) len = lib.outLen;
+    memcpy(data, lib.out, len);
+
+    lib.outLen -= len;
+    memmove(lib.out, lib.out + len, lib.outLen);
+
+    return len;
+  }
+
+
+  int bbemu_i2c_write(const uint8_t *data, unsigned len) {
+    if (lib.dead) return -1;
+    if (haveI2C) return 0; // Previous message not yet delivered
+
+    if (I2C_MAX_DATA < len) len = I2C_MAX_DATA;
+    memcpy(i2cData, data, len);
+    i2cIndex = len;
+    haveI2C = true;
+
+    return len;
+  }
+
+
+  void bbemu_free() {
+    // Streams must be closed before the library is unloaded
+    if (emu_stdout) fclose(emu_stdout);
+    if (trace && trace != stderr) fclose(trace);
+    free(lib.out);
+
+    emu_stdout = trace = 0;
+    lib.out = 0;
+  }
+}
+#endif // EMU_LIB
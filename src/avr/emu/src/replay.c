@@ -0,0 +1,288 @@
+/******************************************************************************\
+
+                  This file is part of the Buildbotics firmware.
+
+         Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.
+
+          This Source describes Open Hardware and is licensed under the
+                                  CERN-OHL-S v2.
+
+          You may redistribute and modify this Source and make products
+     using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).
+            This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED
+     WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS
+      FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable
+                                   conditions.
+
+                 Source location: https://github.com/buildbotics
+
+       As per CERN-OHL-S v2 section 4, should You produce hardware based on
+     these sources, You must maintain the Source Location clearly visible on
+     the external case of the CNC Controller or other product you make using
+                                   this Source.
+
+                 For more information, email info@buildbotics.com
+
+\******************************************************************************/
+
+#include "replay.h"
+
+#include <config.h>
+#include <stepper.h>
+#include <command.h>
+#include <util.h>
+#include <base64.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+uint32_t get_underrun_empty();
+uint32_t get_underrun_held();
+uint32_t get_underrun_late();
+
+
+#define REPLAY_PREFIX ":Comm:< "
+
+
+typedef struct {
+  uint64_t count;
+  uint64_t total; // ns
+  uint64_t max;   // ns
+} isr_stat_t;
+
+
+typedef struct {
+  uint64_t time;
+  uint16_t id;
+} id_event_t;
+
+
+static const char *isr_names[] = {
+  "low_level", "step_timer", "power", "rtc", "serial",
+};
+
+
+static struct {
+  const char *path;
+  char *data;
+  size_t len;
+  size_t next;
+
+  unsigned commands;
+  double planned;      // ms
+
+  uint64_t busy;       // ms
+  uint64_t lastBusy;   // ms
+  unsigned maxDepth;
+  isr_stat_t isrs[REPLAY_ISR_COUNT];
+
+  id_event_t *ids;
+  unsigned idCount;
+  unsigned idSize;
+} replay;
+
+
+static void _append(char c) {
+  static size_t size = 0;
+
+  if (size <= replay.len) {
+    size = size ? size * 2 : 65536;
+    replay.data = (char *)realloc(replay.data, size);
+    if (!replay.data) {perror("replay"); exit(1);}
+  }
+
+  replay.data[replay.len++] = c;
+}
+
+
+/// Undo the JSON string escaping applied by Comm._prep_command()
+static void _unescape(const char *s) {
+  while (*s && *s != '\n') {
+    char c = *s++;
+
+    if (c == '\\' && *s) {
+      c = *s++;
+
+      switch (c) {
+      case 'b': c = '\b'; break;
+      case 'f': c = '\f'; break;
+      case 'n': c = '\n'; break;
+      case 'r': c = '\r'; break;
+      case 't': c = '\t'; break;
+
+      case 'u': {
+        unsigned x = 0;
+        if (sscanf(s, "%4x", &x) == 1 && strlen(s) >= 4) s += 4;
+        c = x < 0x100 ? x : '?';
+        break;
+      }
+
+      default: break; // \" \\ \/
+      }
+    }
+
+    _append(c);
+  }
+
+  _append('\n');
+}
+
+
+static float _planned_time(char *cmd) {
+  float time = 0;
+
+  switch (*cmd++) {
+  case COMMAND_line: {
+    float x, axes[AXES];
+    for (int i = 0; i < 3; i++)
+      if (!decode_float(&cmd, &x)) return 0;
+    if (decode_axes(&cmd, axes)) return 0;
+
+    while ('0' <= *cmd && *cmd <= '6') {
+      cmd++;
+      if (!decode_float(&cmd, &x)) return 0;
+      time += x;
+    }
+
+    return time * 60000; // minutes to ms
+  }
+
+  case COMMAND_dwell:
+    return b64_decode_float(cmd, &time) ? time * 1000 : 0;
+  }
+
+  return 0;
+}
+
+
+bool replay_load(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) return false;
+
+  replay.path = path;
+
+  char *line = 0;
+  size_t size = 0;
+
+  while (getline(&line, &size, f) != -1) {
+    // Only host to AVR lines, e.g. "I:Comm:< #id=1\nl..."
+    if (line[0] == 0 || strncmp(line + 1, REPLAY_PREFIX,
+                                strlen(REPLAY_PREFIX))) continue;
+
+    size_t start = replay.len;
+    _unescape(line + 1 + strlen(REPLAY_PREFIX));
+
+    // Account for each command
+    for (size_t i = start; i < replay.len; i++) {
+      size_t end = i;
+      while (replay.data[end] != '\n') end++;
+
+      replay.data[end] = 0;
+      replay.planned += _planned_time(replay.data + i);
+      replay.data[end] = '\n';
+
+      replay.commands++;
+      i = end;
+    }
+  }
+
+  free(line);
+  fclose(f);
+
+  return true;
+}
+
+
+bool replay_enabled() {return replay.path;}
+
+
+unsigned replay_read(uint8_t *buf, unsigned len) {
+  if (replay.len - replay.next < len) len = replay.len - replay.next;
+  memcpy(buf, replay.data + replay.next, len);
+  replay.next += len;
+  return len;
+}
+
+
+void replay_tick(uint64_t time) {
+  if (!replay.path) return;
+
+  unsigned depth = command_get_count();
+  if (replay.maxDepth < depth) replay.maxDepth = depth;
+
+  if (st_is_busy() || depth) {
+    replay.busy++;
+    replay.lastBusy = time + 1;
+  }
+
+  // Command ID timeline
+  uint16_t id = command_get_id();
+  if (replay.idCount && replay.ids[replay.idCount - 1].id == id) return;
+
+  if (replay.idCount == replay.idSize) {
+    replay.idSize = replay.idSize ? replay.idSize * 2 : 1024;
+    replay.ids = (id_event_t *)
+      realloc(replay.ids, replay.idSize * sizeof(id_event_t));
+    if (!replay.ids) {perror("replay"); exit(1);}
+  }
+
+  replay.ids[replay.idCount].time = time;
+  replay.ids[replay.idCount++].id = id;
+}
+
+
+static uint64_t _now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+uint64_t replay_isr_start() {return replay.path ? _now() : 0;}
+
+
+void replay_isr_end(replay_isr_t isr, uint64_t start) {
+  if (!replay.path) return;
+
+  uint64_t delta = _now() - start;
+  isr_stat_t &s = replay.isrs[isr];
+  s.count++;
+  s.total += delta;
+  if (s.max < delta) s.max = delta;
+}
+
+
+void replay_summary(FILE *f) {
+  if (!replay.path) return;
+
+  fprintf(f, "{\"log\":\"%s\",\"bytes\":%lu,\"commands\":%u,", replay.path,
+          (unsigned long)replay.len, replay.commands);
+  fprintf(f, "\"time\":%llu,\"busy\":%llu,\"planned\":%.3f,",
+          (unsigned long long)replay.lastBusy,
+          (unsigned long long)replay.busy, replay.planned);
+  fprintf(f, "\"underruns\":{\"empty\":%lu,\"held\":%lu,\"late\":%lu},",
+          (unsigned long)get_underrun_empty(),
+          (unsigned long)get_underrun_held(),
+          (unsigned long)get_underrun_late());
+  fprintf(f, "\"max_depth\":%u,", replay.maxDepth);
+
+  // ISR host CPU cost in ns, only an estimate of AVR cost
+  fprintf(f, "\"isrs\":{");
+  for (int i = 0; i < REPLAY_ISR_COUNT; i++) {
+    const isr_stat_t &s = replay.isrs[i];
+    fprintf(f, "%s\"%s\":{\"count\":%llu,\"mean\":%.1f,\"max\":%llu}",
+            i ? "," : "", isr_names[i], (unsigned long long)s.count,
+            s.count ? (double)s.total / s.count : 0.0,
+            (unsigned long long)s.max);
+  }
+
+  // Command ID timeline as [ms, id] pairs
+  fprintf(f, "},\"ids\":[");
+  for (unsigned i = 0; i < replay.idCount; i++)
+    fprintf(f, "%s[%llu,%u]", i ? "," : "",
+            (unsigned long long)replay.ids[i].time, replay.ids[i].id);
+  fprintf(f, "]}\n");
+}
@@ -0,0 +1,53 @@
+/******************************************************************************\
+
+                  This file is part of the Buildbotics firmware.
+
+         Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.
+
+          This Source describes Open Hardware and is licensed under the
+                                  CERN-OHL-S v2.
+
+          You may redistribute and modify this Source and make products
+     using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).
+            This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED
+     WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS
+      FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable
+                                   conditions.
+
+                 Source location: https://github.com/buildbotics
+
+       As per CERN-OHL-S v2 section 4, should You produce hardware based on
+     these sources, You must maintain the Source Location clearly visible on
+     the external case of the CNC Controller or other product you make using
+                                   this Source.
+
+                 For more information, email info@buildbotics.com
+
+\******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+
+// Replays serial commands recorded in a bbctrl log and summarizes the run
+
+typedef enum {
+  REPLAY_ISR_LOW_LEVEL,
+  REPLAY_ISR_STEP_TIMER,
+  REPLAY_ISR_POWER,
+  REPLAY_ISR_RTC,
+  REPLAY_ISR_SERIAL,
+  REPLAY_ISR_COUNT
+} replay_isr_t;
+
+
+bool replay_load(const char *path);
+bool replay_enabled();
+unsigned replay_read(uint8_t *buf, unsigned len);
+void replay_tick(uint64_t time);
+uint64_t replay_isr_start();
+void replay_isr_end(replay_isr_t isr, uint64_t start);
+void replay_summary(FILE *f);
@@ -0,0 +1,349 @@
+/******************************************************************************\
+
+                  This file is part of the Buildbotics firmware.
+
+         Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.
+
+          This Source describes Open Hardware and is licensed under the
+                                  CERN-OHL-S v2.
+
+          You may redistribute and modify this Source and make products
+     using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).
+            This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED
+     WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS
+      FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable
+                                   conditions.
+
+                 Source location: https://github.com/buildbotics
+
+       As per CERN-OHL-S v2 section 4, should You produce hardware based on
+     these sources, You must maintain the Source Location clearly visible on
+     the external case of the CNC Controller or other product you make using
+                                   this Source.
+
+                 For more information, email info@buildbotics.com
+
+\******************************************************************************/
+
+#include "scenario.h"
+#include "steps.h"
+
+#include <config.h>
+#include <pins.h>
+#include <io.h>
+#include <axis.h>
+
+#include <avr/io.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+
+uint8_t get_io_function(int index);
+uint8_t get_io_mode(int index);
+
+
+#define SCENARIO_MAX_EVENTS 64
+
+
+typedef enum {WHEN_TIME, WHEN_AFTER, WHEN_ABOVE, WHEN_BELOW} when_t;
+
+
+typedef struct {
+  unsigned line;
+  when_t when;
+  int axis;
+  float value;         // ms or mm
+  const struct input_t *input;
+  bool active;
+
+  bool fired;
+  uint64_t at;
+  bool mapped;         // Input was mapped to a pin when fired
+  float start[AXES];   // Axis positions when fired
+
+  bool stopped;
+  uint64_t stop;
+  float travel[AXES];
+} event_t;
+
+
+typedef struct input_t {
+  const char *name;
+  io_function_t function;
+  uint8_t pin;         // Hard wired pins only
+} input_t;
+
+
+static const input_t inputs[] = {
+  {"estop",  INPUT_ESTOP},
+  {"probe",  INPUT_PROBE},
+  {"input0", INPUT_0}, {"input1", INPUT_1},
+  {"input2", INPUT_2}, {"input3", INPUT_3},
+  {"min0",   INPUT_MOTOR_0_MIN}, {"min1", INPUT_MOTOR_1_MIN},
+  {"min2",   INPUT_MOTOR_2_MIN}, {"min3", INPUT_MOTOR_3_MIN},
+  {"max0",   INPUT_MOTOR_0_MAX}, {"max1", INPUT_MOTOR_1_MAX},
+  {"max2",   INPUT_MOTOR_2_MAX}, {"max3", INPUT_MOTOR_3_MAX},
+  {"stall0", INPUT_STALL_0, STALL_0_PIN},
+  {"stall1", INPUT_STALL_1, STALL_1_PIN},
+  {"stall2", INPUT_STALL_2, STALL_2_PIN},
+  {"stall3", INPUT_STALL_3, STALL_3_PIN},
+  {"fault",  INPUT_MOTOR_FAULT, MOTOR_FAULT_PIN},
+  {0},
+};
+
+
+// Remappable pins in the order of the io function map, see io.c
+static const uint8_t io_pins[IO_PINS] = {
+  IO_01_PIN, IO_02_PIN, IO_03_PIN, IO_04_PIN, IO_05_PIN, IO_08_PIN, IO_09_PIN,
+  IO_10_PIN, IO_11_PIN, IO_12_PIN, IO_15_PIN, IO_16_PIN, IO_18_PIN, IO_21_PIN,
+  IO_22_PIN, IO_23_PIN, IO_24_PIN,
+};
+
+
+static struct {
+  const char *path;
+  event_t events[SCENARIO_MAX_EVENTS];
+  unsigned count;
+
+  const input_t *used[SCENARIO_MAX_EVENTS];
+  bool active[IO_FUNCTION_COUNT];
+  unsigned usedCount;
+
+  float last[MOTORS];  // Motor positions in the previous ms
+} scenario;
+
+
+static const input_t *_find_input(const char *name) {
+  for (int i = 0; inputs[i].name; i++)
+    if (!strcmp(name, inputs[i].name)) return &inputs[i];
+
+  return 0;
+}
+
+
+static bool _parse_time(const char *s, float *ms) {
+  char *end;
+  *ms = strtod(s, &end);
+
+  if (end == s || *ms < 0) return false;
+  if (!strcmp(end, "ms")) return true;
+  if (!strcmp(end, "s")) {*ms *= 1000; return true;}
+
+  return false;
+}
+
+
+static bool _parse_when(const char *s, event_t &e) {
+  if (*s == '+') {
+    e.when = WHEN_AFTER;
+    return _parse_time(s + 1, &e.value);
+  }
+
+  if (s[1] == '>' || s[1] == '<') {
+    e.axis = axis_get_id(*s);
+    e.when = s[1] == '>' ? WHEN_ABOVE : WHEN_BELOW;
+
+    char *end;
+    e.value = strtod(s + 2, &end);
+    return 0 <= e.axis && end != s + 2 && !*end;
+  }
+
+  e.when = WHEN_TIME;
+  return _parse_time(s, &e.value);
+}
+
+
+static bool _parse_line(char *line, unsigned number) {
+  char *comment = strchr(line, '#');
+  if (comment) *comment = 0;
+
+  char *save = 0;
+  char *when = strtok_r(line, " \t\r\n", &save);
+  if (!when) return true; // Blank
+
+  char *name = strtok_r(0, " \t\r\n", &save);
+  char *state = strtok_r(0, " \t\r\n", &save);
+  const input_t *input = name ? _find_input(name) : 0;
+
+  if (scenario.count == SCENARIO_MAX_EVENTS) {
+    fprintf(stderr, "%s:%u: Too many events\n", scenario.path, number);
+    return false;
+  }
+
+  event_t &e = scenario.events[scenario.count];
+  e.line = number;
+
+  if (!_parse_when(when, e) || !input || !state ||
+      (strcmp(state, "on") && strcmp(state, "off")) ||
+      strtok_r(0, " \t\r\n", &save) ||
+      (e.when == WHEN_AFTER && !scenario.count)) {
+    fprintf(stderr, "%s:%u: Invalid scenario line\n", scenario.path, number);
+    return false;
+  }
+
+  e.input = input;
+  e.active = !strcmp(state, "on");
+  scenario.count++;
+
+  for (unsigned i = 0; i < scenario.usedCount; i++)
+    if (scenario.used[i] == input) return true;
+  scenario.used[scenario.usedCount++] = input;
+
+  return true;
+}
+
+
+/// Pin and active level for an input, false if not mapped
+static bool _input_pin(const input_t *input, uint8_t *pin, bool *activeHigh) {
+  if (input->pin) {
+    *pin = input->pin;
+    *activeHigh = false; // Normally open
+    return true;
+  }
+
+  for (int i = 0; i < IO_PINS; i++)
+    if (get_io_function(i) == input->function) {
+      *pin = io_pins[i];
+      *activeHigh = get_io_mode(i) == NORMALLY_CLOSED;
+      return true;
+    }
+
+  return false;
+}
+
+
+static void _update_pins() {
+  for (unsigned i = 0; i < scenario.usedCount; i++) {
+    const input_t *input = scenario.used[i];
+    uint8_t pin;
+    bool activeHigh;
+
+    if (!_input_pin(input, &pin, &activeHigh)) continue;
+
+    if (scenario.active[input->function] == activeHigh)
+      PIN_PORT(pin)->IN |= PIN_BM(pin);
+    else PIN_PORT(pin)->IN &= ~PIN_BM(pin);
+  }
+}
+
+
+static bool _triggered(const event_t &e, const event_t *prev, uint64_t time) {
+  switch (e.when) {
+  case WHEN_TIME: return e.value <= time;
+  case WHEN_AFTER: return prev->fired && prev->at + e.value <= time;
+  case WHEN_ABOVE: return e.value < steps_axis_position(e.axis);
+  case WHEN_BELOW: return steps_axis_position(e.axis) < e.value;
+  }
+
+  return false;
+}
+
+
+static void _stopped(event_t &e, uint64_t time) {
+  e.stopped = true;
+  e.stop = time;
+
+  for (int axis = 0; axis < AXES; axis++)
+    e.travel[axis] = steps_axis_position(axis) - e.start[axis];
+}
+
+
+static void _fire(event_t &e, uint64_t time, bool moving) {
+  uint8_t pin;
+  bool activeHigh;
+
+  e.fired = true;
+  e.at = time;
+  e.mapped = _input_pin(e.input, &pin, &activeHigh);
+  scenario.active[e.input->function] = e.active;
+
+  for (int axis = 0; axis < AXES; axis++)
+    e.start[axis] = steps_axis_position(axis);
+
+  if (!moving) _stopped(e, time);
+}
+
+
+bool scenario_load(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {perror(path); return false;}
+
+  scenario.path = path;
+
+  char *line = 0;
+  size_t size = 0;
+  unsigned number = 0;
+  bool ok = true;
+
+  while (ok && getline(&line, &size, f) != -1)
+    ok = _parse_line(line, ++number);
+
+  free(line);
+  fclose(f);
+
+  return ok;
+}
+
+
+void scenario_tick(uint64_t time) {
+  if (!scenario.path) return;
+
+  bool moving = false;
+  for (int motor = 0; motor < MOTORS; motor++) {
+    float position = steps_position(motor);
+    if (position != scenario.last[motor]) moving = true;
+    scenario.last[motor] = position;
+  }
+
+  for (unsigned i = 0; i < scenario.count; i++) {
+    event_t &e = scenario.events[i];
+
+    if (!e.fired && _triggered(e, i ? &scenario.events[i - 1] : 0, time))
+      _fire(e, time, moving);
+
+    else if (e.fired && !e.stopped && !moving) _stopped(e, time);
+  }
+
+  _update_pins();
+}
+
+
+void scenario_summary(FILE *f) {
+  if (!scenario.path) return;
+
+  fprintf(f, "{\"scenario\":{\"path\":\"%s\",\"events\":[", scenario.path);
+
+  for (unsigned i = 0; i < scenario.count; i++) {
+    const event_t &e = scenario.events[i];
+
+    fprintf(f, "%s{\"line\":%u,\"input\":\"%s\",\"state\":\"%s\"",
+            i ? "," : "", e.line, e.input->name, e.active ? "on" : "off");
+
+    if (e.fired) {
+      fprintf(f, ",\"at\":%llu,\"mapped\":%s", (unsigned long long)e.at,
+              e.mapped ? "true" : "false");
+
+      if (e.stopped && e.at < e.stop) {
+        fprintf(f, ",\"stop\":%llu,\"travel\":{",
+                (unsigned long long)e.stop);
+
+        bool first = true;
+        for (int axis = 0; axis < AXES; axis++)
+          if (isfinite(e.travel[axis]) && e.travel[axis]) {
+            fprintf(f, "%s\"%c\":%g", first ? "" : ",", "xyzabc"[axis],
+                    e.travel[axis]);
+            first = false;
+          }
+
+        fprintf(f, "}");
+      }
+    }
+
+    fprintf(f, "}");
+  }
+
+  fprintf(f, "]}}\n");
+}
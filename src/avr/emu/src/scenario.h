@@ -0,0 +1,55 @@
+/******************************************************************************\
+
+                  This file is part of the Buildbotics firmware.
+
+         Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.
+
+          This Source describes Open Hardware and is licensed under the
+                                  CERN-OHL-S v2.
+
+          You may redistribute and modify this Source and make products
+     using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).
+            This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED
+     WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS
+      FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable
+                                   conditions.
+
+                 Source location: https://github.com/buildbotics
+
+       As per CERN-OHL-S v2 section 4, should You produce hardware based on
+     these sources, You must maintain the Source Location clearly visible on
+     the external case of the CNC Controller or other product you make using
+                                   this Source.
+
+                 For more information, email info@buildbotics.com
+
+\******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+
+/******************************************************************************\
+
+  Drives emulated input pins from a scenario file given with
+  --scenario <file>.  Each line is "<when> <input> <on|off>" where when is
+  one of:
+
+       <t>s, <t>ms     At a simulated time
+      +<t>s, +<t>ms    After the previous line fired
+      <axis>[<>]<mm>   When the axis position passes a value, e.g. x>12.3
+
+  and input is estop, probe, input0-3, min0-3, max0-3, stall0-3 or fault.
+  Blank lines and text after # are ignored.  Inputs are set through the pin
+  the function is mapped to and its mode.  Inputs used by the scenario are
+  held inactive until set.  For each line the summary gives the time it fired
+  and, if motors were moving, when they stopped and the travel after firing.
+
+\******************************************************************************/
+
+bool scenario_load(const char *path);
+void scenario_tick(uint64_t time);
+void scenario_summary(FILE *f);
@@ -0,0 +1,127 @@
+/******************************************************************************\
+
+                  This file is part of the Buildbotics firmware.
+
+         Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.
+
+          This Source describes Open Hardware and is licensed under the
+                                  CERN-OHL-S v2.
+
+          You may redistribute and modify this Source and make products
+     using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).
+            This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED
+     WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS
+      FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable
+                                   conditions.
+
+                 Source location: https://github.com/buildbotics
+
+       As per CERN-OHL-S v2 section 4, should You produce hardware based on
+     these sources, You must maintain the Source Location clearly visible on
+     the external case of the CNC Controller or other product you make using
+                                   this Source.
+
+                 For more information, email info@buildbotics.com
+
+\******************************************************************************/
+
+#include "step_test.h"
+#include "steps.h"
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+void motor_emulate_trace(int motor, int32_t *steps, bool *negative,
+                         uint32_t *period);
+bool get_reverse(int motor);
+
+
+#define STEP_TEST_MS 10 // Report period, same as the fixture
+
+
+static struct {
+  FILE *out;
+  uint64_t next;
+
+  int32_t commanded[MOTORS]; // Last commanded steps
+  int32_t position[MOTORS];  // Last emulated step position
+  int32_t count[MOTORS];     // Pulses counted by the fixture
+  int32_t reported[MOTORS];
+} test;
+
+
+static FILE *_open_pty() {
+  int fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (fd == -1 || grantpt(fd) || unlockpt(fd)) {perror("pty"); return 0;}
+
+  // Keep clear of fd 3, which is used for I2C input
+  int ptyFD = fcntl(fd, F_DUPFD, 4);
+  close(fd);
+  if (ptyFD == -1) {perror("pty"); return 0;}
+
+  // Writes block until plot_velocity.py opens the port and reads
+  fprintf(stderr, "Step test on %s\n", ptsname(ptyFD));
+  FILE *f = fdopen(ptyFD, "w");
+  if (f) setvbuf(f, 0, _IOLBF, 0);
+
+  return f;
+}
+
+
+bool step_test_open(const char *path) {
+  if (!strcmp(path, "-")) test.out = stderr;
+  else if (!strcmp(path, "pty")) test.out = _open_pty();
+  else {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int testFD = fd == -1 ? -1 : fcntl(fd, F_DUPFD, 4);
+    if (fd != -1) close(fd);
+    test.out = testFD == -1 ? 0 : fdopen(testFD, "w");
+    if (!test.out) perror(path);
+  }
+
+  if (test.out) fprintf(test.out, "RESET\n");
+
+  return test.out;
+}
+
+
+void step_test_tick(uint64_t time) {
+  if (!test.out) return;
+
+  for (int motor = 0; motor < MOTORS; motor++) {
+    int32_t steps;
+    bool negative;
+    uint32_t period;
+    motor_emulate_trace(motor, &steps, &negative, &period);
+
+    int32_t position = lroundf(steps_position(motor));
+    bool reset = steps != test.commanded[motor] && !period;
+
+    // The direction pin is inverted for reversed motors and the fixture
+    // counts down while it is high
+    if (!reset) {
+      int32_t delta = position - test.position[motor];
+      test.count[motor] += get_reverse(motor) ? -delta : delta;
+    }
+
+    test.commanded[motor] = steps;
+    test.position[motor] = position;
+  }
+
+  if (time < test.next) return;
+  test.next = time + STEP_TEST_MS;
+
+  if (!memcmp(test.count, test.reported, sizeof(test.count))) return;
+  memcpy(test.reported, test.count, sizeof(test.count));
+
+  for (int motor = 0; motor < MOTORS; motor++)
+    fprintf(test.out, "%s%ld", motor ? "," : "", (long)test.count[motor]);
+  fprintf(test.out, "\n");
+}
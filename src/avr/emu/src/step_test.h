@@ -0,0 +1,47 @@
+/******************************************************************************\
+
+                  This file is part of the Buildbotics firmware.
+
+         Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.
+
+          This Source describes Open Hardware and is licensed under the
+                                  CERN-OHL-S v2.
+
+          You may redistribute and modify this Source and make products
+     using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).
+            This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED
+     WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS
+      FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable
+                                   conditions.
+
+                 Source location: https://github.com/buildbotics
+
+       As per CERN-OHL-S v2 section 4, should You produce hardware based on
+     these sources, You must maintain the Source Location clearly visible on
+     the external case of the CNC Controller or other product you make using
+                                   this Source.
+
+                 For more information, email info@buildbotics.com
+
+\******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/******************************************************************************\
+
+  Emulates the step-test fixture, see ../step-test.  Enabled with
+  --step-test <file> where file may be - for stderr or pty to create a
+  pseudo terminal for plot_velocity.py.  Prints RESET then, every 10ms of
+  simulated time while any motor moves, the step pulse count of each motor
+  signed by its direction pin, in the fixture's format.  Position changes
+  while stopped, e.g. after homing, do not produce pulses and are not
+  counted.
+
+\******************************************************************************/
+
+bool step_test_open(const char *path);
+void step_test_tick(uint64_t time);
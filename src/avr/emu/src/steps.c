@@ -0,0 +1,91 @@
+/******************************************************************************\
+
+                  This file is part of the Buildbotics firmware.
+
+         Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.
+
+          This Source describes Open Hardware and is licensed under the
+                                  CERN-OHL-S v2.
+
+          You may redistribute and modify this Source and make products
+     using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).
+            This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED
+     WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS
+      FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable
+                                   conditions.
+
+                 Source location: https://github.com/buildbotics
+
+       As per CERN-OHL-S v2 section 4, should You produce hardware based on
+     these sources, You must maintain the Source Location clearly visible on
+     the external case of the CNC Controller or other product you make using
+                                   this Source.
+
+                 For more information, email info@buildbotics.com
+
+\******************************************************************************/
+
+#include "steps.h"
+
+#include <config.h>
+#include <axis.h>
+
+#include <math.h>
+
+
+void motor_emulate_trace(int motor, int32_t *steps, bool *negative,
+                         uint32_t *period);
+
+float get_step_angle(int motor);
+float get_travel(int motor);
+uint16_t get_microstep(int motor);
+
+
+static struct {
+  float from;
+  int32_t to;
+  uint64_t start;
+} motors[MOTORS];
+
+static uint64_t now;
+
+
+void steps_tick(uint64_t time) {
+  now = time;
+
+  for (int motor = 0; motor < MOTORS; motor++) {
+    int32_t steps;
+    bool negative;
+    uint32_t period;
+    motor_emulate_trace(motor, &steps, &negative, &period);
+
+    if (steps == motors[motor].to) continue;
+
+    // A change while stopped is a position reset, e.g. after homing
+    motors[motor].from = period ? steps_position(motor) : steps;
+    motors[motor].to = steps;
+    motors[motor].start = time;
+  }
+}
+
+
+/// Steps, including the part of the current segment completed by the end of
+/// this ms
+float steps_position(int motor) {
+  float t = (float)(now - motors[motor].start + 1) / SEGMENT_MS;
+  if (1 < t) t = 1;
+
+  return motors[motor].from + (motors[motor].to - motors[motor].from) * t;
+}
+
+
+/// mm, or NAN if no motor is mapped to the axis
+float steps_axis_position(int axis) {
+  int motor = axis_get_motor(axis);
+  if (motor < 0) return NAN;
+
+  float stepsPerUnit = 360.0 * get_microstep(motor) / get_travel(motor) /
+    get_step_angle(motor);
+
+  return steps_position(motor) / stepsPerUnit;
+}
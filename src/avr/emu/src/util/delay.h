@@ -30,4 +30,6 @@
 #include <unistd.h>
 
 #define _delay_ms(x) usleep((x) * 1000)
-#define _delay_us(x) usleep(x)
+// Emulated time has ms resolution and the SPI and I2C models need no settling
+// time, so sub-ms delays would only slow the emulator
+#define _delay_us(x) do {} while (0)
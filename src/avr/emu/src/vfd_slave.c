@@ -0,0 +1,493 @@
+/******************************************************************************\
+
+                  This file is part of the Buildbotics firmware.
+
+         Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.
+
+          This Source describes Open Hardware and is licensed under the
+                                  CERN-OHL-S v2.
+
+          You may redistribute and modify this Source and make products
+     using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).
+            This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED
+     WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS
+      FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable
+                                   conditions.
+
+                 Source location: https://github.com/buildbotics
+
+       As per CERN-OHL-S v2 section 4, should You produce hardware based on
+     these sources, You must maintain the Source Location clearly visible on
+     the external case of the CNC Controller or other product you make using
+                                   this Source.
+
+                 For more information, email info@buildbotics.com
+
+\******************************************************************************/
+
+#include "vfd_slave.h"
+
+#include <config.h>
+#include <pins.h>
+#include <usart.h>
+#include <modbus.h>
+
+#include <avr/io.h>
+#include <util/crc16.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+
+void __RS485_DRE_vect();
+void __RS485_TXC_vect();
+void __RS485_RXC_vect();
+
+uint8_t get_mb_baud();
+
+
+#define VFD_MAX_FRAME 64
+#define VFD_MAX_LINKS 8
+
+
+// Huanyang function codes and control bits, see huanyang.c
+enum {
+  HY_FUNC_READ = 1,
+  HY_FUNC_WRITE,
+  HY_CTRL_WRITE,
+  HY_CTRL_READ,
+  HY_FREQ_WRITE,
+};
+
+enum {
+  HY_RUN     = 1 << 0,
+  HY_REVERSE = 1 << 2,
+  HY_STOP    = 1 << 3,
+  HY_REV_FWD = 1 << 4,
+};
+
+enum {
+  HY_STATUS_RUN         = 1 << 0,
+  HY_STATUS_COMMAND_REV = 1 << 2,
+  HY_STATUS_RUNNING     = 1 << 3,
+};
+
+
+typedef struct {
+  uint64_t count;
+  uint64_t total; // ms
+  uint64_t max;   // ms
+} latency_t;
+
+
+static struct {
+  bool enabled;
+
+  // Configuration
+  uint8_t id;
+  unsigned delay;   // ms
+  float crcErrors;  // Probability
+  float drops;      // Probability
+  uint32_t seed;
+  bool huanyang;
+  bool inverted;
+
+  uint16_t regs[1 << 16];
+  uint16_t links[VFD_MAX_LINKS][2];
+  unsigned linkCount;
+
+  // Huanyang drive state
+  uint8_t hyCtrl;
+  uint16_t hyFreq;
+
+  // Request from the firmware
+  uint8_t rx[VFD_MAX_FRAME];
+  unsigned rxLen;
+  uint64_t rxStart;
+  uint64_t rxLast;
+  bool txc;         // Transmit complete pending
+
+  // Response to the firmware
+  uint8_t tx[VFD_MAX_FRAME];
+  unsigned txLen;
+  unsigned txNext;
+  uint64_t txStart;
+  bool write;       // Response acknowledges a write
+
+  float credit;     // Bytes which may be sent this ms
+
+  // Statistics
+  uint64_t first;
+  uint64_t last;
+  unsigned requests;
+  unsigned ignored; // Bad CRC or other slave ID
+  unsigned exceptions;
+  unsigned injectedCRC;
+  unsigned dropped;
+  unsigned lost;    // Response bytes sent with the receiver off
+  latency_t reads;
+  latency_t writes;
+} vfd;
+
+
+static const uint32_t bauds[] = {
+  9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 500000, 1000000,
+};
+
+
+static float _random() {
+  // xorshift32, independent of any use of rand() by the firmware
+  vfd.seed ^= vfd.seed << 13;
+  vfd.seed ^= vfd.seed >> 17;
+  vfd.seed ^= vfd.seed << 5;
+  return (float)vfd.seed / 4294967296.0;
+}
+
+
+static uint16_t _crc16(const uint8_t *data, unsigned len) {
+  uint16_t crc = 0xffff;
+  for (unsigned i = 0; i < len; i++) crc = _crc16_update(crc, data[i]);
+  return crc;
+}
+
+
+static uint16_t _word(const uint8_t *data) {return data[0] << 8 | data[1];}
+
+
+static void _put_word(uint16_t value) {
+  vfd.tx[vfd.txLen++] = value >> 8;
+  vfd.tx[vfd.txLen++] = value;
+}
+
+
+static uint16_t _read_reg(uint16_t addr) {
+  for (unsigned i = 0; i < vfd.linkCount; i++)
+    if (vfd.links[i][0] == addr) return vfd.regs[vfd.links[i][1]];
+
+  return vfd.regs[addr];
+}
+
+
+static void _exception(uint8_t code) {
+  vfd.txLen = 2;
+  vfd.tx[1] |= 0x80;
+  vfd.tx[vfd.txLen++] = code;
+  vfd.exceptions++;
+}
+
+
+static void _modbus(const uint8_t *data, unsigned len) {
+  uint8_t func = vfd.tx[1];
+  uint16_t addr = _word(data);
+  uint16_t count = _word(data + 2);
+
+  switch (func) {
+  case MODBUS_READ_OUTPUT_REG: case MODBUS_READ_INPUT_REG:
+    if (len != 4 || !count || VFD_MAX_FRAME < 2 * count + 5)
+      return _exception(3); // Illegal data value
+
+    vfd.tx[vfd.txLen++] = 2 * count;
+    for (unsigned i = 0; i < count; i++) _put_word(_read_reg(addr + i));
+    break;
+
+  case MODBUS_WRITE_OUTPUT_REG:
+    if (len != 4) return _exception(3);
+    vfd.regs[addr] = count;
+    vfd.write = true;
+    _put_word(addr);
+    _put_word(count);
+    break;
+
+  case MODBUS_WRITE_OUTPUT_REGS:
+    if (len < 5 || len != 5u + data[4] || data[4] != 2 * count)
+      return _exception(3);
+
+    for (unsigned i = 0; i < count; i++)
+      vfd.regs[(uint16_t)(addr + i)] = _word(data + 5 + 2 * i);
+
+    vfd.write = true;
+    _put_word(addr);
+    _put_word(count);
+    break;
+
+  default: return _exception(1); // Illegal function
+  }
+}
+
+
+static uint8_t _hy_status() {
+  uint8_t status = 0;
+
+  if (vfd.hyCtrl & HY_RUN)
+    status |= HY_STATUS_RUN | (vfd.hyFreq ? HY_STATUS_RUNNING : 0);
+  if (vfd.hyCtrl & (HY_REVERSE | HY_REV_FWD)) status |= HY_STATUS_COMMAND_REV;
+
+  return status;
+}
+
+
+static uint16_t _hy_ctrl_read(uint8_t addr) {
+  switch (addr) {
+  case 0: return vfd.hyFreq;                          // Target frequency
+  case 1: return vfd.hyCtrl & HY_RUN ? vfd.hyFreq : 0; // Actual frequency
+  default: return vfd.regs[0x100 + addr];
+  }
+}
+
+
+static void _huanyang(const uint8_t *data, unsigned len) {
+  // Data is [length][args]
+  if (!len || data[0] != len - 1) return _exception(3);
+
+  uint8_t func = vfd.tx[1];
+  vfd.tx[vfd.txLen++] = data[0];
+
+  switch (func) {
+  case HY_FUNC_READ:
+    if (len != 2) return _exception(3);
+    vfd.tx[2] = 3;
+    vfd.tx[vfd.txLen++] = data[1];
+    _put_word(vfd.regs[data[1]]);
+    break;
+
+  case HY_FUNC_WRITE:
+    if (len != 4) return _exception(3);
+    vfd.regs[data[1]] = _word(data + 2);
+    vfd.write = true;
+    memcpy(vfd.tx + vfd.txLen, data + 1, 3);
+    vfd.txLen += 3;
+    break;
+
+  case HY_CTRL_WRITE:
+    if (len != 2) return _exception(3);
+    vfd.hyCtrl = data[1] & HY_STOP ? 0 : data[1];
+    vfd.write = true;
+    vfd.tx[vfd.txLen++] = _hy_status();
+    break;
+
+  case HY_CTRL_READ:
+    if (len != 2) return _exception(3);
+    vfd.tx[2] = 3;
+    vfd.tx[vfd.txLen++] = data[1];
+    _put_word(_hy_ctrl_read(data[1]));
+    break;
+
+  case HY_FREQ_WRITE:
+    if (len != 3) return _exception(3);
+    vfd.hyFreq = _word(data + 1);
+    vfd.write = true;
+    _put_word(vfd.hyFreq);
+    break;
+
+  default: return _exception(1);
+  }
+}
+
+
+static void _request(uint64_t time) {
+  const uint8_t *frame = vfd.rx;
+  unsigned len = vfd.rxLen;
+  vfd.rxLen = 0;
+
+  // Firmware ignores leading zeros, a real slave would see them as noise
+  while (len && !*frame) {frame++; len--;}
+
+  vfd.requests++;
+
+  if (len < 4 || frame[0] != vfd.id ||
+      _crc16(frame, len - 2) != (frame[len - 1] << 8 | frame[len - 2])) {
+    vfd.ignored++;
+    return;
+  }
+
+  if (_random() < vfd.drops) {
+    vfd.dropped++;
+    return;
+  }
+
+  // Build response
+  vfd.tx[0] = frame[0];
+  vfd.tx[1] = frame[1];
+  vfd.txLen = 2;
+  vfd.write = false;
+
+  if (vfd.huanyang) _huanyang(frame + 2, len - 4);
+  else _modbus(frame + 2, len - 4);
+
+  uint16_t crc = _crc16(vfd.tx, vfd.txLen);
+  if (_random() < vfd.crcErrors) {
+    crc = ~crc;
+    vfd.injectedCRC++;
+  }
+
+  vfd.tx[vfd.txLen++] = crc;
+  vfd.tx[vfd.txLen++] = crc >> 8;
+  vfd.txNext = 0;
+
+  // Modbus requires at least 3.5 characters of silence before responding
+  vfd.txStart = time + (vfd.delay ? vfd.delay : 1);
+}
+
+
+static uint8_t _line(uint8_t data, int pin) {
+  // Swapped lines or inverted pins garble each byte
+  bool invert = vfd.inverted ^ !!(PINCTRL_PIN(pin) & PORT_INVEN_bm);
+  return invert ? ~data : data;
+}
+
+
+static void _record(latency_t &l, uint64_t latency) {
+  l.count++;
+  l.total += latency;
+  if (l.max < latency) l.max = latency;
+}
+
+
+static void _transmit(uint64_t time) {
+  while (1 <= vfd.credit && vfd.txNext < vfd.txLen) {
+    uint8_t data = _line(vfd.tx[vfd.txNext++], RS485_RO_PIN);
+    vfd.credit--;
+
+    if (!(RS485_PORT.CTRLA & USART_RXCINTLVL_gm)) vfd.lost++;
+    else {
+      RS485_PORT.DATA = data;
+      __RS485_RXC_vect();
+    }
+  }
+
+  if (vfd.txNext == vfd.txLen) {
+    _record(vfd.write ? vfd.writes : vfd.reads, time + 1 - vfd.rxStart);
+    vfd.txLen = vfd.txNext = 0;
+    vfd.last = time + 1;
+  }
+}
+
+
+static void _receive(uint64_t time) {
+  while (1 <= vfd.credit && (RS485_PORT.CTRLA & USART_DREINTLVL_gm)) {
+    __RS485_DRE_vect();
+    vfd.credit--;
+
+    if (!vfd.rxLen) vfd.rxStart = time;
+    if (!vfd.first) vfd.first = time + 1;
+    if (vfd.rxLen < VFD_MAX_FRAME)
+      vfd.rx[vfd.rxLen++] = _line(RS485_PORT.DATA, RS485_DI_PIN);
+    vfd.rxLast = time;
+    vfd.txc = true;
+  }
+
+  // Transmit complete once the last byte has been shifted out
+  if (vfd.txc && vfd.rxLast < time &&
+      (RS485_PORT.CTRLA & USART_TXCINTLVL_gm)) {
+    vfd.txc = false;
+    __RS485_TXC_vect();
+  }
+
+  // Silence after the last byte ends the frame
+  if (vfd.rxLen && vfd.rxLast < time &&
+      !(RS485_PORT.CTRLA & USART_DREINTLVL_gm)) _request(time);
+}
+
+
+bool vfd_slave_configure(const char *options) {
+  vfd.enabled = true;
+  vfd.id = 1;
+  vfd.delay = 5;
+  vfd.seed = 1;
+
+  char *copy = strdup(options);
+  char *save = 0;
+  bool ok = true;
+
+  for (char *opt = strtok_r(copy, ",", &save); opt && ok;
+       opt = strtok_r(0, ",", &save)) {
+    char *value = strchr(opt, '=');
+    if (value) *value++ = 0;
+
+    char *end = 0;
+    unsigned long a = value ? strtoul(value, &end, 0) : 0;
+    bool pair = end && *end == ':';
+    unsigned long b = pair ? strtoul(end + 1, &end, 0) : 0;
+    bool number = value && *value && !*end;
+
+    if (!strcmp(opt, "huanyang") && !value) vfd.huanyang = true;
+    else if (!strcmp(opt, "inverted") && !value) vfd.inverted = true;
+    else if (!strcmp(opt, "id") && number && !pair && a < 256) vfd.id = a;
+    else if (!strcmp(opt, "delay") && number && !pair) vfd.delay = a;
+    else if (!strcmp(opt, "seed") && number && !pair) vfd.seed = a | 1;
+    else if (!strcmp(opt, "crc") && value) vfd.crcErrors = atof(value);
+    else if (!strcmp(opt, "drop") && value) vfd.drops = atof(value);
+    else if (!strcmp(opt, "reg") && number && pair && a < 65536 &&
+             b < 65536) vfd.regs[a] = b;
+    else if (!strcmp(opt, "link") && number && pair && a < 65536 &&
+             b < 65536 && vfd.linkCount < VFD_MAX_LINKS) {
+      vfd.links[vfd.linkCount][0] = a;
+      vfd.links[vfd.linkCount++][1] = b;
+
+    } else {
+      fprintf(stderr, "Invalid --vfd option '%s'\n", opt);
+      ok = false;
+    }
+  }
+
+  free(copy);
+
+  // Huanyang defaults, PD005 max frequency 400Hz and PD144 rated RPM
+  if (vfd.huanyang) {
+    if (!vfd.regs[5]) vfd.regs[5] = 40000;
+    if (!vfd.regs[144]) vfd.regs[144] = 24000;
+  }
+
+  return ok;
+}
+
+
+bool vfd_slave_enabled() {return vfd.enabled;}
+
+
+void vfd_slave_tick(uint64_t time) {
+  if (!vfd.enabled || !(RS485_PORT.CTRLB & USART_TXEN_bm)) return;
+
+  // RTU characters are always 11 bits
+  uint8_t baud = get_mb_baud();
+  float bytesPerMS = bauds[baud < 10 ? baud : 0] / 11.0 / 1000;
+  vfd.credit += bytesPerMS;
+  if (bytesPerMS + 1 < vfd.credit) vfd.credit = bytesPerMS + 1;
+
+  // Half duplex, the slave only responds after the request
+  if (vfd.txLen) {
+    if (vfd.txStart <= time) _transmit(time);
+
+  } else _receive(time);
+}
+
+
+static void _summary_latency(FILE *f, const char *name, const latency_t &l) {
+  fprintf(f, "\"%s\":{\"count\":%llu,\"mean\":%.2f,\"max\":%llu}", name,
+          (unsigned long long)l.count,
+          l.count ? (double)l.total / l.count : 0.0,
+          (unsigned long long)l.max);
+}
+
+
+void vfd_slave_summary(FILE *f) {
+  if (!vfd.enabled) return;
+
+  uint64_t responses = vfd.reads.count + vfd.writes.count;
+  uint64_t time = vfd.last - vfd.first;
+
+  fprintf(f, "{\"vfd\":{\"requests\":%u,\"responses\":%llu,\"ignored\":%u,",
+          vfd.requests, (unsigned long long)responses, vfd.ignored);
+  fprintf(f, "\"exceptions\":%u,\"crc_errors\":%u,\"dropped\":%u,"
+          "\"lost\":%u,", vfd.exceptions, vfd.injectedCRC, vfd.dropped,
+          vfd.lost);
+
+  // Request start to response end in ms
+  _summary_latency(f, "reads", vfd.reads);
+  fprintf(f, ",");
+  _summary_latency(f, "writes", vfd.writes);
+
+  fprintf(f, ",\"per_sec\":%.2f}}\n",
+          time ? responses * 1000.0 / time : 0.0);
+}
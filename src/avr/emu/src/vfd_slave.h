@@ -0,0 +1,57 @@
+/******************************************************************************\
+
+                  This file is part of the Buildbotics firmware.
+
+         Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.
+
+          This Source describes Open Hardware and is licensed under the
+                                  CERN-OHL-S v2.
+
+          You may redistribute and modify this Source and make products
+     using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).
+            This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED
+     WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS
+      FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable
+                                   conditions.
+
+                 Source location: https://github.com/buildbotics
+
+       As per CERN-OHL-S v2 section 4, should You produce hardware based on
+     these sources, You must maintain the Source Location clearly visible on
+     the external case of the CNC Controller or other product you make using
+                                   this Source.
+
+                 For more information, email info@buildbotics.com
+
+\******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+
+/******************************************************************************\
+
+  Emulates a Modbus RTU VFD on the RS485 USART.  Configured with
+  --vfd <options> where options is a comma separated list of:
+
+           id=<n>         Slave ID, default 1
+        delay=<ms>        Response delay, default 5
+          crc=<p>         Probability of corrupting a response CRC
+         drop=<p>         Probability of not responding, i.e. a timeout
+         seed=<n>         Random seed for errors
+          reg=<a>:<v>     Initial register value
+         link=<a>:<b>     Reads of register a return register b
+     huanyang             Use the Huanyang protocol
+     inverted             RS485 A and B lines swapped
+
+  The firmware's spindle type must be set separately, e.g. with $st=2.
+
+\******************************************************************************/
+
+bool vfd_slave_configure(const char *options);
+bool vfd_slave_enabled();
+void vfd_slave_tick(uint64_t time);
+void vfd_slave_summary(FILE *f);
@@ -0,0 +1,388 @@
+/******************************************************************************\
+
+                  This file is part of the Buildbotics firmware.
+
+         Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.
+
+          This Source describes Open Hardware and is licensed under the
+                                  CERN-OHL-S v2.
+
+          You may redistribute and modify this Source and make products
+     using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).
+            This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED
+     WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS
+      FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable
+                                   conditions.
+
+                 Source location: https://github.com/buildbotics
+
+       As per CERN-OHL-S v2 section 4, should You produce hardware based on
+     these sources, You must maintain the Source Location clearly visible on
+     the external case of the CNC Controller or other product you make using
+                                   this Source.
+
+                 For more information, email info@buildbotics.com
+
+\******************************************************************************/
+
+// Command parser fuzz harness.  Input is sent to the firmware's serial port,
+// one line per command, through the in-process emulator while the stepper and
+// RTC ISRs run in simulated time.  An ESTOP_ASSERT from anything other than
+// the estop and shutdown commands aborts, as do the sanitizers.
+//
+// Built with LIBFUZZER defined the harness provides LLVMFuzzerTestOneInput().
+// Otherwise it runs one input from a file or stdin, as AFL expects, or with
+// --triage runs each input in a child process and groups the failures.
+
+#include <config.h>
+#include <command.h>
+#include <stepper.h>
+#include <state.h>
+#include <estop.h>
+#include <status.h>
+#include <usart.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+
+extern "C" {
+  int bbemu_init(int argc, char *argv[]);
+  int bbemu_step(unsigned ms);
+  int bbemu_write_serial(const uint8_t *data, unsigned len);
+  int bbemu_serial_pending();
+  int bbemu_read_serial(uint8_t *data, unsigned len);
+}
+
+PGM_P get_estop_reason();
+
+
+#define FUZZ_MAX_INPUT   4096   // Longer inputs are truncated
+#define FUZZ_DRAIN_MS    5000   // Simulated time to finish after the input
+#define FUZZ_MAX_MS      120000 // Simulated time limit, e.g. when held
+#define FUZZ_TIMEOUT     10     // Seconds before triage gives up on an input
+#define TRIAGE_EXAMPLES  3      // Inputs listed per failure
+
+
+static bool echo = false; // Copy firmware output to stdout
+
+
+static void _drain_output() {
+  uint8_t buf[256];
+  int len;
+
+  while (0 < (len = bbemu_read_serial(buf, sizeof(buf))))
+    if (echo) fwrite(buf, 1, len, stdout);
+}
+
+
+static void _check_assert() {
+  if (!estop_triggered()) return;
+
+  PGM_P reason = get_estop_reason();
+  if (reason == status_to_pgmstr(STAT_ESTOP_USER) ||
+      reason == status_to_pgmstr(STAT_ESTOP_SWITCH) ||
+      reason == status_to_pgmstr(STAT_POWER_SHUTDOWN)) return;
+
+  _drain_output();
+  fflush(stdout);
+  fprintf(stderr, "ESTOP_ASSERT: %s\n", reason);
+  abort();
+}
+
+
+static bool _idle() {
+  state_t state = state_get();
+  if (state == STATE_RUNNING || state == STATE_JOGGING ||
+      state == STATE_STOPPING) return false;
+
+  return !bbemu_serial_pending() && usart_rx_empty() && !st_is_busy() &&
+    !command_get_count();
+}
+
+
+/// Returns false if the firmware reset
+static bool _run(const uint8_t *data, size_t size) {
+  if (FUZZ_MAX_INPUT < size) size = FUZZ_MAX_INPUT;
+
+  // Feed input as fast as the emulated serial port accepts it
+  unsigned drain = 0;
+  for (unsigned ms = 0; drain < FUZZ_DRAIN_MS && ms < FUZZ_MAX_MS; ms++) {
+    if (size) {
+      int len = bbemu_write_serial(data, size);
+      data += len;
+      size -= len;
+    }
+
+    if (bbemu_step(1)) return false;
+    _drain_output();
+    _check_assert();
+
+    if (!size && !bbemu_serial_pending()) {
+      if (_idle()) break;
+      drain++;
+    }
+  }
+
+  return true;
+}
+
+
+static void _init() {
+  char *argv[] = {(char *)"bbfuzz", 0};
+  if (bbemu_init(1, argv)) {
+    fprintf(stderr, "Firmware failed to initialize\n");
+    exit(1);
+  }
+}
+
+
+#ifdef LIBFUZZER
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static bool initialized = false;
+
+  // Firmware state persists between inputs until a reset, so confirm
+  // findings with --triage which runs each input from a fresh start
+  if (!initialized || !_run(data, size)) _init();
+  initialized = true;
+
+  return 0;
+}
+
+
+#else // LIBFUZZER
+static size_t _read_input(FILE *f, uint8_t *data) {
+  size_t size = fread(data, 1, FUZZ_MAX_INPUT, f);
+  if (ferror(f)) {perror("read"); exit(1);}
+  return size;
+}
+
+
+static int _run_file(const char *path) {
+  static uint8_t data[FUZZ_MAX_INPUT];
+  FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  if (!f) {perror(path); return 1;}
+
+  size_t size = _read_input(f, data);
+  if (f != stdin) fclose(f);
+
+  _init();
+  _run(data, size);
+  _drain_output();
+
+  return 0;
+}
+
+
+/******************************************************************************/
+// Triage
+
+typedef struct {
+  char signature[256];
+  unsigned count;
+  char examples[TRIAGE_EXAMPLES][256];
+} failure_t;
+
+
+static failure_t *failures = 0;
+static unsigned failureCount = 0;
+static unsigned inputCount = 0;
+
+
+/// Copy up to the end of the line
+static void _copy_line(char *dst, unsigned len, const char *src) {
+  const char *end = strchr(src, '\n');
+  unsigned n = end ? end - src : strlen(src);
+  if (len - 1 < n) n = len - 1;
+
+  memcpy(dst, src, n);
+  dst[n] = 0;
+}
+
+
+/// Reduce sanitizer and assert output to one line identifying the failure
+static void _signature(char *sig, unsigned len, const char *output,
+                       int status) {
+  const char *s;
+
+  if ((s = strstr(output, "ESTOP_ASSERT: "))) {
+    _copy_line(sig, len, s);
+    return;
+  }
+
+  if ((s = strstr(output, "ERROR: AddressSanitizer: "))) {
+    // Error type and the first frame outside the sanitizer
+    char type[64];
+    _copy_line(type, sizeof(type), s + 25);
+    char *space = strchr(type, ' ');
+    if (space) *space = 0;
+
+    const char *frame = s;
+    while ((frame = strstr(frame + 1, "\n    #")))
+      if (!strstr(frame, "sanitizer") ||
+          strstr(frame, "sanitizer") > strchr(frame + 1, '\n')) break;
+
+    const char *in = frame ? strstr(frame, " in ") : 0;
+    char where[192] = "";
+    if (in) _copy_line(where, sizeof(where), in + 4);
+
+    snprintf(sig, len, "%.63s in %.180s", type, where);
+    return;
+  }
+
+  if ((s = strstr(output, "runtime error: "))) {
+    // Source location and message with values removed
+    while (output < s && s[-1] != '\n') s--;
+    _copy_line(sig, len, s);
+
+    char *msg = strstr(sig, "runtime error: ");
+    char *out = msg;
+    for (char *in = msg; *in; in++)
+      if (!isdigit(*in)) *out++ = *in;
+      else if (out[-1] != 'N') *out++ = 'N';
+    *out = 0;
+    return;
+  }
+
+  if (WIFSIGNALED(status))
+    snprintf(sig, len, "%s", WTERMSIG(status) == SIGALRM ? "Timeout" :
+             strsignal(WTERMSIG(status)));
+  else if (WEXITSTATUS(status))
+    snprintf(sig, len, "Exit status %d", WEXITSTATUS(status));
+  else *sig = 0;
+}
+
+
+static void _record(const char *sig, const char *path) {
+  failure_t *f = 0;
+
+  for (unsigned i = 0; i < failureCount && !f; i++)
+    if (!strcmp(failures[i].signature, sig)) f = &failures[i];
+
+  if (!f) {
+    failures =
+      (failure_t *)realloc(failures, ++failureCount * sizeof(failure_t));
+    if (!failures) {perror("triage"); exit(1);}
+    f = &failures[failureCount - 1];
+    memset(f, 0, sizeof(failure_t));
+    snprintf(f->signature, sizeof(f->signature), "%s", sig);
+  }
+
+  if (f->count < TRIAGE_EXAMPLES)
+    snprintf(f->examples[f->count], sizeof(f->examples[0]), "%s", path);
+  f->count++;
+}
+
+
+static void _triage_file(const char *path) {
+  int fds[2];
+  if (pipe(fds)) {perror("pipe"); exit(1);}
+
+  fflush(0);
+  pid_t pid = fork();
+  if (pid == -1) {perror("fork"); exit(1);}
+
+  if (!pid) {
+    close(fds[0]);
+    dup2(fds[1], 2);
+    if (!freopen("/dev/null", "w", stdout)) _exit(1);
+    alarm(FUZZ_TIMEOUT);
+    _exit(_run_file(path));
+  }
+
+  close(fds[1]);
+
+  // Collect the child's stderr
+  static char output[16384];
+  unsigned len = 0;
+  ssize_t n;
+  while (0 < (n = read(fds[0], output + len, sizeof(output) - 1 - len)))
+    if ((len += n) == sizeof(output) - 1) break;
+  output[len] = 0;
+  close(fds[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+
+  char sig[256];
+  _signature(sig, sizeof(sig), output, status);
+  if (*sig) _record(sig, path);
+  inputCount++;
+}
+
+
+static void _triage(const char *path) {
+  struct stat st;
+  if (stat(path, &st)) {perror(path); exit(1);}
+
+  if (!S_ISDIR(st.st_mode)) {
+    _triage_file(path);
+    return;
+  }
+
+  struct dirent **entries;
+  int n = scandir(path, &entries, 0, alphasort);
+  if (n < 0) {perror(path); exit(1);}
+
+  for (int i = 0; i < n; i++) {
+    if (entries[i]->d_name[0] != '.') {
+      char child[PATH_MAX];
+      snprintf(child, sizeof(child), "%s/%s", path, entries[i]->d_name);
+      _triage(child);
+    }
+
+    free(entries[i]);
+  }
+
+  free(entries);
+}
+
+
+static int _triage_report() {
+  unsigned failed = 0;
+  for (unsigned i = 0; i < failureCount; i++) failed += failures[i].count;
+
+  printf("%u inputs, %u failed, %u unique\n", inputCount, failed,
+         failureCount);
+
+  for (unsigned i = 0; i < failureCount; i++) {
+    failure_t &f = failures[i];
+    printf("\n%u x %s\n", f.count, f.signature);
+
+    unsigned examples = f.count < TRIAGE_EXAMPLES ? f.count : TRIAGE_EXAMPLES;
+    for (unsigned j = 0; j < examples; j++) printf("  %s\n", f.examples[j]);
+  }
+
+  return !!failureCount;
+}
+
+
+int main(int argc, char *argv[]) {
+  if (1 < argc && !strcmp(argv[1], "--triage")) {
+    if (argc == 2) {
+      fprintf(stderr, "Usage: %s --triage <file|dir>...\n", argv[0]);
+      return 1;
+    }
+
+    for (int i = 2; i < argc; i++) _triage(argv[i]);
+    return _triage_report();
+  }
+
+  if (2 < argc || (argc == 2 && argv[1][0] == '-' && argv[1][1])) {
+    fprintf(stderr, "Usage: %s [file|-]\n"
+            "       %s --triage <file|dir>...\n", argv[0], argv[0]);
+    return 1;
+  }
+
+  echo = true;
+  return _run_file(argc == 2 ? argv[1] : "-");
+}
+#endif // LIBFUZZER
@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+
+################################################################################
+#                                                                              #
+#                 This file is part of the Buildbotics firmware.               #
+#                                                                              #
+#        Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.      #
+#                                                                              #
+#         This Source describes Open Hardware and is licensed under the        #
+#                                 CERN-OHL-S v2.                               #
+#                                                                              #
+#         You may redistribute and modify this Source and make products        #
+#    using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).  #
+#           This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED          #
+#    WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS  #
+#     FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable    #
+#                                  conditions.                                 #
+#                                                                              #
+#                Source location: https://github.com/buildbotics               #
+#                                                                              #
+#      As per CERN-OHL-S v2 section 4, should You produce hardware based on    #
+#    these sources, You must maintain the Source Location clearly visible on   #
+#    the external case of the CNC Controller or other product you make using   #
+#                                  this Source.                                #
+#                                                                              #
+#                For more information, email info@buildbotics.com              #
+#                                                                              #
+################################################################################
+
+# Generates the fuzzer seed corpus.  Session seeds are taken from the start of
+# the replay command logs, the rest cover each command with bbctrl's encoders.
+
+import os, sys, json, glob
+
+dir = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(dir, '../../py'))
+from bbctrl import Cmd
+
+
+SESSION_SIZE = 4096 # Bytes taken from each log, the harness input limit
+PREFIX = 'I:Comm:< '
+
+# Motor setup as sent by the controller
+SETUP = [Cmd.set('%dme' % m, 1) for m in range(3)] + \
+  [Cmd.set_sync('%dsa' % m, 1.8) for m in range(3)] + [Cmd.RESUME]
+
+LINE = Cmd.line({'x': 10, 'y': 5}, 0, 1e6, 1e9, [30, 0, 30, 200, 30, 0, 30],
+                [])
+
+
+SEEDS = {
+  'vars': ['$xx', '$v', '$0me', Cmd.set('0tr', 2.5), Cmd.set('sx', 1000),
+           Cmd.set_sync('0oa', 1), Cmd.DUMP],
+  # Codes are in vars.def order, e.g. 1 = me, 2 = pl and 6 = mi
+  'bulk': Cmd.bulk([(1, 0, 'u8', 1), (2, 1, 'f32', 1.5), (6, 2, 'u16', 16)]) +
+    ['$0me', '$1pl', '$2mi'],
+  'report': ['r0', 'r1', 'r0xx', 'r1xx', Cmd.UNDERRUNS, Cmd.HELP],
+  'line': SETUP + [LINE, Cmd.line({'x': 0, 'z': -1}, 0, 1e6, 1e9,
+                                  [30, 0, 30, 0, 30, 0, 30], [])],
+  'speeds': SETUP + [
+    Cmd.speed(1000),
+    Cmd.line({'x': 20}, 0, 1e6, 1e9, [30, 0, 30, 500, 30, 0, 30],
+             [(0, 100), (5, 200)]),
+    Cmd.line({'x': 0}, 0, 1e6, 1e9, [30, 0, 30, 500, 30, 0, 30],
+             [(i * 0.5, i * 10 % 1000) for i in range(30)], 1000),
+    Cmd.line({'x': 20}, 0, 1e6, 1e9, [30, 0, 30, 500, 30, 0, 30],
+             [(i * 0.1, (i * 37) % 255) for i in range(100)], 255)],
+  'seek': SETUP + [Cmd.seek(1, True, False), LINE, Cmd.seek(2, False, True),
+                   LINE],
+  'axis': SETUP + [Cmd.set_axis('x', 5), Cmd.set_axis('c', -2.5), LINE],
+  'jog': SETUP + [Cmd.jog(1, {'x': 0.5, 'y': -0.25}), Cmd.jog(2, {}),
+                  Cmd.jog(3, {'z': 1})],
+  'dwell': SETUP + [Cmd.dwell(0.25), Cmd.input('digital-in-0', 'rise', 0.1),
+                    Cmd.input('analog-in-1', 'immediate', 0)],
+  'pause': SETUP + [LINE, Cmd.pause('program'), LINE, Cmd.UNPAUSE,
+                    Cmd.STOP, Cmd.FLUSH, Cmd.RESUME],
+  'estop': SETUP + [LINE, Cmd.ESTOP, LINE, '$es'],
+  'edit': ['$x\bx', 'junk\x18$xx', 'l' + 'A' * 200],
+}
+
+
+def write(name, lines):
+  with open(os.path.join(dir, 'corpus', name), 'w') as f:
+    for line in lines: f.write(line + '\n')
+
+
+def sessions():
+  for path in sorted(glob.glob(os.path.join(dir, '../emu/replay/*.log'))):
+    lines = []
+    size = 0
+
+    with open(path, 'r') as f:
+      for line in f:
+        if not line.startswith(PREFIX): continue
+        cmd = json.loads('"%s"' % line[len(PREFIX):].rstrip('\n'))
+
+        size += len(cmd) + 1
+        if SESSION_SIZE < size: break
+        lines.append(cmd)
+
+    name = os.path.splitext(os.path.basename(path))[0]
+    write('session-' + name, lines)
+
+
+if __name__ == '__main__':
+  os.makedirs(os.path.join(dir, 'corpus'), exist_ok = True)
+  sessions()
+  for name, lines in SEEDS.items(): write(name, lines)
@@ -55,8 +55,8 @@ bool axis_is_enabled(int axis) {
 
 
 int axis_get_id(char axis) {
-  const char *axes = "XYZABCUVW";
-  const char *ptr = strchr(axes, toupper(axis));
+  const char *axes = "XYZABC";
+  const char *ptr = axis ? strchr(axes, toupper(axis)) : 0;
   return ptr == 0 ? -1 : (ptr - axes);
 }
 
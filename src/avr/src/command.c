@@ -59,6 +59,7 @@
 
 static struct {
   bool active;
+  bool held;
   uint16_t id;
   uint32_t last_empty;
   volatile uint16_t count;
@@ -92,6 +93,16 @@ static bool _is_synchronous(char code) {
 }
 
 
+static bool _is_variable(char code) {
+  switch (code) {
+#define CMD(CODE, NAME, SYNC, ...) case COMMAND_##NAME: return SYNC == 2;
+#include "command.def"
+#undef CMD
+  }
+  return false;
+}
+
+
 static stat_t _dispatch(char *s) {
   switch (*s) {
 #define CMD(CODE, NAME, SYNC, ...)              \
@@ -135,6 +146,8 @@ static void _i2c_cb(uint8_t *data, uint8_t length) {
 void command_init() {i2c_set_read_callback(_i2c_cb);}
 bool command_is_active() {return cmd.active;}
 unsigned command_get_count() {return cmd.count;}
+uint16_t command_get_id() {return cmd.id;}
+bool command_exec_held() {return cmd.held;}
 
 
 void command_print_json() {
@@ -157,20 +170,28 @@ void command_flush_queue() {
 }
 
 
-void command_push(char code, void *_data) {
+void command_push_size(char code, void *_data, unsigned size) {
   uint8_t *data = (uint8_t *)_data;
-  unsigned size = _size(code);
+  bool variable = _is_variable(code);
 
   ESTOP_ASSERT(_is_synchronous(code), STAT_Q_INVALID_PUSH);
-  ESTOP_ASSERT(size < sync_q_space(), STAT_Q_OVERRUN);
+  ESTOP_ASSERT(variable ? size <= _size(code) : size == _size(code),
+               STAT_Q_INVALID_PUSH);
+  ESTOP_ASSERT(size + variable < sync_q_space(), STAT_Q_OVERRUN);
 
   sync_q_push(code);
+  if (variable) sync_q_push(size);
   for (unsigned i = 0; i < size; i++) sync_q_push(*data++);
 
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE) cmd.count++;
 }
 
 
+void command_push(char code, void *data) {
+  command_push_size(code, data, _size(code));
+}
+
+
 bool command_callback() {
   static char *block = 0;
 
@@ -183,7 +204,8 @@ bool command_callback() {
   if (_is_synchronous(*block)) {
     if (estop_triggered()) status = STAT_MACHINE_ALARMED;
     else if (state_is_flushing()) status = STAT_NOP; // Flush command
-    else if (state_is_resuming() || sync_q_space() <= _size(*block))
+    else if (state_is_resuming() ||
+             sync_q_space() <= _size(*block) + _is_variable(*block))
       return false; // Wait
   }
 
@@ -243,7 +265,10 @@ uint8_t *command_next() {
 
   ESTOP_ASSERT(_is_synchronous((char)data[0]), STAT_INVALID_QCMD);
 
-  unsigned size = _size((char)data[0]);
+  unsigned size =
+    _is_variable((char)data[0]) ? sync_q_next() : _size((char)data[0]);
+  ESTOP_ASSERT(size < sizeof(data), STAT_INVALID_QCMD);
+
   for (unsigned i = 0; i < size; i++)
     data[i + 1] = sync_q_next();
 
@@ -254,6 +279,8 @@ uint8_t *command_next() {
 // Returns true if command queued
 // Called by exec.c from low-level interrupt
 bool command_exec() {
+  cmd.held = false;
+
   if (!cmd.count) {
     cmd.last_empty = rtc_get_time();
     state_idle();
@@ -262,7 +289,10 @@ bool command_exec() {
 
   // On restart wait a bit to give queue a chance to fill
   if (cmd.count < EXEC_FILL_TARGET &&
-      !rtc_expired(cmd.last_empty + EXEC_DELAY)) return false;
+      !rtc_expired(cmd.last_empty + EXEC_DELAY)) {
+    cmd.held = true;
+    return false;
+  }
 
   uint8_t *data = command_next();
   state_running();
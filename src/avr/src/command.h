@@ -45,8 +45,11 @@ typedef enum {
 void command_init();
 bool command_is_active();
 unsigned command_get_count();
+uint16_t command_get_id();
+bool command_exec_held();
 void command_print_json();
 void command_flush_queue();
+void command_push_size(char code, void *data, unsigned size);
 void command_push(char code, void *data);
 bool command_callback();
 void command_set_axis_position(int axis, const float p);
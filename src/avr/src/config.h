@@ -141,6 +141,9 @@ enum {
 #define STEP_TIMER_FREQ          (F_CPU / STEP_TIMER_DIV)
 #define STEP_TIMER_POLL          ((uint16_t)(STEP_TIMER_FREQ * 0.001)) // 1ms
 #define STEP_TIMER_ISR           TCC0_OVF_vect
+#define STEP_TIMER_CCA_ISR       TCC0_CCA_vect // Sub-millisecond power updates
+#define STEP_TIMER_CCB_ISR       TCC0_CCB_vect
+#define STEP_TIMER_CCC_ISR       TCC0_CCC_vect
 #define STEP_LOW_LEVEL_ISR       ADCB_CH0_vect
 #define STEP_PULSE_WIDTH         (F_CPU * 0.000002) // 2uS w/ clk/1
 #define SEGMENT_MS               4
@@ -176,11 +179,15 @@ enum {
 #define RS485_RXC_vect           USARTD1_RXC_vect
 
 
-// Modbus settings
+// Modbus settings, timing may be overridden when tuning in the emulator
+#ifndef MODBUS_TIMEOUT
 #define MODBUS_TIMEOUT           100 // ms. response timeout
+#endif
 #define MODBUS_RETRIES           4   // Number of retries before failure
 #define MODBUS_BUF_SIZE          18  // Max bytes in rx/tx buffers
+#ifndef VFD_QUERY_DELAY
 #define VFD_QUERY_DELAY          100 // ms
+#endif
 
 
 // Serial settings
@@ -191,11 +198,19 @@ enum {
 #define SERIAL_CTS_THRESH        4
 
 
-// PWM settings
-#define POWER_MAX_UPDATES        SEGMENT_MS
+// PWM settings.  More updates per ms smooth dynamic power, but each adds
+// SEGMENT_MS 7 byte power updates to the five line, exec and stepper buffers,
+// 140 bytes of RAM.  Build with DEFS=-DPOWER_UPDATES_PER_MS=4 to use them.
+#ifndef POWER_UPDATES_PER_MS
+#define POWER_UPDATES_PER_MS     1 // 1 to 4, see STEP_TIMER_CCx_ISR
+#endif
+#define POWER_MAX_UPDATES        (SEGMENT_MS * POWER_UPDATES_PER_MS)
+#define POWER_STEP_TIME          (SEGMENT_TIME / POWER_MAX_UPDATES) // mins
 
 // Input
 #define INPUT_BUFFER_LEN         128 // text buffer size (255 max)
+// Bytes of base64 data a line holds after its command code
+#define INPUT_DATA_MAX           ((INPUT_BUFFER_LEN - 2) / 4 * 3)
 
 
 // Report
@@ -223,4 +238,5 @@ enum {
 #define SYNC_QUEUE_SIZE          4096
 #define EXEC_FILL_TARGET         8
 #define EXEC_DELAY               250 // ms
+#define UNDERRUN_LOG_SIZE        8
 #define JOG_STOPPING_UNDERSHOOT  1   // % of stopping distance
@@ -32,5 +32,6 @@
 #else
 void emu_init();
 void emu_callback();
+void emu_reset();
 
 #endif
@@ -196,8 +196,8 @@ stat_t exec_segment(float time, const float target[], float vel, float accel,
                     const power_update_t power_updates[]) {
   // Copy power updates in to the correct position given the time offset
   float nextT       = ex.seg.time + time;
-  const float stepT = 1.0 / 60000; // 1ms in mins
-  float t           = 0.5 / 60000; // 0.5ms in mins
+  const float stepT = POWER_STEP_TIME;
+  float t           = 0.5 * stepT; // Middle of power update
   unsigned j        = 0;
 
   for (unsigned i = 0; t < nextT && j < POWER_MAX_UPDATES; i++) {
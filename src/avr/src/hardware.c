@@ -30,6 +30,7 @@
 #include "usart.h"
 #include "config.h"
 #include "pgmspace.h"
+#include "emu.h"
 
 #include <avr/interrupt.h>
 #include <avr/eeprom.h>
@@ -38,10 +39,6 @@
 #include <stdbool.h>
 #include <stddef.h>
 
-#ifndef __AVR__
-#include <unistd.h>
-#endif
-
 
 typedef struct {
   char id[26];
@@ -136,7 +133,7 @@ static void _hard_reset() {
   RST.CTRL = RST_SWRST_bm;
 
 #else // __AVR__
-  _exit(0);
+  emu_reset();
 #endif
 }
 
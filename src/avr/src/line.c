@@ -114,6 +114,28 @@ static bool _section_next() {
 }
 
 
+static void _load_power_updates(float t, float endT, float endD) {
+  float lastD = l.lD;
+  float lastV = _segment_velocity(t);
+
+  // Evaluate the S-curve at the end of each power update
+  for (unsigned i = 0; i < POWER_MAX_UPDATES; i++) {
+    float nextT = t + POWER_STEP_TIME;
+    if (endT < nextT) nextT = endT;
+
+    float d = nextT < endT ? _segment_distance(nextT) : endD;
+    if (endD < d) d = endD;
+
+    // Average velocity during update
+    if (t < nextT) lastV = (d - lastD) / (nextT - t);
+
+    l.power_updates[i] = spindle_power_update(d, lastV);
+    lastD = d;
+    t = nextT;
+  }
+}
+
+
 static stat_t _exec_segment(float time, const float target[], float vel,
                             float accel) {
   return exec_segment(time, target, vel, accel, l.line.max_accel,
@@ -141,8 +163,9 @@ static stat_t _line_exec() {
   // Don't allow overshoot
   if (l.line.length < d) d = l.line.length;
 
-  // Handle synchronous speeds
-  spindle_load_power_updates(l.power_updates, l.lD, d);
+  // Handle synchronous speeds and dynamic power
+  if (spindle_power_varies(d)) _load_power_updates(l.t - seg_time, l.t, d);
+  else spindle_load_power(l.power_updates, v);
   l.lD = d;
 
   // Check if section complete
@@ -56,7 +56,7 @@ int __argc;
 char **__argv;
 
 
-int main(int argc, char *argv[]) {
+void main_init(int argc, char *argv[]) {
   __argc = argc;
   __argv = argv;
 
@@ -83,17 +83,22 @@ int main(int argc, char *argv[]) {
 
   // Splash
   printf_P(PSTR("\n{\"firmware\":\"Buildbotics AVR\"}\n"));
+}
+
+
+void main_loop() {
+  emu_callback();                 // Emulator callback
+  hw_reset_handler();             // handle hard reset requests
+  state_callback();               // manage state
+  command_callback();             // process next command
+  modbus_callback();              // handle modbus events
+  input_callback();               // handle digital input
+  report_callback();              // report changes
+}
 
-  // Main loop
-  while (true) {
-    emu_callback();               // Emulator callback
-    hw_reset_handler();           // handle hard reset requests
-    state_callback();             // manage state
-    command_callback();           // process next command
-    modbus_callback();            // handle modbus events
-    input_callback();             // handle digital input
-    report_callback();            // report changes
-  }
 
+int main(int argc, char *argv[]) {
+  main_init(argc, argv);
+  while (true) main_loop();
   return 0;
 }
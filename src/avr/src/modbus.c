@@ -246,7 +246,7 @@ ISR(RS485_RXC_vect) {
 
 
 static void _read_cb(uint8_t func, uint8_t bytes, const uint8_t *data) {
-  if (func == MODBUS_READ_OUTPUT_REG && data[0] == bytes - 1) {
+  if (func == MODBUS_READ_OUTPUT_REG && data && data[0] == bytes - 1) {
     if (state.rw_cb)
       for (uint8_t i = 0; i < bytes >> 1; i++)
         state.rw_cb(true, state.addr + i, _read_word(data + i * 2 + 1, false));
@@ -272,6 +272,19 @@ void motor_emulate_steps(int motor) {
 }
 
 
+void motor_emulate_trace(int motor, int32_t *steps, bool *negative,
+                         uint32_t *period) {
+  motor_t *m = &motors[motor];
+  *steps = m->commanded;
+  *negative = m->last_negative;
+
+  // Step period in CPU clocks, zero when stopped
+  if (!m->timer->CTRLA) *period = 0;
+  else *period = (uint32_t)m->timer->PERBUF *
+         (m->timer->CTRLA == TC_CLKSEL_DIV2_gc ? 2 : 1);
+}
+
+
 void motor_end_move(int motor) {
   motor_t &m = motors[motor];
 
@@ -35,8 +35,11 @@
 #include "exec.h"
 #include "estop.h"
 #include "util.h"
+#include "base64.h"
 
 #include <math.h>
+#include <string.h>
+#include <stddef.h>
 
 
 typedef struct {
@@ -45,10 +48,34 @@ typedef struct {
 } sync_speed_t;
 
 
+// Sync speed list flags
+enum {
+  SYNC_SPEEDS_POWER_8BIT = 1 << 0, // Speeds are 8-bit fractions of scale
+  SYNC_SPEEDS_RASTER     = 1 << 1, // 8-bit powers spaced by pitch
+};
+
+
+// Command data less flags, offset and scale
+#define SYNC_SPEEDS_DATA (INPUT_DATA_MAX - 9)
+
+
+typedef struct {
+  uint8_t flags;
+  uint8_t count;
+  float dist;  // Offset of first entry
+  float scale; // Speed at 8-bit power 255
+  float pitch; // Raster pixel spacing
+  uint8_t data[SYNC_SPEEDS_DATA]; // [dist delta um u16][speed f32 | power u8]
+                                  // or raster [power u8]
+} sync_speeds_t;
+
+
 static struct {
   spindle_type_t type;
   float override;
   sync_speed_t sync_speed;
+  sync_speeds_t sync_speeds;
+  uint8_t sync_speeds_next;
   float speed;
   bool reversed;
   float min_rpm;
@@ -123,6 +150,7 @@ static void _deinit_cb() {
   default:                    vfd_spindle_init(); break;
   }
 
+  st_set_power_updates(spindle.type == SPINDLE_TYPE_PWM);
   spindle_update_speed();
 }
 
@@ -146,13 +174,18 @@ static void _set_type(spindle_type_t type) {
 spindle_type_t spindle_get_type() {return spindle.type;}
 
 
-static power_update_t _get_power_update() {
+static bool _is_dynamic() {
+  return spindle.type == SPINDLE_TYPE_PWM && spindle.dynamic_power &&
+    spindle.inv_feed;
+}
+
+
+static power_update_t _get_power_update(float velocity) {
   float power = _speed_to_power(spindle.speed);
 
   // Handle dynamic power
-  if (spindle.type == SPINDLE_TYPE_PWM && spindle.dynamic_power &&
-      spindle.inv_feed) {
-    float scale = spindle.inv_feed * exec_get_velocity();
+  if (_is_dynamic()) {
+    float scale = spindle.inv_feed * velocity;
     if (scale < 1) power *= scale;
   }
 
@@ -160,38 +193,123 @@ static power_update_t _get_power_update() {
 }
 
 
-void spindle_load_power_updates(power_update_t updates[], float minD,
-                                float maxD) {
-  float stepD = (maxD - minD) * (1.0 / POWER_MAX_UPDATES);
-  float d = minD + 1e-3; // Starting distance
+static unsigned _sync_speeds_entry_size(uint8_t flags) {
+  if (flags & SYNC_SPEEDS_RASTER) return 1;
+  return 2 + (flags & SYNC_SPEEDS_POWER_8BIT ? 1 : 4);
+}
 
-  for (unsigned i = 0; i < POWER_MAX_UPDATES; i++) {
-    bool changed = false;
-    d += stepD; // Ending distance for this power step
 
-    while (true) {
-      // Load new sync speed if needed and available
-      if (spindle.sync_speed.dist < 0 && command_peek() == COMMAND_sync_speed)
-        spindle.sync_speed = *(sync_speed_t *)(command_next() + 1);
+static bool _next_list_sync_speed() {
+  sync_speeds_t &l = spindle.sync_speeds;
+  if (l.count <= spindle.sync_speeds_next) return false;
 
-      // Exit if we don't have a speed or it's not ready to be set
-      if (spindle.sync_speed.dist == -1 || d < spindle.sync_speed.dist) break;
+  if (l.flags & SYNC_SPEEDS_RASTER) {
+    unsigned i = spindle.sync_speeds_next++;
+    spindle.sync_speed.dist = l.dist + i * l.pitch;
+    spindle.sync_speed.speed = l.data[i] * l.scale;
+    return true;
+  }
 
-      // Load sync speed
-      spindle.sync_speed.dist = -1; // Mark done
-      spindle.speed = spindle.sync_speed.speed;
-      changed = true;
-    }
+  unsigned size = _sync_speeds_entry_size(l.flags);
+  const uint8_t *entry = l.data + spindle.sync_speeds_next++ * size;
 
-    if (spindle.type == SPINDLE_TYPE_PWM) updates[i] = _get_power_update();
-    else {
-      updates[i].state = POWER_IGNORE;
-      if (changed) spindle_update_speed();
-    }
+  uint16_t delta = entry[0] | entry[1] << 8;
+  l.dist += delta * 1e-3;
+  spindle.sync_speed.dist = l.dist;
+
+  if (l.flags & SYNC_SPEEDS_POWER_8BIT)
+    spindle.sync_speed.speed = entry[2] * l.scale;
+  else memcpy(&spindle.sync_speed.speed, entry + 2, 4);
+
+  return true;
+}
+
+
+static void _load_sync_speeds(const uint8_t *data) {
+  sync_speeds_t &l = spindle.sync_speeds;
+
+  memcpy(&l, data, offsetof(sync_speeds_t, data));
+  memcpy(l.data, data + offsetof(sync_speeds_t, data),
+         l.count * _sync_speeds_entry_size(l.flags));
+
+  l.scale *= 1.0 / 255;
+  spindle.sync_speeds_next = 0;
+}
+
+
+static void _next_sync_speed() {
+  if (_next_list_sync_speed()) return;
+
+  switch (command_peek()) {
+  case COMMAND_sync_speed:
+    spindle.sync_speed = *(sync_speed_t *)(command_next() + 1);
+    break;
+
+  case COMMAND_sync_speeds: case COMMAND_raster:
+    _load_sync_speeds(command_next() + 1);
+    _next_list_sync_speed();
+    break;
+
+  default: break;
   }
 }
 
 
+/// True if power may change during a segment ending at distance endD, with
+/// dynamic power or a sync speed due by then
+bool spindle_power_varies(float endD) {
+  if (spindle.sync_speed.dist < 0) _next_sync_speed();
+
+  return _is_dynamic() ||
+    (spindle.sync_speed.dist != -1 && spindle.sync_speed.dist <= endD + 1e-3);
+}
+
+
+/// Load power updates which are the same for a whole segment
+void spindle_load_power(power_update_t updates[], float velocity) {
+  power_update_t update = {POWER_IGNORE, 0, 0};
+
+  if (spindle.type == SPINDLE_TYPE_PWM) update = _get_power_update(velocity);
+  else update.state = POWER_IGNORE;
+
+  for (unsigned i = 0; i < POWER_MAX_UPDATES; i++) updates[i] = update;
+}
+
+
+/// Power update given the distance at the end of and the average velocity
+/// during the update
+power_update_t spindle_power_update(float dist, float velocity) {
+  bool changed = false;
+  float d = dist + 1e-3; // Ending distance for this step
+
+  while (true) {
+    // Load new sync speed if needed and available
+    if (spindle.sync_speed.dist < 0) _next_sync_speed();
+
+    // Exit if we don't have a speed or it's not ready to be set
+    if (spindle.sync_speed.dist == -1 || d < spindle.sync_speed.dist) break;
+
+    // Load sync speed
+    spindle.sync_speed.dist = -1; // Mark done
+    spindle.speed = spindle.sync_speed.speed;
+    changed = true;
+  }
+
+  if (spindle.type == SPINDLE_TYPE_PWM) return _get_power_update(velocity);
+
+  power_update_t update = {POWER_IGNORE, 0, 0};
+  if (changed) spindle_update_speed();
+  return update;
+}
+
+
+/// Load power updates with no motion
+void spindle_load_power_updates(power_update_t updates[]) {
+  for (unsigned i = 0; i < POWER_MAX_UPDATES; i++)
+    updates[i] = spindle_power_update(0, 0);
+}
+
+
 // Called from hi-priority stepper interrupt
 void spindle_update(const power_update_t &update) {pwm_update(update);}
 void spindle_update_speed() {_set_speed(spindle.speed);}
@@ -200,10 +318,14 @@ void spindle_update_speed() {_set_speed(spindle.speed);}
 // Called from lo-priority stepper interrupt
 void spindle_idle() {
   if (spindle.sync_speed.dist != -1) {
+    // Skip to the last speed in the current list
+    while (_next_list_sync_speed()) continue;
+
     spindle.sync_speed.dist = -1; // Mark done
     spindle.speed = spindle.sync_speed.speed;
 
-    if (spindle.type == SPINDLE_TYPE_PWM) spindle_update(_get_power_update());
+    if (spindle.type == SPINDLE_TYPE_PWM)
+      spindle_update(_get_power_update(exec_get_velocity()));
     else spindle_update_speed();
   }
 }
@@ -323,6 +445,98 @@ void command_sync_speed_exec(void *data) {
 }
 
 
+stat_t command_sync_speeds(char *cmd) {
+  cmd++; // Skip command code
+
+  // Decode [flags][offset][scale][speeds]
+  uint8_t data[INPUT_DATA_MAX];
+  unsigned len = strlen(cmd);
+  if (b64_encoded_length(sizeof(data), false) < len)
+    return STAT_TOO_MANY_ARGUMENTS;
+  if (!b64_decode(cmd, len, data)) return STAT_INVALID_ARGUMENTS;
+
+  len = len * 3 / 4;
+  if (len < 9) return STAT_TOO_FEW_ARGUMENTS;
+
+  sync_speeds_t l;
+  l.flags = data[0] & SYNC_SPEEDS_POWER_8BIT;
+  memcpy(&l.dist, data + 1, 4);
+  memcpy(&l.scale, data + 5, 4);
+  l.pitch = 0;
+
+  if (!isfinite(l.dist) || l.dist < 0) return STAT_BAD_FLOAT;
+  if (!isfinite(l.scale)) return STAT_BAD_FLOAT;
+
+  unsigned size = _sync_speeds_entry_size(l.flags);
+  len -= 9;
+  if (!len || len % size) return STAT_INVALID_ARGUMENTS;
+  l.count = len / size;
+  memcpy(l.data, data + 9, len);
+
+  if (!(l.flags & SYNC_SPEEDS_POWER_8BIT))
+    for (unsigned i = 0; i < l.count; i++) {
+      float speed;
+      memcpy(&speed, l.data + i * size + 2, 4);
+      if (!isfinite(speed)) return STAT_BAD_FLOAT;
+    }
+
+  // Queue
+  command_push_size(COMMAND_sync_speeds, &l,
+                    offsetof(sync_speeds_t, data) + len);
+
+  return STAT_OK;
+}
+
+
+unsigned command_sync_speeds_size() {return sizeof(sync_speeds_t);}
+
+
+void command_sync_speeds_exec(void *data) {
+  _load_sync_speeds((const uint8_t *)data);
+  while (_next_list_sync_speed()) continue;
+
+  spindle.sync_speed.dist = -1;
+  _set_speed(spindle.sync_speed.speed);
+}
+
+
+stat_t command_raster(char *cmd) {
+  cmd++; // Skip command code
+
+  // Decode [offset][pitch][scale][powers]
+  uint8_t data[12 + RASTER_MAX];
+  unsigned len = strlen(cmd);
+  if (b64_encoded_length(sizeof(data), false) < len)
+    return STAT_TOO_MANY_ARGUMENTS;
+  if (!b64_decode(cmd, len, data)) return STAT_INVALID_ARGUMENTS;
+
+  len = len * 3 / 4;
+  if (len <= 12) return STAT_TOO_FEW_ARGUMENTS;
+  len -= 12;
+
+  sync_speeds_t l;
+  l.flags = SYNC_SPEEDS_POWER_8BIT | SYNC_SPEEDS_RASTER;
+  l.count = len;
+  memcpy(&l.dist, data, 4);
+  memcpy(&l.pitch, data + 4, 4);
+  memcpy(&l.scale, data + 8, 4);
+  memcpy(l.data, data + 12, len);
+
+  if (!isfinite(l.dist) || l.dist < 0) return STAT_BAD_FLOAT;
+  if (!isfinite(l.pitch) || l.pitch <= 0) return STAT_BAD_FLOAT;
+  if (!isfinite(l.scale)) return STAT_BAD_FLOAT;
+
+  // Queue
+  command_push_size(COMMAND_raster, &l, offsetof(sync_speeds_t, data) + len);
+
+  return STAT_OK;
+}
+
+
+unsigned command_raster_size() {return sizeof(sync_speeds_t);}
+void command_raster_exec(void *data) {command_sync_speeds_exec(data);}
+
+
 stat_t command_speed(char *cmd) {
   cmd++; // Skip command code
 
@@ -27,10 +27,16 @@
 
 #pragma once
 
+#include "config.h"
+
 #include <stdbool.h>
 #include <stdint.h>
 
 
+// Powers per raster command, after the offset, pitch and scale
+#define RASTER_MAX (INPUT_DATA_MAX - 12)
+
+
 typedef enum {
   POWER_IGNORE,
   POWER_FORWARD,
@@ -74,8 +80,10 @@ typedef void (*deinit_cb_t)();
 spindle_type_t spindle_get_type();
 void spindle_stop();
 void spindle_estop();
-void spindle_load_power_updates(power_update_t updates[], float minD,
-                                float maxD);
+bool spindle_power_varies(float endD);
+void spindle_load_power(power_update_t updates[], float velocity);
+power_update_t spindle_power_update(float dist, float velocity);
+void spindle_load_power_updates(power_update_t updates[]);
 void spindle_update(const power_update_t &update);
 void spindle_update_speed();
 void spindle_idle();
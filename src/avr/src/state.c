@@ -211,7 +211,11 @@ PGM_P get_hold_reason() {return state_get_hold_reason_pgmstr(s.hold_reason);}
 
 // Command callbacks
 stat_t command_pause(char *cmd) {
-  pause_t type = (pause_t)(cmd[1] - '0');
+  int value = cmd[1] - '0';
+  if (value < PAUSE_USER || PAUSE_PROGRAM_OPTIONAL < value || cmd[2])
+    return STAT_INVALID_ARGUMENTS;
+
+  pause_t type = (pause_t)value;
 
   if (type == PAUSE_USER) s.pause_requested = true;
   else command_push(cmd[0], &type);
@@ -35,17 +35,38 @@
 #include "cpp_magic.h"
 #include "exec.h"
 #include "drv8711.h"
+#include "command.h"
+#include "rtc.h"
+#include "pgmspace.h"
 
 #include <util/atomic.h>
 
 #include <string.h>
 #include <stdio.h>
+#include <inttypes.h>
+
+
+typedef enum {
+  UNDERRUN_EMPTY, // Command queue empty
+  UNDERRUN_HELD,  // Command exec waiting for queue to fill
+  UNDERRUN_LATE,  // Move exec did not complete in time
+  UNDERRUN_CAUSES
+} underrun_cause_t;
+
+
+typedef struct {
+  uint32_t time;
+  uint8_t cause;
+  uint16_t depth;
+  uint16_t id;
+} underrun_event_t;
 
 
 typedef struct {
   // Runtime
   bool busy;
   bool requesting;
+  bool late;        // Stall already counted as late, until a move loads
   float dwell;
   uint8_t power_buf;
   uint8_t power_index;
@@ -58,22 +79,51 @@ typedef struct {
 
   power_update_t powers[2][POWER_MAX_UPDATES];
 
-  uint32_t underrun;
+  uint32_t underruns[UNDERRUN_CAUSES];
+  underrun_event_t underrun_log[UNDERRUN_LOG_SIZE];
+  uint8_t underrun_next;
 } stepper_t;
 
 
 static stepper_t st = {0};
 
 
+#if POWER_UPDATES_PER_MS < 1 || 4 < POWER_UPDATES_PER_MS
+#error "POWER_UPDATES_PER_MS must be 1 to 4"
+#endif
+
+
 void stepper_init() {
   // Setup step timer
   TIMER_STEP.CTRLB    = TC_WGMODE_NORMAL_gc; // Count to TOP & rollover
   TIMER_STEP.INTCTRLA = TC_OVFINTLVL_HI_gc;  // Interrupt level
   TIMER_STEP.PER      = STEP_TIMER_POLL;     // Timer rate
+
+  // Compare points for power updates between overflows
+  const uint16_t step = STEP_TIMER_POLL / POWER_UPDATES_PER_MS;
+  TIMER_STEP.CCA = step;
+  TIMER_STEP.CCB = 2 * step;
+  TIMER_STEP.CCC = 3 * step;
+
   TIMER_STEP.CTRLA    = TC_CLKSEL_DIV8_gc;   // Start step timer
 }
 
 
+/// Enable compare interrupts for power updates between 1ms ticks.  Only PWM
+/// power changes within a tick, other spindles are updated by exec.
+void st_set_power_updates(bool enable) {
+  uint8_t intctrlb = 0;
+
+  if (enable) {
+    if (1 < POWER_UPDATES_PER_MS) intctrlb |= TC_CCAINTLVL_HI_gc;
+    if (2 < POWER_UPDATES_PER_MS) intctrlb |= TC_CCBINTLVL_HI_gc;
+    if (3 < POWER_UPDATES_PER_MS) intctrlb |= TC_CCCINTLVL_HI_gc;
+  }
+
+  TIMER_STEP.INTCTRLB = intctrlb;
+}
+
+
 static void _end_move() {
   for (int motor = 0; motor < MOTORS; motor++)
     motor_end_move(motor);
@@ -97,6 +147,19 @@ void st_shutdown() {
 bool st_is_busy() {return st.busy;}
 
 
+static void _underrun(underrun_cause_t cause) {
+  st.underruns[cause]++;
+
+  underrun_event_t &e = st.underrun_log[st.underrun_next];
+  st.underrun_next = (st.underrun_next + 1) % UNDERRUN_LOG_SIZE;
+
+  e.time  = rtc_get_time();
+  e.cause = cause;
+  e.depth = command_get_count();
+  e.id    = command_get_id();
+}
+
+
 /// Interrupt handler for calling move exec function.
 /// ADC channel 0 triggered by load ISR as a "software" interrupt.
 ISR(STEP_LOW_LEVEL_ISR) {
@@ -106,7 +169,8 @@ ISR(STEP_LOW_LEVEL_ISR) {
     switch (status) {
     case STAT_NOP:                          // No move executed, idle
       if (!st.busy) {
-        if (MIN_VELOCITY < exec_get_velocity()) st.underrun++;
+        if (!st.late && MIN_VELOCITY < exec_get_velocity())
+          _underrun(command_exec_held() ? UNDERRUN_HELD : UNDERRUN_EMPTY);
         exec_set_velocity(0); // Velocity is zero if there are no moves
 
         spindle_idle();
@@ -148,6 +212,18 @@ static void _update_power() {
 }
 
 
+/// Step timer compare interrupts.  Power updates between 1ms ticks.
+#if 1 < POWER_UPDATES_PER_MS
+ISR(STEP_TIMER_CCA_ISR) {_update_power();}
+#endif
+#if 2 < POWER_UPDATES_PER_MS
+ISR(STEP_TIMER_CCB_ISR) {_update_power();}
+#endif
+#if 3 < POWER_UPDATES_PER_MS
+ISR(STEP_TIMER_CCC_ISR) {_update_power();}
+#endif
+
+
 /// Step timer interrupt routine.
 /// Dwell or dequeue and load next move.
 ISR(STEP_TIMER_ISR) {
@@ -167,6 +243,12 @@ ISR(STEP_TIMER_ISR) {
 
   // If the next move is not ready try to load it
   if (!st.move_ready) {
+    // Exec still running from the last request
+    if (st.busy && st.requesting && MIN_VELOCITY < exec_get_velocity()) {
+      _underrun(UNDERRUN_LATE);
+      st.late = true;
+    }
+
     _request_exec_move();
     _end_move();
     tick = 0; // Try again in 1ms
@@ -200,6 +282,7 @@ ISR(STEP_TIMER_ISR) {
   }
 
   st.busy = true;        // Executing move so mark busy
+  st.late = false;
   st.move_ready = false; // We are done with this move, flip the flag back
 }
 
@@ -229,14 +312,23 @@ void st_prep_dwell(float seconds) {
   ESTOP_ASSERT(!st.move_ready, STAT_STEPPER_NOT_READY);
   if (seconds <= 1e-4) seconds = 1e-4; // Min dwell
   st.power_next = !st.power_buf;
-  spindle_load_power_updates(st.powers[st.power_next], 0, 0);
+  spindle_load_power_updates(st.powers[st.power_next]);
   st.prep_dwell = seconds;
   st.move_queued = true; // signal prep buffer ready
 }
 
 
 // Var callbacks
-uint32_t get_underrun() {return st.underrun;}
+uint32_t get_underrun() {
+  uint32_t total = 0;
+  for (int i = 0; i < UNDERRUN_CAUSES; i++) total += st.underruns[i];
+  return total;
+}
+
+
+uint32_t get_underrun_empty() {return st.underruns[UNDERRUN_EMPTY];}
+uint32_t get_underrun_held()  {return st.underruns[UNDERRUN_HELD];}
+uint32_t get_underrun_late()  {return st.underruns[UNDERRUN_LATE];}
 
 
 float get_dwell_time() {
@@ -244,3 +336,46 @@ float get_dwell_time() {
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE) dwell = st.dwell;
   return dwell;
 }
+
+
+// Command callbacks
+static PGM_P _underrun_cause_pgmstr(uint8_t cause) {
+  switch (cause) {
+  case UNDERRUN_EMPTY: return PSTR("empty");
+  case UNDERRUN_HELD:  return PSTR("held");
+  case UNDERRUN_LATE:  return PSTR("late");
+  }
+
+  return PSTR("invalid");
+}
+
+
+stat_t command_underruns(char *cmd) {
+  underrun_event_t log[UNDERRUN_LOG_SIZE];
+  uint8_t next;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    memcpy(log, st.underrun_log, sizeof(log));
+    next = st.underrun_next;
+  }
+
+  static const char fmt[] PROGMEM =
+    "{\"t\":%" PRIu32 ",\"cause\":\"%" PRPSTR "\",\"depth\":%" PRIu16
+    ",\"id\":%" PRIu16 "}";
+
+  bool first = true;
+  printf_P(PSTR("{\"underruns\":["));
+
+  // Oldest first
+  for (int i = 0; i < UNDERRUN_LOG_SIZE; i++) {
+    const underrun_event_t &e = log[(next + i) % UNDERRUN_LOG_SIZE];
+    if (!e.time) continue; // Unused entry
+
+    if (first) first = false; else putchar(',');
+    printf_P(fmt, e.time, _underrun_cause_pgmstr(e.cause), e.depth, e.id);
+  }
+
+  printf_P(PSTR("]}\n"));
+
+  return STAT_OK;
+}
@@ -63,6 +63,8 @@ void type_print_f32(float x) {
   if (isnan(x)) printf_P(PSTR("\"nan\""));
   else if (isinf(x)) printf_P(PSTR("\"%cinf\""), x < 0 ? '-' : '+');
 
+  else if (1e9 <= fabs(x)) printf_P(PSTR("%g"), x); // Too long for buf
+
   else {
     char buf[20];
 
@@ -35,6 +35,9 @@
 #include "cpp_magic.h"
 #include "report.h"
 #include "command.h"
+#include "base64.h"
+
+#include <util/crc16.h>
 
 #include <string.h>
 #include <stdio.h>
@@ -266,6 +269,32 @@ static bool _find_var(const char *_name, var_info_t *info) {
 }
 
 
+static bool _find_var_code(uint8_t code, int8_t i, var_info_t *info) {
+  memset(info, 0, sizeof(var_info_t));
+
+  switch (code) {
+#define VAR(NAME, CODE, TYPE, INDEX, SET, ...)                          \
+    case var_code_##CODE:                                               \
+      if (IF_ELSE(INDEX)(i < 0 || INDEX <= i, i != -1)) return false;   \
+                                                                        \
+      info->type = TYPE_##TYPE;                                         \
+      info->index = i;                                                  \
+      info->get.IF_ELSE(INDEX)(get_##TYPE##_index, get_##TYPE) =        \
+        get_##NAME;                                                     \
+                                                                        \
+      IF(SET)(info->set.IF_ELSE(INDEX)                                  \
+              (set_##TYPE##_index, set_##TYPE) = set_##NAME;)           \
+                                                                        \
+      return true;
+
+#include "vars.def"
+#undef VAR
+  }
+
+  return false;
+}
+
+
 static type_u _get(type_t type, int8_t index, get_cb_u cb) {
   type_u value;
 
@@ -401,7 +430,100 @@ void command_sync_var_exec(void *data) {
 }
 
 
+// Bulk variable set
+// [count]([code][index][value])...[CRC16], base64 encoded without padding
+//   code  - var order as reported by vars_print_json()
+//   index - index for indexed vars, otherwise -1
+//   value - little endian, 4 bytes for f32 and 32-bit ints, 2 for u16,
+//           otherwise 1
+#define BULK_DATA_MAX INPUT_DATA_MAX
+#define BULK_VAR_MAX ((BULK_DATA_MAX - 3) / 3)
+
+
+static stat_t _bulk_value(type_t type, const uint8_t **data,
+                          const uint8_t *end, type_u *value) {
+  unsigned size;
+
+  switch (type) {
+  case TYPE_f32: case TYPE_s32: case TYPE_u32: size = 4; break;
+  case TYPE_u16: size = 2; break;
+  case TYPE_u8: case TYPE_s8: case TYPE_b8: size = 1; break;
+  default: return STAT_INVALID_TYPE;
+  }
+
+  if (end < *data + size) return STAT_TOO_FEW_ARGUMENTS;
+
+  uint32_t u = 0;
+  for (unsigned i = 0; i < size; i++) u |= (uint32_t)*(*data)++ << (8 * i);
+
+  switch (type) {
+  case TYPE_f32: memcpy(&value->_f32, &u, 4); break;
+  case TYPE_s32: value->_s32 = u; break;
+  case TYPE_u32: value->_u32 = u; break;
+  case TYPE_u16: value->_u16 = u; break;
+  case TYPE_u8:  value->_u8  = u; break;
+  case TYPE_s8:  value->_s8  = u; break;
+  default:       value->_b8  = u; break;
+  }
+
+  return STAT_OK;
+}
+
+
+stat_t command_bulk(char *cmd) {
+  cmd++; // Skip command code
+
+  uint8_t data[BULK_DATA_MAX];
+  unsigned len = strlen(cmd);
+  if (b64_encoded_length(sizeof(data), false) < len)
+    return STAT_TOO_MANY_ARGUMENTS;
+  if (!b64_decode(cmd, len, data)) return STAT_INVALID_ARGUMENTS;
+
+  // Check CRC
+  len = len * 3 / 4;
+  if (len < 3) return STAT_TOO_FEW_ARGUMENTS;
+
+  uint16_t crc = 0xffff;
+  for (unsigned i = 0; i < len - 2; i++) crc = _crc16_update(crc, data[i]);
+  if (data[len - 2] != (crc & 0xff) || data[len - 1] != crc >> 8)
+    return STAT_INVALID_VALUE;
+
+  // Validate all vars before setting any
+  uint8_t count = data[0];
+  if (BULK_VAR_MAX < count) return STAT_TOO_MANY_ARGUMENTS;
+
+  const uint8_t *next = data + 1;
+  const uint8_t *end = data + len - 2;
+  var_cmd_t vars[BULK_VAR_MAX];
+
+  for (unsigned i = 0; i < count; i++) {
+    if (end < next + 2) return STAT_TOO_FEW_ARGUMENTS;
+
+    var_info_t info;
+    if (!_find_var_code(next[0], (int8_t)next[1], &info))
+      return STAT_UNRECOGNIZED_NAME;
+    if (!info.set.ptr) return STAT_READ_ONLY;
+    next += 2;
+
+    vars[i].type  = info.type;
+    vars[i].index = info.index;
+    vars[i].set   = info.set;
+
+    stat_t status = _bulk_value(info.type, &next, end, &vars[i].value);
+    if (status) return status;
+  }
+
+  if (next != end) return STAT_TOO_MANY_ARGUMENTS;
+
+  for (unsigned i = 0; i < count; i++)
+    _set(vars[i].type, vars[i].index, vars[i].set, vars[i].value);
+
+  return STAT_OK;
+}
+
+
 stat_t command_report(char *cmd) {
+  if (!cmd[1]) return STAT_INVALID_ARGUMENTS;
   bool enable = cmd[1] != '0';
 
   if (cmd[2]) vars_report_var(cmd + 2, enable);
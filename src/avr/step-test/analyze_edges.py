@@ -0,0 +1,224 @@
+#!/usr/bin/env python3
+
+################################################################################
+#                                                                              #
+#                 This file is part of the Buildbotics firmware.               #
+#                                                                              #
+#        Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.      #
+#                                                                              #
+#         This Source describes Open Hardware and is licensed under the        #
+#                                 CERN-OHL-S v2.                               #
+#                                                                              #
+#         You may redistribute and modify this Source and make products        #
+#    using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).  #
+#           This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED          #
+#    WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS  #
+#     FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable    #
+#                                  conditions.                                 #
+#                                                                              #
+#                Source location: https://github.com/buildbotics               #
+#                                                                              #
+#      As per CERN-OHL-S v2 section 4, should You produce hardware based on    #
+#    these sources, You must maintain the Source Location clearly visible on   #
+#    the external case of the CNC Controller or other product you make using   #
+#                                  this Source.                                #
+#                                                                              #
+#                For more information, email info@buildbotics.com              #
+#                                                                              #
+################################################################################
+
+# Builds step interval histograms from a step-test edge capture, made by
+# building the fixture with "make CAPTURE=1".  The capture starts with a
+# CAPTURE line followed by four byte records:
+#
+#   flags    Channel in bits 0-1, then CAPTURE_* below
+#   epoch    Low byte of the timer wrap count
+#   ticks    16-bit timestamp, little endian, 0.25us per tick
+#
+# Intervals are between consecutive edges on a channel in the same direction.
+# Jitter is each interval's difference from the mean of its neighbors, which
+# removes smooth changes in rate from acceleration.
+
+import sys, json, struct, argparse
+import numpy as np
+
+
+TICK_US = 0.25
+CAPTURE_NEGATIVE = 0x04
+CAPTURE_OVERFLOW = 0x40
+CAPTURE_DROPPED = 0x80
+
+
+def read_serial(port, baud, seconds, save):
+  import serial, time
+
+  sp = serial.Serial(port, baud, timeout = 0.1)
+  data = b''
+  end = time.time() + seconds
+
+  while time.time() < end: data += sp.read(max(1, sp.in_waiting))
+  sp.close()
+
+  if save:
+    with open(save, 'wb') as f: f.write(data)
+
+  return data
+
+
+def parse(data):
+  '''Returns per channel edge times in us and directions and the number of
+  dropped edges.'''
+  start = data.rfind(b'CAPTURE\n')
+  if start == -1: raise Exception('No CAPTURE header found')
+  data = data[start + 8:]
+
+  times = [[] for i in range(4)]
+  negative = [[] for i in range(4)]
+  dropped = 0
+  epoch = None
+
+  for i in range(0, len(data) - 3, 4):
+    flags, e, ticks = struct.unpack('<BBH', data[i:i + 4])
+
+    if flags & CAPTURE_DROPPED:
+      dropped += ticks
+      continue
+
+    # Extend the epoch byte, captures may be slightly out of order
+    if epoch is None: epoch = e
+    else:
+      delta = (e - epoch) & 0xff
+      epoch += delta if delta < 128 else delta - 256
+
+    if flags & CAPTURE_OVERFLOW: continue
+
+    channel = flags & 3
+    times[channel].append(((epoch << 16) + ticks) * TICK_US)
+    negative[channel].append(bool(flags & CAPTURE_NEGATIVE))
+
+  return times, negative, dropped
+
+
+def intervals(times, negative, max_interval):
+  '''Step intervals and their jitter in us, within runs of steps.'''
+  t = np.array(times)
+  n = np.array(negative)
+  if len(t) < 2: return np.zeros(0), np.zeros(0)
+
+  order = np.argsort(t, kind = 'stable')
+  t, n = t[order], n[order]
+
+  dt = np.diff(t)
+  valid = (dt <= max_interval) & (n[1:] == n[:-1])
+
+  # Jitter needs valid neighbors on both sides
+  jitter = np.zeros(0)
+  if 2 < len(dt):
+    both = valid[1:-1] & valid[:-2] & valid[2:]
+    mid = dt[1:-1] - (dt[:-2] + dt[2:]) / 2
+    jitter = mid[both]
+
+  return dt[valid], jitter
+
+
+def stats(x):
+  if not len(x): return dict(count = 0)
+
+  a = np.abs(x)
+  return dict(
+    count = int(len(x)),
+    min = round(float(np.min(x)), 3),
+    mean = round(float(np.mean(x)), 3),
+    max = round(float(np.max(x)), 3),
+    p99_abs = round(float(np.percentile(a, 99)), 3),
+    max_abs = round(float(np.max(a)), 3))
+
+
+def histogram(x, bins):
+  if not len(x): return
+
+  counts, edges = np.histogram(x, bins = bins)
+  scale = 50 / max(1, np.max(counts))
+
+  for count, lo, hi in zip(counts, edges[:-1], edges[1:]):
+    print('  %10.2f - %10.2f %8d %s' % (lo, hi, count, '#' * int(np.ceil(
+      count * scale))))
+
+
+def plot(results, output):
+  import matplotlib
+  if output: matplotlib.use('Agg')
+  import matplotlib.pyplot as plt
+
+  fig, axes = plt.subplots(2)
+
+  for channel, dt, jitter in results:
+    label = 'XYZA'[channel]
+    axes[0].hist(dt, bins = 200, histtype = 'step', label = label)
+    axes[1].hist(jitter, bins = 200, histtype = 'step', label = label)
+
+  axes[0].set_xlabel('Step interval (us)')
+  axes[1].set_xlabel('Jitter (us)')
+  axes[0].set_yscale('log')
+  axes[1].set_yscale('log')
+  axes[0].legend()
+
+  if output: plt.savefig(output)
+  else: plt.show()
+
+
+if __name__ == '__main__':
+  # Parse command line arguments
+  description = 'Step interval histograms from a step-test edge capture'
+  parser = argparse.ArgumentParser(description = description)
+  parser.add_argument('-f', '--file', help = 'Read a saved capture')
+  parser.add_argument('-p', '--port', default = '/dev/ttyUSB0')
+  parser.add_argument('-b', '--baud', default = 1000000, type = int)
+  parser.add_argument('-t', '--time', default = 10, type = float,
+                      help = 'Seconds to capture from the port')
+  parser.add_argument('-s', '--save', help = 'Save the raw capture to file')
+  parser.add_argument('-m', '--max-interval', default = 10000, type = float,
+                      help = 'Longer intervals, in us, are stops')
+  parser.add_argument('--bins', default = 20, type = int,
+                      help = 'Text histogram bins')
+  parser.add_argument('--json', action = 'store_true',
+                      help = 'Print results as JSON')
+  parser.add_argument('--plot', nargs = '?', const = '',
+                      help = 'Plot histograms, to a file if given')
+  args = parser.parse_args()
+
+  if args.file:
+    with open(args.file, 'rb') as f: data = f.read()
+  else: data = read_serial(args.port, args.baud, args.time, args.save)
+
+  times, negative, dropped = parse(data)
+  results = []
+  summary = dict(dropped = dropped, channels = {})
+
+  for channel in range(4):
+    dt, jitter = intervals(times[channel], negative[channel],
+                           args.max_interval)
+    if not len(dt): continue
+
+    results.append((channel, dt, jitter))
+    summary['channels']['XYZA'[channel]] = dict(
+      edges = len(times[channel]), interval = stats(dt),
+      jitter = stats(jitter))
+
+  if args.json: print(json.dumps(summary, indent = 2))
+  else:
+    if dropped: print('WARNING: %d edges dropped by the fixture' % dropped)
+
+    for channel, dt, jitter in results:
+      s = summary['channels']['XYZA'[channel]]
+      print('%s: %d edges, interval %.2f - %.2f us, mean %.2f us' % (
+        'XYZA'[channel], s['edges'], s['interval']['min'],
+        s['interval']['max'], s['interval']['mean']))
+      histogram(dt, args.bins)
+
+      if len(jitter):
+        print('  jitter p99 %.2f us, max %.2f us' % (
+          s['jitter']['p99_abs'], s['jitter']['max_abs']))
+        histogram(jitter, args.bins)
+
+  if args.plot is not None: plot(results, args.plot)
@@ -0,0 +1,239 @@
+#!/usr/bin/env python3
+
+################################################################################
+#                                                                              #
+#                 This file is part of the Buildbotics firmware.               #
+#                                                                              #
+#        Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.      #
+#                                                                              #
+#         This Source describes Open Hardware and is licensed under the        #
+#                                 CERN-OHL-S v2.                               #
+#                                                                              #
+#         You may redistribute and modify this Source and make products        #
+#    using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).  #
+#           This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED          #
+#    WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS  #
+#     FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable    #
+#                                  conditions.                                 #
+#                                                                              #
+#                Source location: https://github.com/buildbotics               #
+#                                                                              #
+#      As per CERN-OHL-S v2 section 4, should You produce hardware based on    #
+#    these sources, You must maintain the Source Location clearly visible on   #
+#    the external case of the CNC Controller or other product you make using   #
+#                                  this Source.                                #
+#                                                                              #
+#                For more information, email info@buildbotics.com              #
+#                                                                              #
+################################################################################
+
+# Compares a planned path with measured step counts.  The path is the
+# preplanner's positions.gz, a series of little endian float x, y, z
+# vertices, with its meta JSON.  The counts are the step-test fixture's 10ms
+# output, as logged by plot_velocity.py, or from `bbemu --step-test <file>`.
+#
+# The fixture only reports while moving, so measured time excludes dwells and
+# pauses.  Each sample is matched to the nearest point on the path, searching
+# forward from the previous match, giving the contour error.  Lost steps are
+# the difference between the final counts and the path's end point.
+
+import sys, json, gzip, struct, argparse
+import numpy as np
+
+
+SAMPLE_SEC = 0.01
+MM_PER_STEP = 5 * 1.8 / 360 / 32
+AXES = 'xyz'
+
+
+def load_path(path, origin):
+  with gzip.open(path, 'rb') as f: data = f.read()
+
+  count = len(data) // 12
+  points = np.array(struct.unpack('<%df' % (count * 3), data[:count * 12]),
+                    dtype = float).reshape(count, 3)
+
+  # plan.py starts from the origin and writes each move's target
+  points = np.vstack([origin, points])
+
+  # Drop repeated vertices, written where the speed changes
+  keep = np.ones(len(points), dtype = bool)
+  keep[1:] = np.any(points[1:] != points[:-1], axis = 1)
+
+  return points[keep]
+
+
+def load_counts(path, motors, mm_per_step, origin):
+  f = sys.stdin if path == '-' else open(path, 'r')
+  rows = []
+
+  for line in f:
+    if 'RESET' in line:
+      rows = [] # Counts restart from zero
+      continue
+
+    try:
+      data = [int(float(x)) for x in line.strip().split(',')]
+    except ValueError: continue
+
+    if len(data) == 4: rows.append(data)
+
+  counts = np.array(rows, dtype = float).reshape(len(rows), 4)
+  steps = np.zeros((len(rows), 3))
+
+  for motor, axis in enumerate(motors):
+    if axis in AXES: steps[:, AXES.index(axis)] = counts[:, motor]
+
+  scale = np.array([mm_per_step[AXES.index(axis)] if axis in motors else 0
+                    for axis in AXES])
+
+  return steps, origin + steps * scale
+
+
+def nearest(points, lengths, p, start, reach):
+  '''Nearest point on the path to p, searching segments from start to reach
+  mm past it.  Returns the segment index and point.'''
+  end = np.searchsorted(lengths, lengths[start] + reach, 'right') + 1
+  end = min(max(end, start + 2), len(points))
+
+  a = points[start:end - 1]
+  b = points[start + 1:end]
+  ab = b - a
+  l2 = np.sum(ab * ab, axis = 1)
+  t = np.zeros(len(a))
+  moving = l2 != 0
+  t[moving] = np.clip(np.sum((p - a[moving]) * ab[moving], axis = 1) /
+                      l2[moving], 0, 1)
+
+  q = a + ab * t[:, None]
+  i = np.argmin(np.sum((q - p) ** 2, axis = 1))
+
+  return start + i, q[i]
+
+
+def compare(points, measured, window):
+  if len(points) < 2: points = np.vstack([points, points])
+
+  seg = np.linalg.norm(points[1:] - points[:-1], axis = 1)
+  lengths = np.concatenate([[0], np.cumsum(seg)])
+
+  errors = np.zeros(measured.shape)
+  index = 0
+  last = measured[0] if len(measured) else None
+
+  for i, p in enumerate(measured):
+    # Search as far as the machine moved since the last sample, plus margin
+    reach = np.linalg.norm(p - last) * 2 + window
+    index, q = nearest(points, lengths, p, index, reach)
+    errors[i] = p - q
+    last = p
+
+  return errors
+
+
+def percentiles(x):
+  if not len(x): return dict(p50 = 0, p90 = 0, p99 = 0, max = 0)
+
+  p = np.percentile(x, [50, 90, 99])
+  return dict(p50 = round(float(p[0]), 6), p90 = round(float(p[1]), 6),
+              p99 = round(float(p[2]), 6), max = round(float(np.max(x)), 6))
+
+
+def report(args, meta, points, steps, errors, mm_per_step):
+  contour = np.linalg.norm(errors, axis = 1)
+  moving = len(steps) * SAMPLE_SEC
+  result = dict(
+    samples = len(steps),
+    time = dict(planned = meta.get('time', 0), measured = round(moving, 3)),
+    max_deviation = round(float(np.max(contour, initial = 0)), 6),
+    deviation = percentiles(contour),
+    axes = {})
+
+  for i, axis in enumerate(AXES):
+    if axis not in args.motors: continue
+
+    # Steps at the end of the path relative to the origin
+    planned = round((points[-1][i] - args.origin[i]) / mm_per_step[i])
+    actual = int(steps[-1][i]) if len(steps) else 0
+
+    result['axes'][axis] = dict(
+      error = percentiles(np.abs(errors[:, i])),
+      planned_steps = planned,
+      measured_steps = actual,
+      lost_steps = planned - actual)
+
+  lost = max([abs(a['lost_steps']) for a in result['axes'].values()] + [0])
+  result['pass'] = (lost <= args.max_lost_steps and
+                    result['max_deviation'] <= args.max_deviation)
+
+  return result
+
+
+def plot(errors, output):
+  import matplotlib
+  if output: matplotlib.use('Agg')
+  import matplotlib.pyplot as plt
+
+  contour = np.linalg.norm(errors, axis = 1)
+  seconds = np.arange(len(errors)) * SAMPLE_SEC
+
+  fig, axes = plt.subplots(2)
+
+  for i, axis in enumerate(AXES):
+    axes[0].plot(seconds, errors[:, i], label = axis.upper())
+  axes[0].plot(seconds, contour, label = 'Contour')
+  axes[0].set_xlabel('Moving time (sec)')
+  axes[0].set_ylabel('Error (mm)')
+  axes[0].legend()
+
+  axes[1].hist(contour, bins = 100)
+  axes[1].set_xlabel('Contour error (mm)')
+  axes[1].set_ylabel('Samples')
+
+  if output: plt.savefig(output)
+  else: plt.show()
+
+
+if __name__ == '__main__':
+  # Parse command line arguments
+  description = 'Compare a planned path with step-test counts'
+  parser = argparse.ArgumentParser(description = description)
+  parser.add_argument('positions', help = 'Preplanner positions.gz')
+  parser.add_argument('meta', help = 'Preplanner meta JSON')
+  parser.add_argument('counts', help = 'Step counts or - for stdin')
+  parser.add_argument('-s', '--mm-per-step', default = [MM_PER_STEP],
+                      type = float, nargs = '+',
+                      help = 'mm per step for each of X, Y and Z')
+  parser.add_argument('-m', '--motors', default = 'xyz',
+                      help = 'Axis for each fixture channel, - for none')
+  parser.add_argument('--origin', default = [0, 0, 0], type = float,
+                      nargs = 3, help = 'Machine position at the reset')
+  parser.add_argument('-w', '--window', default = 1, type = float,
+                      help = 'Extra path length, in mm, searched per sample')
+  parser.add_argument('--max-deviation', default = 0.01, type = float,
+                      help = 'Contour error allowed to pass, in mm')
+  parser.add_argument('--max-lost-steps', default = 0, type = int,
+                      help = 'Lost steps allowed to pass')
+  parser.add_argument('-o', '--output', help = 'Write JSON results to file')
+  parser.add_argument('-p', '--plot', nargs = '?', const = '',
+                      help = 'Plot errors, to a file if given')
+  args = parser.parse_args()
+
+  mm_per_step = args.mm_per_step
+  mm_per_step += [mm_per_step[-1]] * 2
+  args.origin = np.array(args.origin)
+
+  with open(args.meta, 'r') as f: meta = json.load(f)
+  points = load_path(args.positions, args.origin)
+  steps, measured = load_counts(args.counts, args.motors, mm_per_step,
+                                args.origin)
+  errors = compare(points, measured, args.window)
+  result = report(args, meta, points, steps, errors, mm_per_step)
+
+  if args.output:
+    with open(args.output, 'w') as f: json.dump(result, f, indent = 2)
+  else: print(json.dumps(result, indent = 2))
+
+  if args.plot is not None: plot(errors, args.plot)
+
+  sys.exit(0 if result['pass'] else 1)
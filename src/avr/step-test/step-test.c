@@ -39,6 +39,25 @@
 #define RESET_PIN SPI_MOSI_PIN
 
 
+#ifdef STEP_CAPTURE
+// Edge capture mode, see capture_init()
+#define CAPTURE_BAUD     USART_BAUD_1000000
+#define CAPTURE_NEGATIVE 0x04 // Direction pin high
+#define CAPTURE_OVERFLOW 0x40 // Timestamp timer wrapped
+#define CAPTURE_DROPPED  0x80 // Ticks is the number of edges lost
+
+#define RING_BUF_NAME capture_buf
+#define RING_BUF_TYPE uint32_t
+#define RING_BUF_INDEX_TYPE volatile uint16_t
+#define RING_BUF_SIZE 1024
+#define RING_BUF_ATOMIC_COPY 1
+#include "ringbuf.def"
+
+static volatile uint8_t capture_epoch = 0;
+static volatile uint16_t capture_dropped = 0;
+#endif // STEP_CAPTURE
+
+
 void rtc_init() {}
 
 
@@ -150,6 +169,76 @@ ISR(TCC1_OVF_vect) {
 }
 
 
+#ifdef STEP_CAPTURE
+static void _capture_push(uint8_t flags, uint8_t epoch, uint16_t ticks) {
+  if (capture_buf_full()) capture_dropped++;
+  else capture_buf_push((uint32_t)ticks << 16 | (uint16_t)epoch << 8 | flags);
+}
+
+
+static void _capture(int i, uint16_t ticks) {
+  // The overflow ISR may not have run yet for a capture just after the wrap.
+  // TCD1 is started first so it wraps no later than TCE1.
+  uint8_t epoch = capture_epoch;
+  if ((TCD1.INTFLAGS & TC1_OVFIF_bm) && ticks < 0x8000) epoch++;
+
+  uint8_t flags = i | (IN_PIN(channel[i].dir_pin) ? CAPTURE_NEGATIVE : 0);
+  _capture_push(flags, epoch, ticks);
+}
+
+
+ISR(TCD1_CCA_vect) {_capture(0, TCD1.CCA);}
+ISR(TCD1_CCB_vect) {_capture(1, TCD1.CCB);}
+ISR(TCE1_CCA_vect) {_capture(2, TCE1.CCA);}
+ISR(TCE1_CCB_vect) {_capture(3, TCE1.CCB);}
+
+
+ISR(TCD1_OVF_vect) {
+  // Marks each wrap so the host can extend timestamps across long gaps
+  _capture_push(CAPTURE_OVERFLOW, ++capture_epoch, 0);
+}
+
+
+static void capture_init() {
+  // TCD1 and TCE1 count CPU clocks / 8, 0.25us per tick, and capture the
+  // count on step events 0 & 1 and 2 & 3 respectively
+  TCD1.CTRLB = TC1_CCAEN_bm | TC1_CCBEN_bm;
+  TCE1.CTRLB = TC1_CCAEN_bm | TC1_CCBEN_bm;
+  TCD1.CTRLD = TC_EVACT_CAPT_gc | TC_EVSEL_CH0_gc;
+  TCE1.CTRLD = TC_EVACT_CAPT_gc | TC_EVSEL_CH2_gc;
+  TCD1.INTCTRLA = TC_OVFINTLVL_HI_gc;
+  TCD1.INTCTRLB = TC_CCAINTLVL_HI_gc | TC_CCBINTLVL_HI_gc;
+  TCE1.INTCTRLB = TC_CCAINTLVL_HI_gc | TC_CCBINTLVL_HI_gc;
+  TCD1.CTRLA = TC_CLKSEL_DIV8_gc;
+  TCE1.CTRLA = TC_CLKSEL_DIV8_gc;
+
+  // Binary records follow the header, each four bytes: channel and flags,
+  // the timestamp's high byte, then the 16-bit timestamp, little endian
+  usart_set_baud(&SERIAL_PORT, CAPTURE_BAUD);
+  printf("CAPTURE\n");
+}
+
+
+static void capture_flush() {
+  // Capture ISRs may fill the buffer or drop more edges at any time
+  if (capture_dropped)
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (!capture_buf_full()) {
+        _capture_push(CAPTURE_DROPPED, capture_epoch, capture_dropped);
+        capture_dropped = 0;
+      }
+    }
+
+  while (!capture_buf_empty()) {
+    uint32_t record = capture_buf_peek();
+    capture_buf_pop();
+
+    for (int i = 0; i < 4; i++) usart_putc(record >> (8 * i));
+  }
+}
+#endif // STEP_CAPTURE
+
+
 static void _splash(uint8_t addr) {
   lcd_init(addr);
   lcd_goto(addr, 5, 1);
@@ -201,7 +290,9 @@ static void init() {
   PIN_PORT(MOTOR_ENABLE_PIN)->INT0MASK |= PIN_BM(MOTOR_ENABLE_PIN);
 
   // Configure report clock
+#ifndef STEP_CAPTURE
   TCC1.INTCTRLA = TC_OVFINTLVL_LO_gc;
+#endif
   TCC1.PER = F_CPU / 256 * 0.01; // 10ms
   TCC1.CTRLA = TC_CLKSEL_DIV256_gc;
 
@@ -212,7 +303,11 @@ static void init() {
   PIN_PORT(RESET_PIN)->INTCTRL  |= PORT_INT0LVL_LO_gc;
   PIN_PORT(RESET_PIN)->INT0MASK |= PIN_BM(RESET_PIN);
 
+#ifdef STEP_CAPTURE
+  capture_init();
+#else
   printf("RESET\n");
+#endif
 
   sei();
 }
@@ -224,7 +319,11 @@ int main() {
   _splash(0x27);
   _splash(0x3f);
 
+#ifdef STEP_CAPTURE
+  while (true) capture_flush();
+#else
   while (true) continue;
+#endif
 
   return 0;
 }
@@ -31,10 +31,14 @@ import traceback
 import signal
 
 from . import Cmd
+from .BBEmu import BBEmu
 
 __all__ = ['AVREmu']
 
 
+LIB_TICK_MS = 10
+
+
 class AVREmu(object):
     def __init__(self, ctrl):
         self.ctrl = ctrl
@@ -47,6 +51,11 @@ class AVREmu(object):
         self.write_cb = None
         self.pid      = None
 
+        # In process emulator
+        self.emu      = None
+        self.timeout  = None
+        self.i2cQueue = []
+
 
     def close(self):
         # Close pipes
@@ -65,6 +74,15 @@ class AVREmu(object):
 
         self.avrOut, self.avrIn, self.i2cOut = None, None, None
 
+        # Stop in process emulator
+        if self.timeout is not None:
+            self.ctrl.ioloop.remove_timeout(self.timeout)
+            self.timeout = None
+
+        if self.emu is not None:
+            self.emu.close()
+            self.emu = None
+
         # Kill process and wait for it
         if self.pid is not None:
             os.kill(self.pid, signal.SIGKILL)
@@ -75,7 +93,61 @@ class AVREmu(object):
     def flush_output(self): pass
 
 
+    def _start_lib(self):
+        try:
+            self.close()
+            self.emu = BBEmu()
+            self.i2cQueue = []
+            self.write_enabled = True
+            self._lib_tick()
+
+        except Exception:
+            self.close()
+            self.log.exception('Failed to start libbbemu')
+
+
+    def _lib_write(self, data):
+        length = self.emu.write_serial(data)
+        self.continue_write = length and length == len(data)
+        return length
+
+
+    def _lib_tick(self):
+        self.timeout = None
+        emu = self.emu
+
+        try:
+            # Queue serial input
+            while self.write_enabled:
+                self.continue_write = False
+                self.write_cb(self._lib_write)
+                if not self.continue_write: break
+
+            # Deliver next I2C message
+            if self.i2cQueue and emu.i2c_write(self.i2cQueue[0]):
+                self.i2cQueue.pop(0)
+
+            # Advance simulated time
+            ms = LIB_TICK_MS * (10 if self.ctrl.args.fast_emu else 1)
+            reset = not emu.step(ms)
+
+            data = emu.read_serial()
+            if data: self.read_cb(data)
+
+            if reset:
+                emu.restart()
+                self.i2cQueue = []
+
+        except Exception:
+            self.log.warning('AVR emulator error: %s', traceback.format_exc())
+
+        self.timeout = self.ctrl.ioloop.call_later(
+            LIB_TICK_MS / 1000, self._lib_tick)
+
+
     def _start(self):
+        if self.ctrl.args.emu_lib: return self._start_lib()
+
         try:
             self.close()
 
@@ -145,6 +217,7 @@ class AVREmu(object):
 
 
     def enable_write(self, enable):
+        if self.emu is not None: self.write_enabled = enable
         if self.avrOut is None: return
 
         flags = self.ctrl.ioloop.WRITE if enable else 0
@@ -204,6 +277,10 @@ class AVREmu(object):
         elif block is not None: data = block
         else: data = ''
 
+        if self.emu is not None:
+            self.i2cQueue.append(bytes(cmd + data, 'utf-8'))
+            return
+
         try:
             if self.i2cOut is not None:
                 os.write(self.i2cOut, bytes(cmd + data + '\n', 'utf-8'))
@@ -0,0 +1,130 @@
+################################################################################
+#                                                                              #
+#                 This file is part of the Buildbotics firmware.               #
+#                                                                              #
+#        Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.      #
+#                                                                              #
+#         This Source describes Open Hardware and is licensed under the        #
+#                                 CERN-OHL-S v2.                               #
+#                                                                              #
+#         You may redistribute and modify this Source and make products        #
+#    using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).  #
+#           This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED          #
+#    WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS  #
+#     FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable    #
+#                                  conditions.                                 #
+#                                                                              #
+#                Source location: https://github.com/buildbotics               #
+#                                                                              #
+#      As per CERN-OHL-S v2 section 4, should You produce hardware based on    #
+#    these sources, You must maintain the Source Location clearly visible on   #
+#    the external case of the CNC Controller or other product you make using   #
+#                                  this Source.                                #
+#                                                                              #
+#                For more information, email info@buildbotics.com              #
+#                                                                              #
+################################################################################
+
+import os
+import shutil
+import tempfile
+import ctypes
+import ctypes.util
+
+__all__ = ['BBEmu']
+
+
+def find_library():
+    path = os.environ.get('BBEMU_LIB')
+    if path: return path
+
+    path = ctypes.util.find_library('bbemu')
+    if path: return path
+
+    for path in ('/usr/local/lib/libbbemu.so',
+                 os.path.join(os.path.dirname(__file__),
+                              '../../avr/emu/libbbemu.so')):
+        if os.path.exists(path): return path
+
+
+class BBEmu(object):
+    '''In process AVR emulator backed by libbbemu.so.
+
+    Firmware state lives in library globals so each instance loads a private
+    copy of the library.  Simulated time only advances in step().
+    '''
+
+    def __init__(self, args = [], path = None):
+        self.path = path or find_library()
+        if self.path is None: raise Exception('libbbemu.so not found')
+
+        self.args = ['bbemu'] + list(args)
+        self.lib = None
+        self._load()
+
+
+    def _load(self):
+        # Load a private copy, the mapping outlives the file
+        fd, tmp = tempfile.mkstemp(prefix = 'bbemu-', suffix = '.so')
+        try:
+            with os.fdopen(fd, 'wb') as f, open(self.path, 'rb') as src:
+                shutil.copyfileobj(src, f)
+            lib = ctypes.CDLL(tmp)
+
+        finally: os.unlink(tmp)
+
+        buf = ctypes.c_char_p
+        lib.bbemu_init.argtypes = [ctypes.c_int, ctypes.POINTER(buf)]
+        lib.bbemu_step.argtypes = [ctypes.c_uint]
+        lib.bbemu_write_serial.argtypes = [buf, ctypes.c_uint]
+        lib.bbemu_read_serial.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+        lib.bbemu_i2c_write.argtypes = [buf, ctypes.c_uint]
+        lib.bbemu_free.restype = None
+
+        self.lib = lib
+        self.running = True
+
+        # Keep argv alive with the library
+        self.argv = (buf * (len(self.args) + 1))(
+            *[arg.encode('utf-8') for arg in self.args])
+        self._check(lib.bbemu_init(len(self.args), self.argv))
+
+
+    def _check(self, ret):
+        if ret < 0: self.running = False
+        return ret
+
+
+    def close(self):
+        if self.lib is None: return
+
+        self.lib.bbemu_free()
+        import _ctypes
+        _ctypes.dlclose(self.lib._handle)
+        self.lib = None
+
+
+    def restart(self):
+        self.close()
+        self._load()
+
+
+    def step(self, ms = 1):
+        '''Advance simulated time.  Returns False once the firmware resets.'''
+        return 0 <= self._check(self.lib.bbemu_step(ms))
+
+
+    def write_serial(self, data):
+        '''Queue serial input.  Returns the number of bytes accepted.'''
+        return max(0, self._check(self.lib.bbemu_write_serial(data, len(data))))
+
+
+    def read_serial(self, size = 4096):
+        buf = ctypes.create_string_buffer(size)
+        length = self.lib.bbemu_read_serial(buf, size)
+        return buf.raw[:length]
+
+
+    def i2c_write(self, data):
+        '''Returns False if the previous I2C message is still pending.'''
+        return 0 < self._check(self.lib.bbemu_i2c_write(data, len(data)))
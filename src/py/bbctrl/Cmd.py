@@ -27,16 +27,23 @@
 #                                                                              #
 ################################################################################
 
+import struct
+import base64
+import binascii
+
 
 # Keep this in sync with AVR code command.def
 SET          = '$'
 SET_SYNC     = '#'
+BULK         = 'B'
 MODBUS_READ  = 'm'
 MODBUS_WRITE = 'M'
 SEEK         = 's'
 SET_AXIS     = 'a'
 LINE         = 'l'
 SYNC_SPEED   = '%'
+SYNC_SPEEDS  = 'w'
+RASTER       = 'W'
 SPEED        = 'p'
 INPUT        = 'I'
 DWELL        = 'd'
@@ -52,23 +59,102 @@ SHUTDOWN     = 'X'
 CLEAR        = 'C'
 FLUSH        = 'F'
 DUMP         = 'D'
+UNDERRUNS    = 'u'
 HELP         = 'h'
 
+_LINE_BYTES = LINE.encode('utf-8')
+_SYNC_SPEED_BYTES = SYNC_SPEED.encode('utf-8')
+_AXIS_BYTES = {axis: axis.encode('utf-8') for axis in 'xyzabc'}
+_TIME_BYTES = [str(i).encode('utf-8') for i in range(7)]
+
+# Bytes of base64 data a command line holds, see INPUT_DATA_MAX in config.h
+INPUT_BUFFER_LEN = 128
+INPUT_DATA_MAX = (INPUT_BUFFER_LEN - 2) // 4 * 3
+
+BULK_DATA_MAX = INPUT_DATA_MAX # Bytes per bulk command
+
+SYNC_SPEEDS_POWER_8BIT = 1 << 0
+SYNC_SPEEDS_DATA_MAX = INPUT_DATA_MAX - 9 # Bytes of speeds
+RASTER_MAX = INPUT_DATA_MAX - 12 # Powers per raster command, see spindle.h
+
 SEEK_ACTIVE = 1 << 0
 SEEK_ERROR  = 1 << 1
 
 
-def encode_float(x):
-    import struct
-    import base64
+class Encoder(object):
+    '''
+    Encodes floats as six base64 characters without padding.  A float padded
+    with two zero bytes encodes to exactly its six characters plus "AA", so all
+    the floats of a command are packed and base64 encoded with one call each
+    to precompiled struct formats and binascii.
+    '''
 
-    return base64.b64encode(struct.pack('<f', x))[:-2].decode('utf-8')
+    def __init__(self): self.formats = {}
 
 
-def decode_float(s):
-    import struct
-    import base64
+    def _get_formats(self, count):
+        formats = self.formats.get(count)
+
+        if formats is None:
+            formats = self.formats[count] = (
+                struct.Struct('<' + 'f2x' * count),
+                struct.Struct('6s2x' * count))
+
+        return formats
+
+
+    def floats(self, values):
+        '''Returns a tuple of encoded floats as bytes.'''
+        pack, split = self._get_formats(len(values))
+        return split.unpack(binascii.b2a_base64(pack.pack(*values),
+                                                newline = False))
+
+
+    def float(self, value): return self.floats((value,))[0]
+
+
+    def line(self, target, exitVel, maxAccel, maxJerk, times, speeds,
+             scale = None):
+        names = [_LINE_BYTES, b'', b'']
+        values = [exitVel, maxAccel, maxJerk]
+
+        for axis in 'xyzabc':
+            if axis in target: value = target[axis]
+            elif axis.upper() in target: value = target[axis.upper()]
+            else: continue
+
+            names.append(_AXIS_BYTES[axis])
+            values.append(value)
+
+        # S-Curve time parameters
+        for i in range(7):
+            if times[i]:
+                names.append(_TIME_BYTES[i])
+                values.append(times[i] / 60000) # to mins
+
+        cmd = b''.join(map(bytes.__add__, names, self.floats(values)))
 
+        # Speeds
+        if 2 < len(speeds):
+            if get_raster_pitch(speeds, scale):
+                cmd += b'\n' + raster(speeds, scale).encode('utf-8')
+            else: cmd += b'\n' + sync_speeds(speeds, scale).encode('utf-8')
+
+        else:
+            for dist, speed in speeds:
+                cmd += b'\n' + _SYNC_SPEED_BYTES + b''.join(
+                    self.floats((dist, speed)))
+
+        return cmd
+
+
+encoder = Encoder()
+
+
+def encode_float(x): return encoder.float(x).decode('utf-8')
+
+
+def decode_float(s):
     return struct.unpack('<f', base64.b64decode(s + '=='))[0]
 
 
@@ -98,36 +184,148 @@ def set_float(name, value):
     return SET_SYNC + '%s=:%s' % (name, encode_float(value))
 
 
+def crc16(data):
+    crc = 0xffff
+
+    for b in data:
+        crc ^= b
+        for i in range(8):
+            if crc & 1: crc = (crc >> 1) ^ 0xa001
+            else: crc >>= 1
+
+    return crc
+
+
+def _bulk_var(code, index, type, value):
+    data = struct.pack('<Bb', code, index)
+
+    if type == 'f32': return data + struct.pack('<f', value)
+    if type in ('s32', 'u32'):
+        return data + struct.pack('<I', int(value) & 0xffffffff)
+    if type == 'u16': return data + struct.pack('<H', int(value) & 0xffff)
+    return data + struct.pack('<B', int(value) & 0xff)
+
+
+def _bulk(vars):
+    data = struct.pack('<B', len(vars)) + b''.join(vars)
+    data += struct.pack('<H', crc16(data))
+
+    return BULK + base64.b64encode(data).decode('utf-8').rstrip('=')
+
+
+def bulk(vars):
+    # vars is a list of (code, index, type, value), code is the AVR var order
+    cmds = []
+    packed = []
+    size = 3 # Count and CRC
+
+    for var in vars:
+        data = _bulk_var(*var)
+
+        if BULK_DATA_MAX < size + len(data):
+            cmds.append(_bulk(packed))
+            packed = []
+            size = 3
+
+        packed.append(data)
+        size += len(data)
+
+    if len(packed): cmds.append(_bulk(packed))
+
+    return cmds
+
+
 def modbus_read(addr): return MODBUS_READ + '%d' % addr
 def modbus_write(addr, value): return MODBUS_WRITE + '%d=%d' % (addr, value)
 def set_axis(axis, position): return SET_AXIS + axis + encode_float(position)
 
 
-def line(target, exitVel, maxAccel, maxJerk, times, speeds):
-    cmd = LINE
+def line(target, exitVel, maxAccel, maxJerk, times, speeds, scale = None):
+    return encoder.line(target, exitVel, maxAccel, maxJerk, times, speeds,
+                        scale).decode('utf-8')
+
+
+def speed(value): return SPEED + encode_float(value)
+
+
+def sync_speed(dist, speed):
+    return SYNC_SPEED + encode_float(dist) + encode_float(speed)
+
+
+def _sync_speeds(flags, offset, scale, entries):
+    data = struct.pack('<Bff', flags, offset, scale) + b''.join(entries)
+    return SYNC_SPEEDS + base64.b64encode(data).decode('utf-8').rstrip('=')
 
-    cmd += encode_float(exitVel)
-    cmd += encode_float(maxAccel)
-    cmd += encode_float(maxJerk)
-    cmd += encode_axes(target)
 
-    # S-Curve time parameters
-    for i in range(7):
-        if times[i]:
-            cmd += str(i) + encode_float(times[i] / 60000) # to mins
+def sync_speeds(speeds, scale = None):
+    # Quantize to 8-bit power of scale if all speeds are in range
+    quantize = scale is not None and 0 < scale and \
+        all(0 <= speed <= scale for dist, speed in speeds)
+    flags = SYNC_SPEEDS_POWER_8BIT if quantize else 0
+    if not quantize: scale = 0
+
+    def encode(delta, speed):
+        if quantize:
+            return struct.pack('<HB', delta, round(speed * 255 / scale))
+        return struct.pack('<Hf', delta, speed)
+
+    # Distances are encoded as micrometer deltas from the previous entry
+    entries = []
+    last = None
 
-    # Speeds
     for dist, speed in speeds:
-        cmd += '\n' + sync_speed(dist, speed)
+        um = round(dist * 1000)
+        if last is None: offset = last = um
+        um = max(um, last) # Distances must not decrease
 
-    return cmd
+        # Split deltas too long for 16-bits
+        while 0xffff < um - last:
+            entries.append((0xffff, entries[-1][1]))
+            last += 0xffff
 
+        entries.append((um - last, speed))
+        last = um
 
-def speed(value): return SPEED + encode_float(value)
+    # Split in to commands
+    count = SYNC_SPEEDS_DATA_MAX // (3 if quantize else 6)
+    cmds = []
 
+    for i in range(0, len(entries), count):
+        chunk = entries[i:i + count]
+        data = [encode(delta, speed) for delta, speed in chunk]
+        cmds.append(_sync_speeds(flags, offset / 1000, scale, data))
+        offset += sum(delta for delta, speed in chunk)
 
-def sync_speed(dist, speed):
-    return SYNC_SPEED + encode_float(dist) + encode_float(speed)
+    return '\n'.join(cmds)
+
+
+def get_raster_pitch(speeds, scale):
+    # Returns pixel pitch if speeds are evenly spaced 8-bit powers of scale
+    if not scale or len(speeds) < 2: return
+    if not all(0 <= speed <= scale for dist, speed in speeds): return
+
+    start = speeds[0][0]
+    pitch = (speeds[-1][0] - start) / (len(speeds) - 1)
+    if pitch <= 0: return
+
+    for i, (dist, speed) in enumerate(speeds):
+        if 5e-4 < abs(start + i * pitch - dist): return
+
+    return pitch
+
+
+def raster(speeds, scale):
+    pitch = get_raster_pitch(speeds, scale)
+    cmds = []
+
+    for i in range(0, len(speeds), RASTER_MAX):
+        offset = speeds[0][0] + i * pitch
+        data = struct.pack('<fff', offset, pitch, scale)
+        data += bytes(round(speed * 255 / scale)
+                      for dist, speed in speeds[i:i + RASTER_MAX])
+        cmds.append(RASTER + base64.b64encode(data).decode('utf-8').rstrip('='))
+
+    return '\n'.join(cmds)
 
 
 def _get_input_type_index(port):
@@ -219,6 +417,12 @@ def decode_command(cmd):
         elif value.find('.') == -1: data['value'] = int(value)
         else: data['value'] = float(value)
 
+    elif cmd[0] == BULK:
+        data['type'] = 'bulk'
+        raw = base64.b64decode(cmd[1:] + '=' * (-len(cmd[1:]) % 4))
+        data['count'] = raw[0]
+        data['crc'] = struct.unpack('<H', raw[-2:])[0] == crc16(raw[:-2])
+
     elif cmd[0] == JOG:
         data['type'] = 'jog'
 
@@ -263,6 +467,30 @@ def decode_command(cmd):
         data['offset'] = decode_float(cmd[1:7])
         data['speed']  = decode_float(cmd[7:13])
 
+    elif cmd[0] == SYNC_SPEEDS:
+        raw = base64.b64decode(cmd[1:] + '=' * (-len(cmd[1:]) % 4))
+        flags, offset, scale = struct.unpack('<Bff', raw[:9])
+        quantized = flags & SYNC_SPEEDS_POWER_8BIT
+        fmt = '<HB' if quantized else '<Hf'
+        size = struct.calcsize(fmt)
+
+        data['type'] = 'speeds'
+        data['speeds'] = []
+
+        for i in range(9, len(raw), size):
+            delta, speed = struct.unpack(fmt, raw[i:i + size])
+            offset += delta / 1000
+            if quantized: speed *= scale / 255
+            data['speeds'].append((offset, speed))
+
+    elif cmd[0] == RASTER:
+        raw = base64.b64decode(cmd[1:] + '=' * (-len(cmd[1:]) % 4))
+        offset, pitch, scale = struct.unpack('<fff', raw[:12])
+
+        data['type'] = 'speeds'
+        data['speeds'] = [(offset + i * pitch, power * scale / 255)
+                          for i, power in enumerate(raw[12:])]
+
     elif cmd[0] == REPORT:   data['type'] = 'report'
     elif cmd[0] == PAUSE:    data['type'] = 'pause'
     elif cmd[0] == UNPAUSE:  data['type'] = 'unpause'
@@ -51,6 +51,14 @@ DRV8711_COMM_ERROR_bm    = 1 << 8
 # Ignoring stall and stall latch flags for now
 DRV8711_MASK = ~(DRV8711_STATUS_STD_bm | DRV8711_STATUS_STDLAT_bm)
 
+# Messages with these keys are more than variable reports
+SPECIAL_KEYS = frozenset(
+    ('variables', 'msg', 'underruns', 'firmware', 'result'))
+
+# Reports with these keys are state transitions, which are not coalesced
+TRANSITION_KEYS = frozenset(
+    ('xx', 'xc', 'pr') + tuple('%ddf' % motor for motor in range(4)))
+
 
 def _driver_flags_to_string(flags):
     if DRV8711_STATUS_OTS_bm    & flags: yield 'over temp'
@@ -68,16 +76,32 @@ def driver_flags_to_string(flags):
     return ', '.join(_driver_flags_to_string(flags))
 
 
+def _log_command(cmd):
+    if isinstance(cmd, bytes): cmd = cmd.decode('utf-8')
+    return '< ' + json.dumps(cmd).strip('"')
+
+
+def _log_reports(lines):
+    return '> ' + b'\n> '.join(lines).decode('utf-8', 'replace')
+
+
 class Comm(ABC):
     def __init__(self, ctrl, avr):
         self.ctrl = ctrl
         self.avr = avr
         self.log = self.ctrl.log.get('Comm')
         self.queue = deque()
-        self.in_buf = ''
+        self.in_buf = bytearray()
+        self.reports = {}       # Variable reports not yet applied
+        self.report_lines = []
+        self.reports_pending = False
         self.command = None
         self.last_motor_flags = [0] * 4
         self.estopped = False
+        self.write_idle_start = None
+        self.underrun = None
+        self.connect_time = None
+        self.reloading = False
 
         avr.set_handlers(self._read, self._write)
         self._poll_cb(False)
@@ -116,8 +140,10 @@ class Comm(ABC):
 
 
     def _prep_command(self, cmd):
-        self.log.info('< ' + json.dumps(cmd).strip('"'))
-        return bytes(cmd.strip() + '\n', 'utf-8')
+        # Planner commands arrive as bytes
+        self.log.trace(_log_command, cmd)
+        if isinstance(cmd, str): cmd = cmd.encode('utf-8')
+        return cmd.strip() + b'\n'
 
 
     def resume(self): self.queue_command(Cmd.RESUME)
@@ -151,13 +177,25 @@ class Comm(ABC):
         # Load next command from queue
         if len(self.queue):
             self.command = self._prep_command(self.queue.popleft())
+            self.write_idle_start = None
 
         # Load next command from callback
         else:
+            if self.reloading:
+                self.reloading = False
+                self.log.info('AVR configured in %.3fs' % (
+                    time.time() - self.connect_time))
+
             cmd = self.comm_next() # pylint: disable=assignment-from-no-return
 
-            if cmd is None: self.avr.enable_write(False) # Stop writing
-            else: self.command = self._prep_command(cmd)
+            if cmd is None:
+                self.avr.enable_write(False) # Stop writing
+                if self.write_idle_start is None:
+                    self.write_idle_start = time.time()
+
+            else:
+                self.command = self._prep_command(cmd)
+                self.write_idle_start = None
 
 
     def _update_vars(self, msg):
@@ -171,6 +209,8 @@ class Comm(ABC):
                 position = self.ctrl.state.get(axis + 'p', 0)
                 self.queue_command(Cmd.set_axis(axis, position))
 
+            self.reloading = True
+
         except Exception as e:
             self.log.warning('AVR reload failed: %s', traceback.format_exc())
             self.ctrl.ioloop.call_later(1, self.connect)
@@ -207,9 +247,38 @@ class Comm(ABC):
                 self.log.info('Motor %d flags: %s' % (motor, flags))
 
 
+    def _log_underrun(self, count):
+        last, self.underrun = self.underrun, count
+        if last is None or count <= last: return
+
+        # How long the host has had nothing to send
+        idle = 0
+        if self.write_idle_start is not None:
+            idle = time.time() - self.write_idle_start
+
+        state = self.ctrl.state
+        self.log.info('Underrun %d: empty=%d held=%d late=%d, host writes '
+                      'disabled for %.3fs' % (
+                          count, state.get('ue', 0), state.get('uh', 0),
+                          state.get('ul', 0), idle))
+
+        self.queue_command(Cmd.UNDERRUNS) # Request recent underrun events
+
+
+    def _log_underruns(self, events):
+        for e in events:
+            self.log.info('Underrun at %dms: %s, queue depth %d, id %d' % (
+                e['t'], e['cause'], e['depth'], e['id']))
+
+
     def _update_state(self, update):
         self.ctrl.state.update(update)
 
+        # Let listeners see each transition, not just the last one
+        if not TRANSITION_KEYS.isdisjoint(update): self.ctrl.state.notify()
+
+        if 'un' in update: self._log_underrun(update['un'])
+
         if 'xx' in update:        # State change
             self.ctrl.ready()     # We've received data from AVR
             self.flush()          # May have more data to send now
@@ -217,40 +286,76 @@ class Comm(ABC):
         self._log_motor_flags(update)
 
 
-    def _read(self, data):
-        self.in_buf += data.decode('utf-8')
+    def _flush_reports(self):
+        self.reports_pending = False
+        if not self.report_lines: return
+
+        # One log record for all the lines, logged as if separately
+        self.log.trace(_log_reports, tuple(self.report_lines))
+        self.report_lines.clear()
 
-        # Parse incoming serial data into lines
-        while True:
-            i = self.in_buf.find('\n')
-            if i == -1: break
-            line = self.in_buf[0:i].strip()
-            self.in_buf = self.in_buf[i + 1:]
+        self._update_state(self.reports)
+        self.reports.clear()
 
-            if line:
-                try:
-                    msg = json.loads(line)
 
-                except Exception as e:
-                    self.log.warning('%s, data: %s', e, line)
-                    continue
+    def _read_line(self, line):
+        try:
+            msg = json.loads(line)
+
+        except Exception as e:
+            self.log.warning('%s, data: %s', e,
+                             line.decode('utf-8', 'replace'))
+            return
 
-                if self.estopped:
-                    if not 'firmware' in msg: continue
-                    self.estopped = False
+        if self.estopped:
+            if not 'firmware' in msg: return
+            self.estopped = False
 
-                self.log.info('> ' + line)
+        # Coalesce variable reports until the next IOLoop callback
+        if type(msg) is dict and SPECIAL_KEYS.isdisjoint(msg):
+            # Keep transitions apart so none is overwritten
+            if not TRANSITION_KEYS.isdisjoint(msg): self._flush_reports()
 
-                if 'variables' in msg: self._update_vars(msg)
-                elif 'msg' in msg: self._log_msg(msg)
+            self.reports.update(msg)
+            self.report_lines.append(line)
 
-                elif 'firmware' in msg:
-                    self.log.info('AVR firmware rebooted')
-                    self.connect()
+            if not self.reports_pending:
+                self.reports_pending = True
+                self.ctrl.ioloop.add_callback(self._flush_reports)
 
-                else:
-                    if 'result' in msg: self.comm_result(msg['result'])
-                    self._update_state(msg)
+            return
+
+        # Apply earlier reports first
+        self._flush_reports()
+
+        self.log.trace(_log_reports, (line,))
+
+        if 'variables' in msg: self._update_vars(msg)
+        elif 'msg' in msg: self._log_msg(msg)
+        elif 'underruns' in msg: self._log_underruns(msg['underruns'])
+
+        elif 'firmware' in msg:
+            self.log.info('AVR firmware rebooted')
+            self.underrun = None
+            self.connect()
+
+        else:
+            if 'result' in msg: self.comm_result(msg['result'])
+            self._update_state(msg)
+
+
+    def _read(self, data):
+        # Take all complete lines before handling any
+        self.in_buf += data
+        end = self.in_buf.rfind(b'\n') + 1
+        if not end: return
+
+        lines = self.in_buf[:end].split(b'\n')
+        del self.in_buf[:end]
+
+        for line in lines:
+            line = line.strip()
+            if line: self._read_line(line)
 
 
     def enter_estop(self): self.estopped = True
@@ -277,6 +382,8 @@ class Comm(ABC):
 
 
     def connect(self):
+        self.connect_time = time.time()
+
         try:
             # Resume once current queue of GCode commands has flushed
             self.queue_command(Cmd.RESUME)
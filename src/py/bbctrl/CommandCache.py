@@ -0,0 +1,294 @@
+################################################################################
+#                                                                              #
+#                 This file is part of the Buildbotics firmware.               #
+#                                                                              #
+#        Copyright (c) 2015 - 2023, Buildbotics LLC, All rights reserved.      #
+#                                                                              #
+#         This Source describes Open Hardware and is licensed under the        #
+#                                 CERN-OHL-S v2.                               #
+#                                                                              #
+#         You may redistribute and modify this Source and make products        #
+#    using it under the terms of the CERN-OHL-S v2 (https:/cern.ch/cern-ohl).  #
+#           This Source is distributed WITHOUT ANY EXPRESS OR IMPLIED          #
+#    WARRANTY, INCLUDING OF MERCHANTABILITY, SATISFACTORY QUALITY AND FITNESS  #
+#     FOR A PARTICULAR PURPOSE. Please see the CERN-OHL-S v2 for applicable    #
+#                                  conditions.                                 #
+#                                                                              #
+#                Source location: https://github.com/buildbotics               #
+#                                                                              #
+#      As per CERN-OHL-S v2 section 4, should You produce hardware based on    #
+#    these sources, You must maintain the Source Location clearly visible on   #
+#    the external case of the CNC Controller or other product you make using   #
+#                                  this Source.                                #
+#                                                                              #
+#                For more information, email info@buildbotics.com              #
+#                                                                              #
+################################################################################
+
+from collections import deque
+
+import os
+import json
+import gzip
+import shutil
+import struct
+
+__all__ = ['CommandCache', 'CommandCacheWriter', 'check_command_cache',
+           'same_position']
+
+
+# Preplanned planner blocks, streamed by Planner instead of planning the
+# program again.  The file is a header followed by gzip compressed records:
+#
+#   'BBCC' <u16 version> <u32 length> <meta JSON>
+#   'L' <u32 id> <u8 axes> <u8 times> <u8 flags> <f32 exit-vel>
+#       <f32 max-accel> <f32 max-jerk> <f32 target>... <f32 time>...
+#       [<u16 count> (<f64 dist> <f64 speed>)...]
+#   'J' <u32 length> <block JSON>
+#
+# 'L' records are line blocks.  The axes and times masks select the targets
+# and nonzero S-curve times stored.  Values are stored as the f32 the
+# firmware receives, with times in minutes, so cached lines encode to the
+# same commands.  Sync speeds stay f64 as raster and sync speed commands are
+# computed from them on the host.  Other blocks are 'J' records.  The meta
+# holds the planner config, start position, bounds and the machine variables
+# the program read, which must match for the blocks to be streamed.
+
+MAGIC   = b'BBCC'
+VERSION = 2
+
+HEADER = struct.Struct('<4sHI')
+LINE   = struct.Struct('<IBBB3f')
+COUNT  = struct.Struct('<H')
+LENGTH = struct.Struct('<I')
+
+POSITION_TOLERANCE = 1e-4 # mm or degrees
+
+AXES      = 'xyzabc'
+LINE_KEYS = set(('type', 'id', 'target', 'exit-vel', 'max-accel', 'max-jerk',
+                 'times', 'speeds', 'first', 'seeking', 'rapid'))
+FLAGS     = ('first', 'seeking', 'rapid') # Present bits 0-2, values bits 3-5
+SPEEDS    = 1 << 6
+
+
+def _is_number(x):
+    return isinstance(x, (int, float)) and not isinstance(x, bool)
+
+
+def _floats(values):
+    return struct.pack('<%df' % len(values), *values)
+
+
+def _doubles(values):
+    return struct.pack('<%dd' % len(values), *values)
+
+
+def _encode_line(block):
+    # Returns None if the block does not fit an 'L' record
+    if not LINE_KEYS.issuperset(block) or not 0 <= block['id'] < 1 << 32:
+        return
+
+    target, times = block['target'], block['times']
+    if not set(AXES).issuperset(target) or len(times) != 7: return
+
+    header = [block['exit-vel'], block['max-accel'], block['max-jerk']]
+    values = []
+    axes = tmask = flags = 0
+
+    for i, axis in enumerate(AXES):
+        if axis in target:
+            axes |= 1 << i
+            values.append(target[axis])
+
+    for i, t in enumerate(times):
+        if t:
+            tmask |= 1 << i
+            values.append(t / 60000) # To mins, as sent
+
+    for i, name in enumerate(FLAGS):
+        if name in block:
+            if not isinstance(block[name], bool): return
+            flags |= 1 << i
+            if block[name]: flags |= 8 << i
+
+    speeds = []
+    if 'speeds' in block:
+        if 0xffff < len(block['speeds']): return
+        flags |= SPEEDS
+
+        for pair in block['speeds']:
+            if len(pair) != 2: return
+            speeds += pair
+
+    if not all(_is_number(x) for x in header + values + speeds): return
+
+    try:
+        data = b'L' + LINE.pack(block['id'], axes, tmask, flags, *header)
+        data += _floats(values)
+    except OverflowError: return # Out of f32 range
+    if flags & SPEEDS:
+        data += COUNT.pack(len(speeds) // 2) + _doubles(speeds)
+
+    return data
+
+
+def _encode(block):
+    data = _encode_line(block) if block['type'] == 'line' else None
+    if data is not None: return data
+
+    data = json.dumps(block, separators = (',', ':')).encode('utf-8')
+    return b'J' + LENGTH.pack(len(data)) + data
+
+
+def _read(f, size):
+    data = f.read(size)
+    if len(data) != size: raise EOFError('Truncated command cache')
+    return data
+
+
+def _read_floats(f, count):
+    return list(struct.unpack('<%df' % count, _read(f, 4 * count)))
+
+
+def _read_doubles(f, count):
+    return list(struct.unpack('<%dd' % count, _read(f, 8 * count)))
+
+
+def _decode(f):
+    tag = f.read(1)
+    if not tag: return # End of file
+
+    if tag == b'J':
+        size, = LENGTH.unpack(_read(f, LENGTH.size))
+        return json.loads(_read(f, size).decode('utf-8'))
+
+    if tag != b'L': raise ValueError('Invalid command cache record')
+
+    id, axes, tmask, flags, exitVel, maxAccel, maxJerk = \
+        LINE.unpack(_read(f, LINE.size))
+
+    names = [axis for i, axis in enumerate(AXES) if axes & (1 << i)]
+    slots = [i for i in range(7) if tmask & (1 << i)]
+    values = _read_floats(f, len(names) + len(slots))
+
+    times = [0] * 7
+    for i, t in zip(slots, values[len(names):]): times[i] = t * 60000
+
+    block = {
+        'type': 'line',
+        'id': id,
+        'target': dict(zip(names, values)),
+        'exit-vel': exitVel,
+        'max-accel': maxAccel,
+        'max-jerk': maxJerk,
+        'times': times,
+    }
+
+    for i, name in enumerate(FLAGS):
+        if flags & (1 << i): block[name] = bool(flags & (8 << i))
+
+    if flags & SPEEDS:
+        count, = COUNT.unpack(_read(f, COUNT.size))
+        speeds = _read_doubles(f, 2 * count)
+        block['speeds'] = [speeds[i:i + 2] for i in range(0, len(speeds), 2)]
+
+    return block
+
+
+def _read_meta(f):
+    magic, version, size = HEADER.unpack(_read(f, HEADER.size))
+
+    if magic != MAGIC or version != VERSION:
+        raise ValueError('Unsupported command cache')
+
+    return json.loads(_read(f, size).decode('utf-8'))
+
+
+def same_position(a, b):
+    '''True if positions a and b have the same axes and are within
+    POSITION_TOLERANCE on each.'''
+    if set(a) != set(b): return False
+    return all(abs(a[axis] - b[axis]) <= POSITION_TOLERANCE for axis in a)
+
+
+def check_command_cache(meta, position, config, get_var):
+    '''Returns why the cached blocks cannot be used, or None if they can.'''
+    if not same_position(meta['position'], position):
+        return 'start position changed'
+
+    config = dict(config)
+    minLimit = config.pop('min-soft-limit', {})
+    maxLimit = config.pop('max-soft-limit', {})
+
+    if meta['config'] != config: return 'planner config changed'
+
+    # Soft limits do not change the plan, only whether it is allowed
+    bounds = meta['bounds']
+    for axis, value in bounds['min'].items():
+        if value < minLimit.get(axis, -float('inf')): return 'soft limits'
+    for axis, value in bounds['max'].items():
+        if maxLimit.get(axis, float('inf')) < value: return 'soft limits'
+
+    for name, value in meta['vars'].items():
+        if get_var(name) != value: return 'variable %s changed' % name
+
+
+class CommandCacheWriter(object):
+    def __init__(self, path):
+        self.path = path
+        self.body = gzip.open(path + '.tmp', 'wb')
+
+
+    def add(self, block): self.body.write(_encode(block))
+
+
+    def close(self, meta):
+        '''Write the cache file, or discard it if meta is None.'''
+        self.body.close()
+        tmp = self.path + '.tmp'
+
+        try:
+            if meta is None: return
+
+            data = json.dumps(meta, separators = (',', ':')).encode('utf-8')
+
+            with open(self.path, 'wb') as f:
+                f.write(HEADER.pack(MAGIC, VERSION, len(data)) + data)
+                with open(tmp, 'rb') as body: shutil.copyfileobj(body, f)
+
+        finally: os.unlink(tmp)
+
+
+class CommandCache(object):
+    '''Streams cached blocks with the same calls as camotics.Planner.  Block
+    IDs are renumbered to follow on from the IDs already sent.'''
+
+    def __init__(self, path, first_id):
+        self.f = open(path, 'rb')
+        self.meta = _read_meta(self.f)
+        self.body = gzip.GzipFile(fileobj = self.f, mode = 'rb')
+        self.block = _decode(self.body)
+        self.first_id = first_id
+        self.last_id = None # Last ID streamed
+        if self.block is not None: self.offset = first_id - self.block['id']
+
+
+    @staticmethod
+    def read_meta(path):
+        with open(path, 'rb') as f: return _read_meta(f)
+
+
+    def close(self):
+        self.body.close()
+        self.f.close()
+
+
+    def has_more(self): return self.block is not None
+    def is_running(self): return self.block is not None
+
+
+    def next(self):
+        block, self.block = self.block, _decode(self.body)
+        block['id'] += self.offset
+        self.last_id = block['id']
+        return block
@@ -53,7 +53,7 @@ class CommandQueue():
 
 
     def enqueue(self, id, cb, *args, **kwargs):
-        self.log.info('add(#%d) releaseID=%d', id, self.releaseID)
+        self.log.trace('add(#%d) releaseID=%d', id, self.releaseID)
         self.lastEnqueueID = id
         self.q.append([id, cb, args, kwargs])
         self._release()
@@ -66,7 +66,7 @@ class CommandQueue():
             # Execute commands <= releaseID
             if util.id16_less(self.releaseID, id): return
 
-            self.log.info('releasing id=%d' % id)
+            self.log.trace('releasing id=%d', id)
             self.q.popleft()
 
             try:
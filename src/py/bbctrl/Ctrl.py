@@ -128,8 +128,11 @@ class Ctrl:
     def configure(self):
         # Called from Comm.py after AVR vars are loaded
         # Indirectly configures state via calls to config() and the AVR
-        self.config.reload()
-        self.state.init()
+        self.mach.begin_bulk()
+        try:
+            self.config.reload()
+            self.state.init()
+        finally: self.mach.end_bulk()
         self.mach.set('be', 1) # Enable buffers
 
 
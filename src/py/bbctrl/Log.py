@@ -28,7 +28,11 @@
 import os
 import sys
 import io
+import time
+import atexit
+import threading
 import traceback
+from collections import deque
 from inspect import getframeinfo, stack
 
 from . import util
@@ -36,6 +40,10 @@ from . import util
 __all__ = ['Log']
 
 
+TRACE_MAX = 100000    # Trace records held while waiting for the writer
+WRITE_INTERVAL = 0.1  # Seconds between background writes
+
+
 class Logger(object):
     def __init__(self, log, name, level):
         self.log = log
@@ -67,7 +75,8 @@ class Logger(object):
     def _log(self, level, msg, *args, **kwargs):
         if not self._enabled(level): return
 
-        if not 'where' in kwargs:
+        # Only messages sent to listeners use the caller
+        if not 'where' in kwargs and level != Log.INFO:
             filename, line, func = self._find_caller()
             kwargs['where'] = '%s:%d' % (os.path.basename(filename), line)
 
@@ -83,6 +92,13 @@ class Logger(object):
     def error  (self, *args, **kwargs): self._log(Log.ERROR,   *args, **kwargs)
 
 
+    def trace(self, msg, *args):
+        '''Log at info level, formatting later in the writer thread.  msg is
+        a format string or a function of args, which must not be modified
+        after the call.'''
+        if self._enabled(Log.INFO): self.log.trace(self.name, msg, args)
+
+
     def exception(self, *args, **kwargs):
         msg = traceback.format_exc()
         if len(args): msg = args[0] % args[1:] + '\n' + msg
@@ -106,10 +122,19 @@ class Log(object):
 
         self.level = self.DEBUG if args.verbose else self.INFO
 
+        # Log lines and trace records, written by a background thread
+        self.queue = deque()
+        self.dropped = 0
+        self.write_lock = threading.Lock()
+
         # Open log, rotate if necessary
         self.f = None
         self._open()
 
+        thread = threading.Thread(target = self._writer, daemon = True)
+        thread.start()
+        atexit.register(self.flush)
+
         # Log header
         self._log('Log started v%s' % util.get_version())
         self._log_time(ioloop)
@@ -136,20 +161,59 @@ class Log(object):
         for listener in self.listeners: listener(msg)
 
 
+    def trace(self, prefix, msg, args):
+        if TRACE_MAX <= len(self.queue): self.dropped += 1
+        else: self.queue.append((prefix, msg, args))
+
+
+    def _format(self, item):
+        if isinstance(item, str): return item
+
+        prefix, msg, args = item
+        try:
+            msg = msg(*args) if callable(msg) else msg % args
+        except Exception as e: msg = 'Trace format failed: %s' % e
+
+        hdr = 'I:%s:' % prefix
+        return hdr + ('\n' + hdr).join(msg.split('\n'))
+
+
+    def flush(self):
+        '''Write queued log lines now, e.g. before reading the log file.'''
+        with self.write_lock:
+            lines = []
+            while self.queue: lines.append(self._format(self.queue.popleft()))
+
+            dropped, self.dropped = self.dropped, 0
+            if dropped: lines.append('W:Log:%d trace records dropped' % dropped)
+
+            if not lines: return
+            s = '\n'.join(lines) + '\n'
+
+            if self.f is not None:
+                if 1e22 <= self.bytes_written + len(s): self._open()
+                self.f.write(s)
+                self.f.flush()
+                self.bytes_written += len(s)
+
+            sys.stdout.write(s)
+
+
+    def _writer(self):
+        while True:
+            time.sleep(WRITE_INTERVAL)
+
+            try:
+                self.flush()
+            except Exception: pass
+
+
     def _log(self, msg, level = INFO, prefix = '', where = None, time = False):
         if not msg: return
 
         hdr = '%s:%s:' % ('DIMWE'[level], prefix)
         if time: hdr += util.timestamp() + ':'
-        s = hdr + ('\n' + hdr).join(msg.split('\n'))
-
-        if self.f is not None:
-            if 1e22 <= self.bytes_written + len(s) + 1: self._open()
-            self.f.write(s + '\n')
-            self.f.flush()
-            self.bytes_written += len(s) + 1
-
-        print(s)
+        self.queue.append(hdr + ('\n' + hdr).join(msg.split('\n')))
 
         # Broadcast to log listeners
         if level == self.INFO: return
@@ -60,6 +60,7 @@ class Mach(Comm):
         self.unpausing = False
         self.stopping = False
         self.next_jog_id = 1
+        self.bulk = None
 
         ctrl.state.set('cycle', 'idle')
         ctrl.state.add_listener(self._update)
@@ -208,9 +209,34 @@ class Mach(Comm):
 
 
     def set(self, code, value):
+        if self.bulk is not None:
+            info = self.ctrl.state.get_machine_var_info(code)
+            if info is not None and info[2] not in ('str', 'pstr') and \
+                    isinstance(value, (int, float)):
+                self.bulk.append(info + (value,))
+                return
+
+            # Send earlier bulk sets first to keep sets in order
+            self._flush_bulk()
+
         super().queue_command('${}={}'.format(code, value))
 
 
+    def _flush_bulk(self):
+        for cmd in Cmd.bulk(self.bulk): super().queue_command(cmd)
+        self.bulk = []
+
+
+    def begin_bulk(self):
+        # Collect var sets until end_bulk() and send them in bulk commands
+        self.bulk = []
+
+
+    def end_bulk(self):
+        self._flush_bulk()
+        self.bulk = None
+
+
     def step(self): raise Exception('NYI') # TODO
 
 
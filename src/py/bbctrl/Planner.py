@@ -29,10 +29,13 @@ import json
 import math
 import re
 import time
+import threading
+import traceback
 from collections import deque
 
 from . import Cmd
 from .CommandQueue import *
+from .CommandCache import *
 
 try:
     from . import camotics # pylint: disable=no-name-in-module,import-error
@@ -42,6 +45,9 @@ except:
 __all__ = ['Planner']
 
 
+READY_MAX = 64 # Encoded commands planned ahead of the serial port
+
+
 reLogLine = re.compile(
     r'^(?P<level>[A-Z])[0-9 ]:'
     r'((?P<file>[^:]+):)?'
@@ -58,9 +64,25 @@ def log_floats(o):
 
 
 def log_json(o): return json.dumps(log_floats(o))
+def _log_block(block): return 'Cmd:' + log_json(block)
 
 
 class Planner():
+    '''
+    Plans and encodes commands in a worker thread, ahead of the serial port,
+    so slow planning does not hold up the IOLoop.  The camotics planner is
+    only used by the worker.  The IOLoop passes it messages and takes encoded
+    commands from the ready queue, applying each block's side effects, such as
+    queued state changes, as its command is sent.  Records from before a stop,
+    restart or reset are dropped by generation.  With --sync-planner the
+    worker's steps run in the IOLoop instead, as needed.
+
+    Files are streamed from the Preplanner's command cache when it was planned
+    from the same start state, falling back to live planning on restart.
+    Cached blocks are renumbered to follow the IDs already sent and live
+    planner IDs are offset to follow the cached ones, so IDs always increase.
+    '''
+
     def __init__(self, ctrl):
         self.ctrl          = ctrl
         self.log           = ctrl.log.get('Planner')
@@ -69,6 +91,30 @@ class Planner():
         self.planner       = None
         self.where         = ''
 
+        # Shared with the worker
+        self.cond       = threading.Condition()
+        self.messages   = deque()
+        self.ready      = deque() # (generation, block, cmd or error)
+        self.seq        = 0       # Messages sent
+        self.generation = 0
+        self.status     = (0, False) # Worker's (seq, is_running)
+
+        # Worker only
+        self.worker_gen = 0
+        self.planning   = False
+        self.cache      = None    # CommandCache being streamed
+        self.cache_load = None    # Its (position, path, config)
+        self.pending    = deque() # Loads waiting for the cache to finish
+        self.last_id    = 0       # Last block ID planned
+        self.id_offset  = 0       # Live planner to block IDs, see _close_cache()
+        self.live_id    = 0       # Last live planner ID
+
+        self.threaded = not ctrl.args.sync_planner
+        if self.threaded:
+            self.thread = threading.Thread(target = self._worker)
+            self.thread.daemon = True
+            self.thread.start()
+
         ctrl.state.add_listener(self._update)
 
         try:
@@ -82,7 +128,9 @@ class Planner():
 
 
     def is_running(self):
-        return self.planner is not None and self.planner.is_running()
+        # Assume running until the worker has seen all messages
+        seq, running = self.status
+        return running or seq != self.seq or 0 < len(self.ready)
 
 
     def get_config(self, with_start, with_limits):
@@ -140,8 +188,8 @@ class Planner():
     def _update(self, update):
         if 'id' in update:
             id = update['id']
-            self.planner.set_active(id) # Release planner commands
-            self.cmdq.release(id)       # Synchronize planner variables
+            self.cmdq.release(id)           # Synchronize planner variables
+            self._send('set_active', id)    # Release planner commands
 
 
     def _get_var_cb(self, name, units):
@@ -182,6 +230,11 @@ class Planner():
         else: self.log.error('Could not parse planner log line: ' + line)
 
 
+    def _worker_log_cb(self, line):
+        # Log listeners run on the IOLoop
+        self.ctrl.ioloop.add_callback(self._log_cb, line)
+
+
     def _add_message(self, text):
         self.ctrl.state.add_message(text)
 
@@ -193,7 +246,7 @@ class Planner():
 
 
     def _enqueue_set_cmd(self, id, name, value):
-        self.log.info('set(#%d, %s, %s)', id, name, value)
+        self.log.trace('set(#%d, %s, %s)', id, name, value)
         self.cmdq.enqueue(id, self.ctrl.state.set, name, value)
 
 
@@ -240,37 +293,30 @@ class Planner():
         self.plan_time += block['seconds']
 
 
-    def __encode(self, block):
-        type, id = block['type'], block['id']
+    def _get_power_scale(self):
+        # Speed corresponding to 8-bit power 255 or None for full resolution
+        config = self.ctrl.config
+        if config.get('tool-type') != 'PWM Spindle': return
+        if not config.get('quantize-power'): return
+        return config.get('max-spin')
 
-        if type == 'start': return # ignore
 
-        if type != 'set': self.log.info('Cmd:' + log_json(block))
+    def _encode_block(self, block):
+        # Called by the worker, must not change controller state
+        type = block['type']
 
         if type == 'line':
-            self._enqueue_line_time(block)
-            return Cmd.line(block['target'], block['exit-vel'],
-                            block['max-accel'], block['max-jerk'],
-                            block['times'], block.get('speeds', []))
+            return Cmd.encoder.line(block['target'], block['exit-vel'],
+                                    block['max-accel'], block['max-jerk'],
+                                    block['times'], block.get('speeds', []),
+                                    self._get_power_scale())
 
         if type == 'set':
             name, value = block['name'], block['value']
 
-            if name == 'message':
-                self.cmdq.enqueue(id, self._add_message, value)
-
-            if name in ['line', 'tool']: self._enqueue_set_cmd(id, name, value)
-
-            if name == 'speed':
-                self._enqueue_set_cmd(id, name, value)
-                return Cmd.speed(value)
-
-            if len(name) and name[0] == '_':
-                # Don't queue axis positions, can be triggered by new position
-                if len(name) != 2 or name[1] not in 'xyzabc':
-                    self._enqueue_set_cmd(id, name[1:], value)
+            if name == 'speed': return Cmd.speed(value)
 
-            if name == '_feed': # Must come after _enqueue_set_cmd() above
+            if name == '_feed':
                 return Cmd.set_sync('if', 1 / value if value else 0)
 
             if name[0:1] == '_' and name[1:2] in 'xyzabc':
@@ -289,30 +335,58 @@ class Planner():
         if type == 'output':
             return Cmd.output(block['port'], int(float(block['value'])))
 
-        if type == 'dwell':
-            self._enqueue_dwell_time(block)
-            return Cmd.dwell(block['seconds'])
-
+        if type == 'dwell': return Cmd.dwell(block['seconds'])
         if type == 'pause': return Cmd.pause(block['pause-type'])
 
         if type == 'seek':
             sw = self.ctrl.state.get_switch_id(block['switch'])
             return Cmd.seek(sw, block['active'], block['error'])
 
-        if type == 'end':
-            self.cmdq.enqueue(id, self._end_program, 'Program end')
-            return '' # Blank command still sends command id
+        if type == 'end': return '' # Blank command still sends command id
 
         raise Exception('Unknown planner command "%s"' % type)
 
 
     def _encode(self, block):
-        cmd = self.__encode(block)
+        if block['type'] == 'start': return # ignore
+
+        cmd = self._encode_block(block)
+        if cmd is None: return
+
+        # Line commands are already bytes, see Cmd.Encoder
+        if isinstance(cmd, str): cmd = cmd.encode('utf-8')
+        id = Cmd.set_sync('id', block['id']).encode('utf-8')
+        return id + b'\n' + cmd
+
+
+    def _apply(self, block):
+        # Called on the IOLoop as the block's command is sent
+        type, id = block['type'], block['id']
+
+        if type == 'start': return # ignore
+
+        if type != 'set': self.log.trace(_log_block, block)
+
+        if type == 'line': self._enqueue_line_time(block)
 
-        if cmd is not None:
-            # Enqueue id with no callback to track command activity
-            self.cmdq.enqueue(block['id'], None)
-            return Cmd.set_sync('id', block['id']) + '\n' + cmd
+        if type == 'set':
+            name, value = block['name'], block['value']
+
+            if name == 'message':
+                self.cmdq.enqueue(id, self._add_message, value)
+
+            if name in ['line', 'tool', 'speed']:
+                self._enqueue_set_cmd(id, name, value)
+
+            if len(name) and name[0] == '_':
+                # Don't queue axis positions, can be triggered by new position
+                if len(name) != 2 or name[1] not in 'xyzabc':
+                    self._enqueue_set_cmd(id, name[1:], value)
+
+        if type == 'dwell': self._enqueue_dwell_time(block)
+
+        if type == 'end':
+            self.cmdq.enqueue(id, self._end_program, 'Program end')
 
 
     def reset_times(self):
@@ -324,24 +398,20 @@ class Planner():
 
     def close(self):
         # Release planner callbacks
-        if self.planner is not None:
-            self.planner.set_resolver(None)
-            camotics.set_logger(None)
+        self._send('close')
+        if self.threaded: self.thread.join(1)
 
 
     def reset(self, stop = True):
         self._end_program('Program reset', True)
         if stop: self.ctrl.mach.stop()
-        self.planner = camotics.Planner()
-        self.planner.set_resolver(self._get_var_cb)
-        # TODO logger is global and will not work correctly in demo mode
-        camotics.set_logger(self._log_cb, 1, 'LinePlanner:3')
+        self._send('reset', new_generation = True)
         self.cmdq.clear()
         self.reset_times()
         self.ctrl.state.reset()
 
 
-    def result(self, result): self.planner.synchronize(result)
+    def result(self, result): self._send('synchronize', result)
 
 
     def _end_program(self, msg = None, end_all = False):
@@ -361,55 +431,319 @@ class Planner():
         self.where = path
         self.log.info('Start: ' + path, time = True)
         self.ctrl.state.set('active_program', path)
-        # Sync position
-        self.planner.set_position(self.ctrl.state.get_position())
 
         config = self.get_config(with_start, with_limits)
-        if mdi is not None: self.planner.load_string(mdi, config)
-        else: self.planner.load(self.ctrl.fs.realpath(path), config)
+        position = self.ctrl.state.get_position() # Sync position
+        cache = None
+
+        if mdi is None:
+            # Only when no other program is loaded
+            if len(self.end_callbacks) == 1:
+                cache = self._get_command_cache(path, position, config)
+
+            path = self.ctrl.fs.realpath(path)
+
+        self._send('load', position, path, mdi, config, cache)
 
         self.reset_times()
 
 
-    def stop(self):
+    def _get_command_cache(self, path, position, config):
+        if self.ctrl.args.disable_command_cache: return
+
+        path = self.ctrl.preplanner.get_commands(path)
+        if path is None: return
+
+        def get_var(name): return self.ctrl.state.get(name, 0)
+
         try:
-            self.planner.stop()
-            self.cmdq.clear()
-            self._end_program('Program stop', True)
+            meta = CommandCache.read_meta(path)
+            reason = check_command_cache(meta, position, config, get_var)
 
         except:
             self.log.exception()
-            self.reset()
+            return
 
+        if reason is not None:
+            self.log.info('Not using preplanned commands: ' + reason)
+            return
 
-    def restart(self):
-        try:
-            id = self.ctrl.state.get('id')
-            position = self.ctrl.state.get_position()
+        self.log.info('Using preplanned commands')
+        return path
 
-            self.log.info('Planner restart: %d %s' % (id, log_json(position)))
 
-            self.cmdq.clear()
-            self.cmdq.release(id)
-            self._plan_time_restart()
-            self.planner.restart(id, position)
+    def stop(self):
+        self._send('stop', new_generation = True)
+        self.cmdq.clear()
+        self._end_program('Program stop', True)
 
-        except:
-            self.log.exception()
-            self.stop()
+
+    def restart(self):
+        id = self.ctrl.state.get('id')
+        position = self.ctrl.state.get_position()
+
+        self.log.info('Planner restart: %d %s' % (id, log_json(position)))
+
+        self.cmdq.clear()
+        self.cmdq.release(id)
+        self._plan_time_restart()
+        self._send('restart', id, position, new_generation = True)
 
 
     def next(self):
-        try:
+        if not self.threaded: self._fill()
+
+        while True:
+            with self.cond:
+                if not len(self.ready): return
+                generation, block, cmd = self.ready.popleft()
+                self.cond.notify() # Room to plan ahead
+
+            if generation != self.generation: continue # Before stop or restart
+
+            if block is None:
+                self.log.error(cmd)
+                self.stop()
+                return
+
+            try:
+                self._apply(block)
+
+            except:
+                self.log.exception()
+                self.stop()
+                return
+
+            if cmd is not None:
+                # Enqueue id with no callback to track command activity
+                self.cmdq.enqueue(block['id'], None)
+                return cmd
+
+
+    def _send(self, *msg, new_generation = False):
+        with self.cond:
+            self.seq += 1
+
+            if new_generation:
+                self.generation += 1
+                self.ready.clear()
+
+            self.messages.append((self.seq, self.generation) + msg)
+            self.cond.notify()
+
+        if not self.threaded: self._receive()
+
+
+    def _failed(self, generation, name, msg):
+        self.log.error(msg)
+        if generation != self.generation: return
+
+        if name == 'stop': self.reset()
+        elif name not in ('reset', 'close'): self.stop()
+
+
+    def _load(self, position, path, mdi, config, cache):
+        if cache is not None:
+            try:
+                self.cache = CommandCache(cache, self.last_id + 1)
+                self.cache_load = (position, path, config)
+                return
+
+            except:
+                self.cache = None
+                self.log.info('Reading command cache failed, planning: ' +
+                              traceback.format_exc())
+
+        self.planner.set_position(position)
+        if mdi is not None: self.planner.load_string(mdi, config)
+        else: self.planner.load(path, config)
+
+
+    def _close_cache(self):
+        # Returns loads waiting for the cache
+        if self.cache is not None:
+            self.cache.close()
+
+            # Number live planner blocks after the cached ones
+            if self.cache.last_id is not None:
+                self.id_offset = self.cache.last_id - self.live_id
+
+        self.cache = None
+
+        pending, self.pending = self.pending, deque()
+        return pending
+
+
+    def _planner_id(self, id):
+        # Live planner ID of a 16-bit firmware ID
+        return (id - self.id_offset) & 0xffff
+
+
+    def _plan_to(self, id):
+        '''Replaces the cache with live planning up to firmware command id.'''
+        position, path, config = self.cache_load
+        first, last = self.cache.first_id, self.cache.last_id
+        pending = self._close_cache()
+
+        self.planner.set_position(position)
+        self.planner.load(path, config)
+
+        # Live blocks take the IDs of the cached blocks they replace
+        self.id_offset = first - self.live_id - 1
+
+        # Skip to the 16-bit firmware ID, at or before the last sent
+        if last is not None:
+            target = last - ((last - id) & 0xffff)
+            start = True
+
             while self.planner.has_more():
-                cmd = self._encode(self.planner.next())
-                if cmd is not None: return cmd
+                block = self.planner.next()
+                if start: self.id_offset = first - block['id']
+                start = False
+
+                self.live_id = block['id']
+                self.planner.set_active(block['id'])
+                if target <= block['id'] + self.id_offset: break
+
+        for args in pending: self._load(*args)
+
+
+    def _handle(self, name, *args):
+        if name == 'reset':
+            self._close_cache()
+            self.planner = camotics.Planner()
+            self.last_id = self.id_offset = self.live_id = 0
+            self.planner.set_resolver(self._get_var_cb)
+            # TODO logger is global and will not work correctly in demo mode
+            camotics.set_logger(self._worker_log_cb if self.threaded else
+                                self._log_cb, 1, 'LinePlanner:3')
+
+        elif name == 'close':
+            self._close_cache()
+            if self.planner is not None:
+                self.planner.set_resolver(None)
+                camotics.set_logger(None)
+
+        elif name == 'set_active':
+            # Cached blocks are not known to the live planner
+            if self.cache is None:
+                self.planner.set_active(self._planner_id(args[0]))
+
+        elif name == 'synchronize': self.planner.synchronize(*args)
+
+        elif name == 'stop':
+            self._close_cache()
+            self.planner.stop()
+
+        elif name == 'restart':
+            id, position = args
+            if self.cache is not None: self._plan_to(id)
+            self.planner.restart(self._planner_id(id), position)
+
+        elif name == 'load':
+            if self.cache is not None and self.cache.has_more():
+                self.pending.append(args)
+
+            else:
+                self._close_cache()
+                self._load(*args)
+
+
+    def _receive(self):
+        '''Handle queued messages in the worker, returns False on close.'''
+        with self.cond:
+            messages, self.messages = self.messages, deque()
+
+        for seq, generation, name, *args in messages:
+            self.worker_gen = generation
+            self.planning = True
+
+            try:
+                self._handle(name, *args)
+
+            except:
+                self.ctrl.ioloop.add_callback(self._failed, generation, name,
+                                              traceback.format_exc())
+
+            if name == 'close': return False
+
+            self._publish(seq)
+
+        return True
+
+
+    def _publish(self, seq = None):
+        if seq is None: seq = self.status[0]
+
+        if self.cache is not None:
+            running = self.cache.is_running() or 0 < len(self.pending)
+        else: running = self.planner is not None and self.planner.is_running()
+
+        self.status = (seq, running)
+
+
+    def _step(self):
+        '''Plan and encode one block, returns the record or None.'''
+        try:
+            if self.cache is not None and not self.cache.has_more() and \
+               len(self.pending):
+                for args in self._close_cache(): self._load(*args)
+
+            source = self.planner if self.cache is None else self.cache
+
+            if not source.has_more():
+                self.planning = False
+                return
+
+            block = source.next()
+
+            if source is self.planner:
+                self.live_id = block['id']
+                block['id'] += self.id_offset
+
+            self.last_id = block['id']
+            record = (self.worker_gen, block, self._encode(block))
 
         except RuntimeError as e:
             # Pass on the planner message
-            self.log.error(str(e))
-            self.stop()
+            record = (self.worker_gen, None, str(e))
 
         except:
-            self.log.exception()
-            self.stop()
+            record = (self.worker_gen, None, traceback.format_exc())
+
+        if record[1] is None: self.planning = False
+
+        with self.cond:
+            empty = not len(self.ready)
+            self.ready.append(record)
+
+        # Wake the serial port
+        if empty and self.threaded:
+            self.ctrl.ioloop.add_callback(self.ctrl.mach.flush)
+
+        return record
+
+
+    def _fill(self):
+        # Plan up to the next command, as Planner.next() did without a worker
+        self._receive()
+
+        while self.planning:
+            record = self._step()
+            if record is not None and record[2] is not None: break
+
+        self._publish()
+
+
+    def _worker(self):
+        while True:
+            with self.cond:
+                while not len(self.messages) and \
+                      not (self.planning and len(self.ready) < READY_MAX):
+                    self.cond.wait()
+
+            if not self._receive(): return
+
+            if self.planning and len(self.ready) < READY_MAX:
+                self._step()
+                self._publish()
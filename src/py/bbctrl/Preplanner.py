@@ -37,10 +37,14 @@ from concurrent.futures import Future
 from tornado import gen, process, iostream
 
 from . import util
+from .CommandCache import same_position
 
 __all__ = ['Preplanner']
 
 
+START_VARS = ('cycle', 'metric') + tuple(axis + 'p' for axis in 'xyzabc')
+
+
 def hash_dump(o):
     s = json.dumps(o, separators = (',', ':'), sort_keys = True)
     return s.encode('utf8')
@@ -60,6 +64,22 @@ def plan_hash(path, config):
     return h.hexdigest()
 
 
+def start_hash(start):
+    return hashlib.sha256(hash_dump(start)).hexdigest()[:16]
+
+
+def same_start(a, b):
+    return a['units'] == b['units'] and \
+        same_position(a['position'], b['position'])
+
+
+def oldest(paths, max):
+    '''Returns all but the newest max paths.'''
+    if len(paths) <= max: return []
+    paths = sorted(paths, key = os.path.getmtime)
+    return paths[:len(paths) - max]
+
+
 def safe_remove(path):
     try:
         os.unlink(path)
@@ -67,8 +87,10 @@ def safe_remove(path):
 
 
 class Plan(object):
-    def __init__(self, preplanner, ctrl, path):
+    def __init__(self, preplanner, ctrl, path, start = None):
         self.preplanner = preplanner
+        self.path = path
+        self.start = start # Plan the command cache from here, not the preview
 
         # Copy planner state
         self.state = ctrl.state.snapshot()
@@ -83,10 +105,15 @@ class Plan(object):
         self.base = '%s/plans/%s' % (ctrl.root, os.path.basename(path))
         self.hid = plan_hash(self.gcode, self.config)
         fbase = '%s.%s.' % (self.base, self.hid)
-        self.files = [
-            fbase + 'json',
-            fbase + 'positions.gz',
-            fbase + 'speeds.gz']
+
+        if start is not None:
+            self.files = [fbase + start_hash(start) + '.commands.gz']
+
+        else:
+            self.files = [
+                fbase + 'json',
+                fbase + 'positions.gz',
+                fbase + 'speeds.gz']
 
         self.future = Future()
         ctrl.ioloop.add_callback(self._load)
@@ -110,6 +137,10 @@ class Plan(object):
     def _read(self):
         if self.cancel: return
 
+        if self.start is not None:
+            if self._exists(): return self.files[0]
+            return
+
         try:
             with open(self.files[0], 'r')  as f: meta = json.load(f)
             with open(self.files[1], 'rb') as f: positions = f.read()
@@ -138,6 +169,9 @@ class Plan(object):
                 '--max-loop=%s' % self.preplanner.max_loop_time
             )
 
+            if self.start is not None:
+                cmd += ('--commands=' + json.dumps(self.start),)
+
             self.preplanner.log.info('Running: %s', cmd)
 
             proc = process.Subprocess(cmd, stdout = process.Subprocess.STREAM,
@@ -166,9 +200,15 @@ class Plan(object):
                 proc.stdout.close()
 
             if not self.cancel:
-                shutil.move(tmpdir + '/meta.json',    self.files[0])
-                shutil.move(tmpdir + '/positions.gz', self.files[1])
-                shutil.move(tmpdir + '/speeds.gz',    self.files[2])
+                if self.start is None:
+                    shutil.move(tmpdir + '/meta.json',    self.files[0])
+                    shutil.move(tmpdir + '/positions.gz', self.files[1])
+                    shutil.move(tmpdir + '/speeds.gz',    self.files[2])
+
+                # Not written if the program cannot be cached
+                elif os.path.exists(tmpdir + '/commands.gz'):
+                    shutil.move(tmpdir + '/commands.gz', self.files[0])
+
                 self.preplanner.clean()
                 os.sync()
 
@@ -204,24 +244,65 @@ class Preplanner(object):
 
         self.started = Future()
         self.plans = {}
+        self.commands = None # Command cache plan of the last previewed file
+        self.timeout = None
 
         ctrl.events.on('invalidate-all', self.invalidate_all)
         ctrl.events.on('invalidate', self.invalidate)
 
+        if not ctrl.args.disable_command_cache:
+            ctrl.state.add_listener(self._update)
+
 
     def clean(self, max = 100):
         plans = glob.glob('%s/plans/*.json' % self.ctrl.root)
-        if len(plans) <= max: return
+        commands = glob.glob('%s/plans/*.commands.gz' % self.ctrl.root)
 
         # Delete oldest plans
-        plans = [(os.path.getmtime(path), path) for path in plans]
-        plans.sort()
-
-        for mtime, path in plans[:len(plans) - max]:
+        for path in oldest(plans, max):
             safe_remove(path)
             safe_remove(path[:-4] + 'positions.gz')
             safe_remove(path[:-4] + 'speeds.gz')
 
+        for path in oldest(commands, max): safe_remove(path)
+
+
+    def _get_start(self):
+        state = self.ctrl.state
+        return dict(position = state.get_position(),
+                    units = 'METRIC' if state.get('metric') else 'IMPERIAL')
+
+
+    def _plan_commands(self, path):
+        # Plan the command cache from the current start state
+        start = self._get_start()
+        plan = self.commands
+
+        if plan is not None:
+            if plan.path == path and same_start(plan.start, start): return
+            plan.terminate()
+
+        self.commands = Plan(self, self.ctrl, path, start)
+
+
+    def _replan_commands(self):
+        self.timeout = None
+        if self.commands is None or self.ctrl.state.get('cycle') != 'idle':
+            return
+
+        self._plan_commands(self.commands.path)
+
+
+    def _update(self, update):
+        # Plan the command cache again once idle after a jog, home or program
+        if self.commands is None: return
+        if not any(name in update for name in START_VARS): return
+
+        if self.timeout is not None:
+            self.ctrl.ioloop.remove_timeout(self.timeout)
+
+        self.timeout = self.ctrl.ioloop.call_later(1, self._replan_commands)
+
 
     def start(self):
         if not self.started.done():
@@ -234,12 +315,20 @@ class Preplanner(object):
             self.plans[path].terminate()
             del self.plans[path]
 
+        if self.commands is not None and self.commands.path == path:
+            self.commands.terminate()
+            self.commands = None
+
 
     def invalidate_all(self):
         for path, plan in self.plans.items():
             plan.terminate()
         self.plans = {}
 
+        if self.commands is not None:
+            self.commands.terminate()
+            self.commands = None
+
 
     @gen.coroutine
     def get_plan(self, path):
@@ -256,8 +345,22 @@ class Preplanner(object):
             self.plans[path] = plan
 
         data = yield plan.future
+
+        # Then the commands the file will most likely be run with
+        if not self.ctrl.args.disable_command_cache:
+            self._plan_commands(path)
+
         return data
 
 
+    def get_commands(self, path):
+        '''Returns the command cache file for path, if it was preplanned.'''
+        plan = self.commands
+
+        if plan is not None and plan.future.done() and \
+           plan.gcode == self.ctrl.fs.realpath(path):
+            return plan.future.result()
+
+
     def get_plan_progress(self, path):
         return self.plans[path].progress if path in self.plans else 0
@@ -46,6 +46,7 @@ class State(object):
         self.listeners = []
         self.timeout = None
         self.machine_var_set = set()
+        self.machine_var_info = {}
         self.message_id = 0
 
         # Defaults
@@ -115,6 +116,14 @@ class State(object):
         self.set('messages', msgs)
 
 
+    def notify(self):
+        '''Notify listeners of changes now instead of after a delay.'''
+        if self.timeout is not None:
+            self.ctrl.ioloop.remove_timeout(self.timeout)
+
+        self._notify()
+
+
     def _notify(self):
         if not self.changes: return
 
@@ -214,11 +223,24 @@ class State(object):
     def set_machine_vars(self, vars):
         # Record all machine vars, indexed or otherwise
         self.machine_var_set = set()
-        for code, spec in vars.items():
+        self.machine_var_info = {}
+
+        for order, (code, spec) in enumerate(vars.items()):
+            type = spec['type'].strip('<>')
+
             if 'index' in spec:
-                for index in spec['index']:
+                for i, index in enumerate(spec['index']):
                     self.machine_var_set.add(str(index) + code)
-            else: self.machine_var_set.add(code)
+                    self.machine_var_info[str(index) + code] = (order, i, type)
+
+            else:
+                self.machine_var_set.add(code)
+                self.machine_var_info[code] = (order, -1, type)
+
+
+    def get_machine_var_info(self, name):
+        # Returns AVR var (order, index, type) as used by bulk config
+        return self.machine_var_info.get(name)
 
 
     def get_position(self):
@@ -78,6 +78,7 @@ class StateHandler(APIHandler):
 
 class LogHandler(RequestHandler):
     def get(self):
+        self.get_ctrl().log.flush()
         with open(self.get_ctrl().log.get_path(), 'r') as f:
             self.write(f.read())
 
@@ -110,6 +111,7 @@ class BugReportHandler(RequestHandler):
             check_add(path, os.path.basename(path))
 
         ctrl = self.get_ctrl()
+        ctrl.log.flush()
         path = ctrl.log.get_path()
         check_add_basename(path)
         for i in range(1, 8):
@@ -68,6 +68,13 @@ def _parse_args():
                         help = 'Enable debug mode and set frequency in seconds')
     parser.add_argument('--fast-emu', action = 'store_true',
                         help = 'Enter demo mode')
+    parser.add_argument('--emu-lib', action = 'store_true',
+                        help = 'Run the demo mode AVR emulator in process')
+    parser.add_argument('--sync-planner', action = 'store_true',
+                        help = 'Plan in the IOLoop instead of a worker thread')
+    parser.add_argument('--disable-command-cache', action = 'store_true',
+                        help = 'Always plan programs again when run instead '
+                        'of using the preplanned commands')
     parser.add_argument('--client-timeout', default = 5 * 60, type = int,
                         help = 'Demo client timeout in seconds')
 
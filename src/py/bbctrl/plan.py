@@ -38,6 +38,7 @@ import gzip
 import struct
 import math
 import bbctrl.camotics as camotics # pylint: disable=no-name-in-module,import-error
+from bbctrl.CommandCache import CommandCacheWriter
 
 
 reLogLine = re.compile(
@@ -80,10 +81,11 @@ def compute_move(start, unit, dist):
 
 
 class Plan(object):
-    def __init__(self, path, state, config):
+    def __init__(self, path, state, config, start = None):
         self.path = path
         self.state = state
         self.config = config
+        self.start = start
 
         self.lines = sum(1 for line in open(path, 'rb'))
 
@@ -91,6 +93,17 @@ class Plan(object):
         self.planner.set_resolver(self.get_var_cb)
         camotics.set_logger(self._log_cb, 1, 'LinePlanner:3')
 
+        # Plan as the controller would from the start state to cache commands
+        # instead of the preview
+        self.commands = None
+        self.cacheable = True
+        if start is not None:
+            self.config['default-units'] = start['units']
+            self.planner.set_position(start['position'])
+            self.commands = CommandCacheWriter('commands.gz')
+            self.vars = {}
+            self.command_bounds = dict(min = {}, max = {})
+
         self.messages = []
         self.levels = dict(I = 'info', D = 'debug', W = 'warning', E = 'error',
                            C = 'critical')
@@ -137,6 +150,7 @@ class Plan(object):
 
         if len(name) and name[0] == '_':
             value = self.state.get(name[1:], 0)
+            if self.commands is not None: self.vars[name[1:]] = value
             if units == 'IMPERIAL': value /= 25.4
 
         return value
@@ -160,6 +174,9 @@ class Plan(object):
 
         self.messages.append(msg)
 
+        # Leave planning with warnings to the controller, which reports them
+        if level in ('warning', 'error', 'critical'): self.cacheable = False
+
 
     def _log_cb(self, line):
         line = line.strip()
@@ -180,6 +197,30 @@ class Plan(object):
         self.log_cb(level, msg, filename, line, column)
 
 
+    def add_command(self, cmd):
+        self.commands.add(cmd)
+
+        if cmd['type'] == 'line':
+            for axis, value in cmd['target'].items():
+                if value < self.command_bounds['min'].get(axis, math.inf):
+                    self.command_bounds['min'][axis] = value
+                if self.command_bounds['max'].get(axis, -math.inf) < value:
+                    self.command_bounds['max'][axis] = value
+
+
+    def save_commands(self):
+        meta = None
+
+        if self.cacheable:
+            meta = dict(
+                config   = self.config,
+                position = self.start['position'],
+                bounds   = self.command_bounds,
+                vars     = self.vars)
+
+        self.commands.close(meta)
+
+
     def progress(self, x):
         if time.time() - self.lastProgressTime < 1 and x != 1: return
         self.lastProgressTime = time.time()
@@ -208,9 +249,12 @@ class Plan(object):
             while self.planner.has_more():
                 cmd = self.planner.next()
                 self.planner.set_active(cmd['id']) # Release plan
+                if self.commands is not None: self.add_command(cmd)
 
                 # Cannot synchronize with actual machine so fake it
-                if self.planner.is_synchronizing(): self.planner.synchronize(0)
+                if self.planner.is_synchronizing():
+                    self.planner.synchronize(0)
+                    self.cacheable = False
 
                 if cmd['type'] == 'line':
                     if not (cmd.get('first', False) or
@@ -274,6 +318,11 @@ class Plan(object):
             self.log_cb('error', str(e), os.path.basename(self.path), line, 0)
 
 
+    def run_commands(self):
+        for move in self._run(): pass
+        self.save_commands()
+
+
     def run(self):
         lastS = 0
         speed = 0
@@ -323,12 +372,18 @@ parser.add_argument('--max-loop', default = 30,
                     type = int, help = 'Maximum time in loop in seconds')
 parser.add_argument('--nice', default = 10,
                     type = int, help = 'Set "nice" process priority')
+parser.add_argument('--commands', help = 'Cache the planned commands from '
+                    'this start state, JSON with position and units, instead '
+                    'of planning the preview')
 
 args = parser.parse_args()
 
 state = json.loads(args.state)
 config = json.loads(args.config)
 
+start = json.loads(args.commands) if args.commands else None
+
 os.nice(args.nice)
-plan = Plan(args.gcode, state, config)
-plan.run()
+plan = Plan(args.gcode, state, config, start)
+if start is None: plan.run()
+else: plan.run_commands()